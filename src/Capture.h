@@ -0,0 +1,36 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Frames sent over the CDC link by a CAPTURE build between DLE c and
+ *  DLE e, in place of the characters the strobes would make: what the
+ *  keyboard put on the data lines and direct keys, and when, without any
+ *  decoding. Shared with the host tools that record and replay them.
+ *
+ *  A frame is a kind byte, which always has bit 7 set so that it cannot be
+ *  taken for the E of the DLE e reply; the raw data lines, with
+ *  CAPTURE_FRAME_STROBE; the direct keys, low byte first, with
+ *  CAPTURE_FRAME_KEYS; and the Timer 1 ticks since the last frame, seven
+ *  bits to a byte, low first, with bit 7 set on all but the last. The
+ *  first frame after DLE c has no time before it.
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+  /* Macros: */
+    #define CAPTURE_FRAME           0x80
+    #define CAPTURE_FRAME_STROBE    (1 << 0)   /**< A strobe, not just direct keys changing. */
+    #define CAPTURE_FRAME_KEYS      (1 << 1)   /**< The direct keys follow. */
+    #define CAPTURE_FRAME_LOST      (1 << 2)   /**< Strobes were lost to a full queue before this one. */
+    #define CAPTURE_FRAME_KINDS     0x07
+
+    /** Longest frame: kind, data lines, keys and a full 32-bit time. */
+    #define CAPTURE_FRAME_MAX       (1 + 1 + 2 + 5)
+
+    /** Timer 1 ticks, at prescaler 8, per usec. */
+    #define CAPTURE_TICKS_PER_USEC  (F_CPU / 8 / 1000000)
+
+#endif
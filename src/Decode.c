@@ -0,0 +1,62 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Character decode table, generated by the preprocessor from the
+ *  PARALLEL_KBD_OPTS the firmware is built with, or at runtime from the
+ *  settings.
+ */
+
+#include <string.h>
+
+#include "Decode.h"
+
+#if CHAR_DECODE_TABLE
+
+const char_decode_t CharDecodeTable[256] PROGMEM = {
+  DECODE_ENTRIES_256
+};
+
+#endif
+
+#ifdef RUNTIME_SETTINGS
+
+uint8_t CharDecodeRAM[256];
+uint16_t CharDecodeReject;
+
+void Decode_Build(uint8_t charMask, bool charInvert, int8_t parityCheck)
+{
+  // Which outputs accepted values use, to find one for rejects.
+  uint8_t used[256 / 8];
+  memset(used, 0, sizeof(used));
+  bool rejects = false;
+  uint8_t raw = 0;
+  do {
+    uint8_t code = (charInvert ? ~raw : raw) & charMask;
+    if (parityCheck != PARITY_NONE && __builtin_parity(raw) != parityCheck) {
+      rejects = true;
+    } else {
+      used[code >> 3] |= 1 << (code & 7);
+    }
+    CharDecodeRAM[raw] = code;
+  } while (++raw != 0);
+
+  CharDecodeReject = 0x100;
+  if (rejects) {
+    // At most 128 values are accepted, so there is always a free one.
+    uint8_t reject = 0;
+    while (used[reject >> 3] & (1 << (reject & 7))) {
+      reject++;
+    }
+    CharDecodeReject = reject;
+    do {
+      if (__builtin_parity(raw) != parityCheck) {
+        CharDecodeRAM[raw] = reject;
+      }
+    } while (++raw != 0);
+  }
+}
+
+#endif
@@ -0,0 +1,143 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Header file for Decode.c.
+ *
+ *  Turns the raw value latched from the character port into a character
+ *  code, applying PARITY_CHECK, CHAR_INVERT and CHAR_MASK. With
+ *  CHAR_DECODE_TABLE (the default when checking parity), all three are
+ *  folded at compile time into a table indexed by the raw value, so that
+ *  decoding is a single program memory read. With RUNTIME_SETTINGS, the
+ *  table is built in RAM from the settings instead, and those options are
+ *  only its defaults.
+ */
+
+#ifndef _DECODE_H_
+#define _DECODE_H_
+
+  /* Includes: */
+    #include <avr/pgmspace.h>
+    #include <stdbool.h>
+    #include <stdint.h>
+
+  /* Macros: */
+    #ifndef CHAR_MASK
+    #define CHAR_MASK 0x7F
+    #endif
+
+    #ifndef PARITY_CHECK
+    #define PARITY_CHECK PARITY_NONE
+    #endif
+    #define PARITY_NONE -1
+    #define PARITY_EVEN 0
+    #define PARITY_ODD 1
+
+    #ifdef CHAR_INVERT
+    #define DECODE_INVERT 0xFF
+    #else
+    #define DECODE_INVERT 0
+    #endif
+
+    #ifdef RUNTIME_SETTINGS
+      #undef CHAR_DECODE_TABLE
+      #define CHAR_DECODE_TABLE 0
+    #elif !defined(CHAR_DECODE_TABLE)
+      #define CHAR_DECODE_TABLE (PARITY_CHECK != PARITY_NONE)
+    #endif
+
+    /** A table entry flag for a raw value that fails the parity check: any bit that CHAR_MASK
+     *  leaves clear, or a ninth bit if it does not leave one.
+     */
+    #if PARITY_CHECK != PARITY_NONE
+      #if (CHAR_MASK & 0x80) == 0
+        #define DECODE_REJECT 0x80
+      #else
+        #define DECODE_REJECT 0x100
+      #endif
+    #endif
+
+    #if defined(DECODE_REJECT) && (DECODE_REJECT > 0xFF)
+      #define DECODE_WIDE 1
+    #else
+      #define DECODE_WIDE 0
+    #endif
+
+    /** Compile time parity of an 8-bit value. */
+    #define DECODE_PARITY(raw) (((raw) ^ ((raw) >> 1) ^ ((raw) >> 2) ^ ((raw) >> 3) ^ \
+                                 ((raw) >> 4) ^ ((raw) >> 5) ^ ((raw) >> 6) ^ ((raw) >> 7)) & 1)
+
+    #if PARITY_CHECK == PARITY_NONE
+      #define DECODE_ENTRY(raw) (((raw) ^ DECODE_INVERT) & CHAR_MASK)
+    #else
+      #define DECODE_ENTRY(raw) ((DECODE_PARITY(raw) == PARITY_CHECK) ? \
+                                 (((raw) ^ DECODE_INVERT) & CHAR_MASK) : DECODE_REJECT)
+    #endif
+
+    /** Table entries for raw values starting at n, which must be a multiple of the count. */
+    #define DECODE_ENTRIES_4(n)   DECODE_ENTRY(n), DECODE_ENTRY((n) + 1), \
+                                  DECODE_ENTRY((n) + 2), DECODE_ENTRY((n) + 3)
+    #define DECODE_ENTRIES_16(n)  DECODE_ENTRIES_4(n), DECODE_ENTRIES_4((n) + 4), \
+                                  DECODE_ENTRIES_4((n) + 8), DECODE_ENTRIES_4((n) + 12)
+    #define DECODE_ENTRIES_64(n)  DECODE_ENTRIES_16(n), DECODE_ENTRIES_16((n) + 16), \
+                                  DECODE_ENTRIES_16((n) + 32), DECODE_ENTRIES_16((n) + 48)
+    #define DECODE_ENTRIES_256    DECODE_ENTRIES_64(0), DECODE_ENTRIES_64(64), \
+                                  DECODE_ENTRIES_64(128), DECODE_ENTRIES_64(192)
+
+  /* Type Defines: */
+    #if DECODE_WIDE
+      typedef uint16_t char_decode_t;
+    #else
+      typedef uint8_t char_decode_t;
+    #endif
+
+  /* External Variables: */
+    #if CHAR_DECODE_TABLE
+      extern const char_decode_t CharDecodeTable[256] PROGMEM;
+    #endif
+
+    #ifdef RUNTIME_SETTINGS
+      extern uint8_t CharDecodeRAM[256];
+      /** An output that no accepted raw value decodes to, or 0x100 if nothing is rejected. */
+      extern uint16_t CharDecodeReject;
+    #endif
+
+  /* Function Prototypes: */
+    #ifdef RUNTIME_SETTINGS
+      void Decode_Build(uint8_t charMask, bool charInvert, int8_t parityCheck);
+    #endif
+
+  /* Inline Functions: */
+    /** Decodes raw into *code, returning false if it should be ignored. */
+    static inline bool DecodeChar(uint8_t raw, uint8_t *code)
+    {
+    #if defined(RUNTIME_SETTINGS)
+      uint8_t decoded = CharDecodeRAM[raw];
+      *code = decoded;
+      return decoded != CharDecodeReject;
+    #elif CHAR_DECODE_TABLE
+      #if DECODE_WIDE
+      char_decode_t decoded = pgm_read_word(&CharDecodeTable[raw]);
+      #else
+      char_decode_t decoded = pgm_read_byte(&CharDecodeTable[raw]);
+      #endif
+      *code = decoded;
+      #ifdef DECODE_REJECT
+      return (decoded & DECODE_REJECT) == 0;
+      #else
+      return true;
+      #endif
+    #else
+      #if PARITY_CHECK != PARITY_NONE
+      if (__builtin_parity(raw) != PARITY_CHECK) {
+        return false;
+      }
+      #endif
+      *code = (raw ^ DECODE_INVERT) & CHAR_MASK;
+      return true;
+    #endif
+    }
+
+#endif
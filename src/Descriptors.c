@@ -40,6 +40,22 @@
 #include "Descriptors.h"
 
 
+#if USB_HAS_HID
+/** HID class report descriptor. This is a special descriptor constructed with values from the
+ *  USBIF HID class specification to describe the reports and capabilities of the HID device. This
+ *  descriptor is parsed by the host and its contents used to determine what data (and in what encoding)
+ *  the device will send, and what it may be sent back from the host. Refer to the HID specification for
+ *  more details on HID report descriptors.
+ */
+const USB_Descriptor_HIDReport_Datatype_t PROGMEM KeyboardReport[] =
+{
+  /* Use the HID class driver's standard Keyboard report.
+   *   Max simultaneous keys: 6
+   */
+  HID_DESCRIPTOR_KEYBOARD(6)
+};
+#endif
+
 /** Device descriptor structure. This descriptor, located in FLASH memory, describes the overall
  *  device characteristics, including the supported USB version, control endpoint size and the
  *  number of device configurations. The descriptor is read out by the USB host when the enumeration
@@ -50,9 +66,19 @@ const USB_Descriptor_Device_t PROGMEM DeviceDescriptor =
   .Header                 = {.Size = sizeof(USB_Descriptor_Device_t), .Type = DTYPE_Device},
 
   .USBSpecification       = VERSION_BCD(1,1,0),
+#if (USB_MODE == USB_MODE_CDC) && (KBD_CHANNELS == 1)
   .Class                  = CDC_CSCP_CDCClass,
   .SubClass               = CDC_CSCP_NoSpecificSubclass,
   .Protocol               = CDC_CSCP_NoSpecificProtocol,
+#elif USB_MODE == USB_MODE_HID
+  .Class                  = USB_CSCP_NoDeviceClass,
+  .SubClass               = USB_CSCP_NoDeviceSubclass,
+  .Protocol               = USB_CSCP_NoDeviceProtocol,
+#else
+  .Class                  = USB_CSCP_IADDeviceClass,
+  .SubClass               = USB_CSCP_IADDeviceSubclass,
+  .Protocol               = USB_CSCP_IADDeviceProtocol,
+#endif
 
   .Endpoint0Size          = FIXED_CONTROL_ENDPOINT_SIZE,
 
@@ -79,7 +105,7 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
       .Header                 = {.Size = sizeof(USB_Descriptor_Configuration_Header_t), .Type = DTYPE_Configuration},
 
       .TotalConfigurationSize = sizeof(USB_Descriptor_Configuration_t),
-      .TotalInterfaces        = 2,
+      .TotalInterfaces        = INTERFACE_ID_COUNT,
 
       .ConfigurationNumber    = 1,
       .ConfigurationStrIndex  = NO_DESCRIPTOR,
@@ -89,6 +115,23 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
       .MaxPowerConsumption    = USB_CONFIG_POWER_MA(100)
     },
 
+#if USB_HAS_CDC
+#if USB_HAS_HID || (KBD_CHANNELS > 1)
+  .CDC_IAD =
+    {
+      .Header                 = {.Size = sizeof(USB_Descriptor_Interface_Association_t), .Type = DTYPE_InterfaceAssociation},
+
+      .FirstInterfaceIndex    = INTERFACE_ID_CDC_CCI,
+      .TotalInterfaces        = 2,
+
+      .Class                  = CDC_CSCP_CDCClass,
+      .SubClass               = CDC_CSCP_ACMSubclass,
+      .Protocol               = CDC_CSCP_ATCommandProtocol,
+
+      .IADStrIndex            = NO_DESCRIPTOR
+    },
+#endif
+
   .CDC_CCI_Interface =
     {
       .Header                 = {.Size = sizeof(USB_Descriptor_Interface_t), .Type = DTYPE_Interface},
@@ -174,7 +217,150 @@ const USB_Descriptor_Configuration_t PROGMEM ConfigurationDescriptor =
       .Attributes             = (EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
       .EndpointSize           = CDC_TXRX_EPSIZE,
       .PollingIntervalMS      = 0x05
-    }
+    },
+#endif
+
+#if KBD_CHANNELS > 1
+  .CDC_1_IAD =
+    {
+      .Header                 = {.Size = sizeof(USB_Descriptor_Interface_Association_t), .Type = DTYPE_InterfaceAssociation},
+
+      .FirstInterfaceIndex    = INTERFACE_ID_CDC_1_CCI,
+      .TotalInterfaces        = 2,
+
+      .Class                  = CDC_CSCP_CDCClass,
+      .SubClass               = CDC_CSCP_ACMSubclass,
+      .Protocol               = CDC_CSCP_ATCommandProtocol,
+
+      .IADStrIndex            = NO_DESCRIPTOR
+    },
+
+  .CDC_1_CCI_Interface =
+    {
+      .Header                 = {.Size = sizeof(USB_Descriptor_Interface_t), .Type = DTYPE_Interface},
+
+      .InterfaceNumber        = INTERFACE_ID_CDC_1_CCI,
+      .AlternateSetting       = 0,
+
+      .TotalEndpoints         = 1,
+
+      .Class                  = CDC_CSCP_CDCClass,
+      .SubClass               = CDC_CSCP_ACMSubclass,
+      .Protocol               = CDC_CSCP_ATCommandProtocol,
+
+      .InterfaceStrIndex      = NO_DESCRIPTOR
+    },
+
+  .CDC_1_Functional_Header =
+    {
+      .Header                 = {.Size = sizeof(USB_CDC_Descriptor_FunctionalHeader_t), .Type = CDC_DTYPE_CSInterface},
+      .Subtype                = CDC_DSUBTYPE_CSInterface_Header,
+
+      .CDCSpecification       = VERSION_BCD(1,1,0),
+    },
+
+  .CDC_1_Functional_ACM =
+    {
+      .Header                 = {.Size = sizeof(USB_CDC_Descriptor_FunctionalACM_t), .Type = CDC_DTYPE_CSInterface},
+      .Subtype                = CDC_DSUBTYPE_CSInterface_ACM,
+
+      .Capabilities           = 0x06,
+    },
+
+  .CDC_1_Functional_Union =
+    {
+      .Header                 = {.Size = sizeof(USB_CDC_Descriptor_FunctionalUnion_t), .Type = CDC_DTYPE_CSInterface},
+      .Subtype                = CDC_DSUBTYPE_CSInterface_Union,
+
+      .MasterInterfaceNumber  = INTERFACE_ID_CDC_1_CCI,
+      .SlaveInterfaceNumber   = INTERFACE_ID_CDC_1_DCI,
+    },
+
+  .CDC_1_NotificationEndpoint =
+    {
+      .Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
+
+      .EndpointAddress        = CDC_1_NOTIFICATION_EPADDR,
+      .Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+      .EndpointSize           = CDC_NOTIFICATION_EPSIZE,
+      .PollingIntervalMS      = 0xFF
+    },
+
+  .CDC_1_DCI_Interface =
+    {
+      .Header                 = {.Size = sizeof(USB_Descriptor_Interface_t), .Type = DTYPE_Interface},
+
+      .InterfaceNumber        = INTERFACE_ID_CDC_1_DCI,
+      .AlternateSetting       = 0,
+
+      .TotalEndpoints         = 2,
+
+      .Class                  = CDC_CSCP_CDCDataClass,
+      .SubClass               = CDC_CSCP_NoDataSubclass,
+      .Protocol               = CDC_CSCP_NoDataProtocol,
+
+      .InterfaceStrIndex      = NO_DESCRIPTOR
+    },
+
+  .CDC_1_DataOutEndpoint =
+    {
+      .Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
+
+      .EndpointAddress        = CDC_1_RX_EPADDR,
+      .Attributes             = (EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+      .EndpointSize           = CDC_TXRX_EPSIZE,
+      .PollingIntervalMS      = 0x05
+    },
+
+  .CDC_1_DataInEndpoint =
+    {
+      .Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
+
+      .EndpointAddress        = CDC_1_TX_EPADDR,
+      .Attributes             = (EP_TYPE_BULK | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+      .EndpointSize           = CDC_TXRX_EPSIZE,
+      .PollingIntervalMS      = 0x05
+    },
+#endif
+
+#if USB_HAS_HID
+  .HID_Interface =
+    {
+      .Header                 = {.Size = sizeof(USB_Descriptor_Interface_t), .Type = DTYPE_Interface},
+
+      .InterfaceNumber        = INTERFACE_ID_Keyboard,
+      .AlternateSetting       = 0x00,
+
+      .TotalEndpoints         = 1,
+
+      .Class                  = HID_CSCP_HIDClass,
+      .SubClass               = HID_CSCP_BootSubclass,
+      .Protocol               = HID_CSCP_KeyboardBootProtocol,
+
+      .InterfaceStrIndex      = NO_DESCRIPTOR
+    },
+
+  .HID_KeyboardHID =
+    {
+      .Header                 = {.Size = sizeof(USB_HID_Descriptor_HID_t), .Type = HID_DTYPE_HID},
+
+      .HIDSpec                = VERSION_BCD(1,1,1),
+      .CountryCode            = 0x00,
+      .TotalReportDescriptors = 1,
+      .HIDReportType          = HID_DTYPE_Report,
+      .HIDReportLength        = sizeof(KeyboardReport)
+    },
+
+  .HID_ReportINEndpoint =
+    {
+      .Header                 = {.Size = sizeof(USB_Descriptor_Endpoint_t), .Type = DTYPE_Endpoint},
+
+      .EndpointAddress        = KEYBOARD_EPADDR,
+      .Attributes             = (EP_TYPE_INTERRUPT | ENDPOINT_ATTR_NO_SYNC | ENDPOINT_USAGE_DATA),
+      .EndpointSize           = KEYBOARD_EPSIZE,
+      .PollingIntervalMS      = 0x01
+    },
+#endif
 };
 
 /** Language descriptor structure. This descriptor, located in FLASH memory, is returned when the host requests
@@ -243,6 +429,16 @@ uint16_t CALLBACK_USB_GetDescriptor(const uint16_t wValue,
       }
 
       break;
+#if USB_HAS_HID
+    case HID_DTYPE_HID:
+      Address = &ConfigurationDescriptor.HID_KeyboardHID;
+      Size    = sizeof(USB_HID_Descriptor_HID_t);
+      break;
+    case HID_DTYPE_Report:
+      Address = &KeyboardReport;
+      Size    = sizeof(KeyboardReport);
+      break;
+#endif
   }
 
   *DescriptorAddress = Address;
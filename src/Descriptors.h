@@ -44,6 +44,46 @@
     #include <LUFA/Drivers/USB/USB.h>
 
   /* Macros: */
+    /** USB functions the device presents: the CDC virtual serial port, a HID boot keyboard, or both
+     *  as a composite device.
+     */
+    #define USB_MODE_CDC                   0
+    #define USB_MODE_HID                   1
+    #define USB_MODE_CDC_HID               2
+
+    #ifndef USB_MODE
+    #define USB_MODE                       USB_MODE_CDC
+    #endif
+
+    #if (USB_MODE != USB_MODE_CDC) && (USB_MODE != USB_MODE_HID) && (USB_MODE != USB_MODE_CDC_HID)
+      #error USB_MODE must be USB_MODE_CDC, USB_MODE_HID or USB_MODE_CDC_HID.
+    #endif
+
+    #define USB_HAS_CDC                    (USB_MODE != USB_MODE_HID)
+    #define USB_HAS_HID                    (USB_MODE != USB_MODE_CDC)
+
+    /** Keyboards served by the device, each with its own strobe and CDC interface. Two CDC
+     *  interfaces take all six of the ATmega32U4's endpoints besides control, so there is no room
+     *  for a third, or for HID alongside them.
+     */
+    #ifndef KBD_CHANNELS
+    #define KBD_CHANNELS                   1
+    #endif
+
+    #if (KBD_CHANNELS != 1) && (KBD_CHANNELS != 2)
+      #error KBD_CHANNELS must be 1 or 2.
+    #endif
+
+    #if (KBD_CHANNELS > 1) && (USB_MODE != USB_MODE_CDC)
+      #error KBD_CHANNELS needs USB_MODE_CDC.
+    #endif
+
+    /** Endpoint address of the HID keyboard report IN endpoint. */
+    #define KEYBOARD_EPADDR                (ENDPOINT_DIR_IN  | 1)
+
+    /** Size in bytes of the HID keyboard report IN endpoint. */
+    #define KEYBOARD_EPSIZE                8
+
     /** Endpoint address of the CDC device-to-host notification IN endpoint. */
     #define CDC_NOTIFICATION_EPADDR        (ENDPOINT_DIR_IN  | 2)
 
@@ -53,11 +93,43 @@
     /** Endpoint address of the CDC host-to-device data OUT endpoint. */
     #define CDC_RX_EPADDR                  (ENDPOINT_DIR_OUT | 4)
 
+    /** Endpoint addresses of the second keyboard's CDC interface, taking the HID endpoint for its
+     *  notifications.
+     */
+    #define CDC_1_NOTIFICATION_EPADDR      (ENDPOINT_DIR_IN  | 1)
+    #define CDC_1_TX_EPADDR                (ENDPOINT_DIR_IN  | 5)
+    #define CDC_1_RX_EPADDR                (ENDPOINT_DIR_OUT | 6)
+
     /** Size in bytes of the CDC device-to-host notification IN endpoint. */
     #define CDC_NOTIFICATION_EPSIZE        8
 
     /** Size in bytes of the CDC data IN and OUT endpoints. */
+    #ifndef CDC_TXRX_EPSIZE
     #define CDC_TXRX_EPSIZE                16
+    #endif
+
+    /** Number of banks of the CDC data IN and OUT endpoints. With two, the firmware can fill one
+     *  packet while the host is still collecting the previous one.
+     */
+    #ifndef CDC_TXRX_BANKS
+    #define CDC_TXRX_BANKS                 2
+    #endif
+
+    #if (CDC_TXRX_EPSIZE != 8) && (CDC_TXRX_EPSIZE != 16) && (CDC_TXRX_EPSIZE != 32) && (CDC_TXRX_EPSIZE != 64)
+      #error CDC_TXRX_EPSIZE must be 8, 16, 32 or 64.
+    #endif
+
+    #if (CDC_TXRX_BANKS != 1) && (CDC_TXRX_BANKS != 2)
+      #error CDC_TXRX_BANKS must be 1 or 2.
+    #endif
+
+    /** Size in bytes of the USB controller's endpoint DPRAM (ATmega32U4). */
+    #define USB_DPRAM_SIZE                 832
+
+    #if (FIXED_CONTROL_ENDPOINT_SIZE + (USB_HAS_HID * KEYBOARD_EPSIZE) + \
+         (USB_HAS_CDC * KBD_CHANNELS * (CDC_NOTIFICATION_EPSIZE + 2 * CDC_TXRX_BANKS * CDC_TXRX_EPSIZE))) > USB_DPRAM_SIZE
+      #error USB endpoints do not fit in the USB DPRAM.
+    #endif
 
   /* Type Defines: */
     /** Type define for the device configuration descriptor structure. This must be defined in the
@@ -68,6 +140,12 @@
     {
       USB_Descriptor_Configuration_Header_t    Config;
 
+#if USB_HAS_CDC
+#if USB_HAS_HID || (KBD_CHANNELS > 1)
+      // CDC Interface Association
+      USB_Descriptor_Interface_Association_t   CDC_IAD;
+#endif
+
       // CDC Control Interface
       USB_Descriptor_Interface_t               CDC_CCI_Interface;
       USB_CDC_Descriptor_FunctionalHeader_t    CDC_Functional_Header;
@@ -79,6 +157,27 @@
       USB_Descriptor_Interface_t               CDC_DCI_Interface;
       USB_Descriptor_Endpoint_t                CDC_DataOutEndpoint;
       USB_Descriptor_Endpoint_t                CDC_DataInEndpoint;
+#endif
+
+#if KBD_CHANNELS > 1
+      // Second keyboard's CDC Interface Association, Control and Data Interfaces
+      USB_Descriptor_Interface_Association_t   CDC_1_IAD;
+      USB_Descriptor_Interface_t               CDC_1_CCI_Interface;
+      USB_CDC_Descriptor_FunctionalHeader_t    CDC_1_Functional_Header;
+      USB_CDC_Descriptor_FunctionalACM_t       CDC_1_Functional_ACM;
+      USB_CDC_Descriptor_FunctionalUnion_t     CDC_1_Functional_Union;
+      USB_Descriptor_Endpoint_t                CDC_1_NotificationEndpoint;
+      USB_Descriptor_Interface_t               CDC_1_DCI_Interface;
+      USB_Descriptor_Endpoint_t                CDC_1_DataOutEndpoint;
+      USB_Descriptor_Endpoint_t                CDC_1_DataInEndpoint;
+#endif
+
+#if USB_HAS_HID
+      // HID Keyboard Interface
+      USB_Descriptor_Interface_t               HID_Interface;
+      USB_HID_Descriptor_HID_t                 HID_KeyboardHID;
+      USB_Descriptor_Endpoint_t                HID_ReportINEndpoint;
+#endif
     } USB_Descriptor_Configuration_t;
 
     /** Enum for the device interface descriptor IDs within the device. Each interface descriptor
@@ -87,8 +186,18 @@
      */
     enum InterfaceDescriptors_t
     {
-      INTERFACE_ID_CDC_CCI = 0, /**< CDC CCI interface descriptor ID */
-      INTERFACE_ID_CDC_DCI = 1, /**< CDC DCI interface descriptor ID */
+#if USB_HAS_CDC
+      INTERFACE_ID_CDC_CCI,     /**< CDC CCI interface descriptor ID */
+      INTERFACE_ID_CDC_DCI,     /**< CDC DCI interface descriptor ID */
+#endif
+#if KBD_CHANNELS > 1
+      INTERFACE_ID_CDC_1_CCI,   /**< Second keyboard's CDC CCI interface descriptor ID */
+      INTERFACE_ID_CDC_1_DCI,   /**< Second keyboard's CDC DCI interface descriptor ID */
+#endif
+#if USB_HAS_HID
+      INTERFACE_ID_Keyboard,    /**< HID keyboard interface descriptor ID */
+#endif
+      INTERFACE_ID_COUNT        /**< Number of interfaces */
     };
 
     /** Enum for the device string descriptor IDs within the device. Each string descriptor should
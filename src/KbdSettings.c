@@ -0,0 +1,67 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  EEPROM storage of keyboard settings.
+ */
+
+#ifdef RUNTIME_SETTINGS
+
+#include <avr/eeprom.h>
+
+#include "KbdSettings.h"
+
+typedef struct
+{
+  kbd_settings_t settings;
+  uint8_t check;
+} settings_slot_t;
+
+static uint8_t EEMEM SettingsBootSlot;
+static settings_slot_t EEMEM SettingsSlots[SETTINGS_SLOTS];
+
+// Blank EEPROM (all 0xFF) or a half-finished save fails this.
+static uint8_t SettingsCheck(const kbd_settings_t *settings)
+{
+  const uint8_t *p = (const uint8_t *)settings;
+  uint8_t check = 0x5A;
+  for (uint8_t i = 0; i < sizeof(kbd_settings_t); i++) {
+    check = ((check << 1) | (check >> 7)) ^ p[i];
+  }
+  return check;
+}
+
+uint8_t Settings_BootSlot(void)
+{
+  return eeprom_read_byte(&SettingsBootSlot);
+}
+
+void Settings_SetBootSlot(uint8_t slot)
+{
+  eeprom_update_byte(&SettingsBootSlot, slot);
+}
+
+bool Settings_Load(uint8_t slot, kbd_settings_t *settings)
+{
+  if (slot >= SETTINGS_SLOTS) {
+    return false;
+  }
+  eeprom_read_block(settings, &SettingsSlots[slot].settings, sizeof(kbd_settings_t));
+  return settings->version == SETTINGS_VERSION &&
+    eeprom_read_byte(&SettingsSlots[slot].check) == SettingsCheck(settings);
+}
+
+// Only bytes that change are written, but each one takes 3.4 msec.
+bool Settings_Save(uint8_t slot, const kbd_settings_t *settings)
+{
+  if (slot >= SETTINGS_SLOTS) {
+    return false;
+  }
+  eeprom_update_block(settings, &SettingsSlots[slot].settings, sizeof(kbd_settings_t));
+  eeprom_update_byte(&SettingsSlots[slot].check, SettingsCheck(settings));
+  return true;
+}
+
+#endif
@@ -0,0 +1,91 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Header file for KbdSettings.c.
+ *
+ *  With RUNTIME_SETTINGS defined, the keyboard options that otherwise come
+ *  from PARALLEL_KBD_OPTS are read at startup from one of several slots in
+ *  EEPROM, and can be replaced and saved over the CDC link, so that one
+ *  firmware image serves any of the keyboards. The options it was compiled
+ *  with become the built-in default.
+ */
+
+#ifndef _KBDSETTINGS_H_
+#define _KBDSETTINGS_H_
+
+  /* Includes: */
+    #include <stdbool.h>
+    #include <stdint.h>
+
+  /* Macros: */
+    /** Changes whenever kbd_settings_t does, so that old slots read as empty. */
+    #define SETTINGS_VERSION             1
+
+    /** Number of settings slots in EEPROM. */
+    #ifndef SETTINGS_SLOTS
+    #define SETTINGS_SLOTS               4
+    #endif
+
+    /** Boot slot that means the built-in default. */
+    #define SETTINGS_SLOT_DEFAULT        0xFF
+
+    /** Most direct keys a runtime build can have. */
+    #define SETTINGS_DIRECT_KEYS         15
+
+    /** Room for the answerback, including the terminating null. */
+    #define SETTINGS_ANSWERBACK_SIZE     32
+
+    /** Bits of kbd_settings_t.flags. */
+    #define SETTINGS_STROBE_RISING       (1 << 0)
+    #define SETTINGS_CHAR_INVERT         (1 << 1)
+    #define SETTINGS_ESC_PREFIX_VT100    (1 << 2)
+    #define SETTINGS_READY_ACK_ON_HIGH   (1 << 3)
+
+    /** Direct key actions, as stored. */
+    #define DIRECT_ACTION_NONE           0
+    #define DIRECT_ACTION_BREAK          1
+    #define DIRECT_ACTION_HERE_IS        2
+    #define DIRECT_ACTION_ANSWERBACK_2   3
+    #define DIRECT_ACTION_ANSWERBACK_3   4
+    #define DIRECT_ACTION_MACRO_1        5
+    #define DIRECT_ACTION_MACRO_2        6
+    #define DIRECT_ACTION_MACRO_3        7
+    #define DIRECT_ACTION_MACRO_4        8
+    #define DIRECT_ACTION_MACRO_5        9
+    #define DIRECT_ACTION_MACRO_6        10
+    #define DIRECT_ACTION_MACRO_7        11
+    #define DIRECT_ACTION_MACRO_8        12
+    #define DIRECT_ACTION_COUNT          13
+
+  /* Type Defines: */
+    /** One keyboard's options, laid out the same on the host as on the AVR. */
+    typedef struct __attribute__((packed))
+    {
+      uint8_t  version;
+      uint8_t  flags;
+      uint8_t  charMask;                  /**< CHAR_MASK */
+      int8_t   parityCheck;               /**< PARITY_CHECK */
+      uint8_t  directKeys;                /**< DIRECT_KEYS */
+      uint8_t  directPortUnused;          /**< DIRECT_PORT_UNUSED */
+      uint16_t directInvertMask;          /**< DIRECT_INVERT_MASK */
+      uint16_t directEscPrefixMask;       /**< DIRECT_ESC_PREFIX_MASK */
+      uint8_t  directDebounce;            /**< DIRECT_DEBOUNCE */
+      uint8_t  directActions[SETTINGS_DIRECT_KEYS]; /**< DIRECT_KEY_n, as DIRECT_ACTION_xxx */
+      int8_t   bellMode;                  /**< BELL_MODE */
+      uint32_t bellDurationUsec;          /**< BELL_DURATION_USEC */
+      uint16_t bellToneFrequency;         /**< BELL_TONE_FREQUENCY */
+      uint8_t  readyAckMode;              /**< READY_ACK_MODE */
+      uint8_t  readyAckDelayMsec;         /**< READY_ACK_DELAY_MSEC */
+      char     answerback[SETTINGS_ANSWERBACK_SIZE]; /**< ANSWERBACK */
+    } kbd_settings_t;
+
+  /* Function Prototypes: */
+    uint8_t Settings_BootSlot(void);
+    void Settings_SetBootSlot(uint8_t slot);
+    bool Settings_Load(uint8_t slot, kbd_settings_t *settings);
+    bool Settings_Save(uint8_t slot, const kbd_settings_t *settings);
+
+#endif
@@ -8,31 +8,49 @@
            www.lufa-lib.org
 */
 
+#include <string.h>
+
 #include <avr/io.h>
+#include <avr/cpufunc.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
 #include <util/delay.h>
 
 #include <LUFA/Drivers/Board/LEDs.h>
 #include <LUFA/Drivers/USB/USB.h>
 #include <LUFA/Platform/Platform.h>
 
+#include "Capture.h"
+#include "Decode.h"
+#include "Descriptors.h"
+#include "KbdSettings.h"
+#include "Profile.h"
+
+#if USB_HAS_CDC
 extern USB_ClassInfo_CDC_Device_t VirtualSerial_CDC_Interface;
+#endif
+#if KBD_CHANNELS > 1
+extern USB_ClassInfo_CDC_Device_t VirtualSerial_CDC_Interface_1;
+#endif
+#if USB_HAS_HID
+extern USB_ClassInfo_HID_Device_t Keyboard_HID_Interface;
+#endif
+
+#ifdef RUNTIME_SETTINGS
+#if !USB_HAS_CDC
+#error RUNTIME_SETTINGS needs the CDC interface
+#endif
+// The running settings. Each section below keeps what it needs from
+// them in the form its hot path wants, set by ApplySettings.
+static kbd_settings_t Settings;
+#endif
 
 /*** Parallel input on B0-B7 */
 
 #define CHAR_PORT PORTB
 #define CHAR_PIN PINB
 
-#ifndef CHAR_MASK
-#define CHAR_MASK 0x7F
-#endif
-
-#ifndef PARITY_CHECK
-#define PARITY_CHECK PARITY_NONE
-#endif
-#define PARITY_NONE -1
-#define PARITY_EVEN 0
-#define PARITY_ODD 1
+// CHAR_MASK, PARITY_CHECK and CHAR_INVERT are applied by Decode.h.
 
 #ifndef CHAR_PULLUP_MASK
 #if PARITY_CHECK == PARITY_NONE
@@ -46,6 +64,7 @@ extern USB_ClassInfo_CDC_Device_t VirtualSerial_CDC_Interface;
 
 #define CONTROL_PORT PORTD
 #define CONTROL_DDR DDRD
+#define CONTROL_PIN PIND
 #define CONTROL_STROBE (1 << 0)
 #define CONTROL_STROBE_INTERRUPT (1 << INT0)
 #ifndef CONTROL_STROBE_TRIGGER
@@ -54,12 +73,147 @@ extern USB_ClassInfo_CDC_Device_t VirtualSerial_CDC_Interface;
 #define TRIGGER_FALLING (1 << ISC01)
 #define TRIGGER_RISING ((1 << ISC01) | (1 << ISC00))
 
+// With STROBE_FILTER, each strobe is timestamped, one that comes too
+// soon after the last is taken for a bounce, and the data lines can be
+// read again after a delay until they agree.
+#ifdef STROBE_FILTER
+
+#ifndef STROBE_MIN_INTERVAL_USEC
+#define STROBE_MIN_INTERVAL_USEC 500
+#endif
+#ifndef STROBE_SETTLE_USEC
+#define STROBE_SETTLE_USEC 0
+#endif
+#ifndef STROBE_SETTLE_TRIES
+#define STROBE_SETTLE_TRIES 3
+#endif
+
+// Timer 1, free running with the same prescaler as the profile, so
+// the two can share it; compare B ends the hold-off after a strobe.
+#define STROBE_TIMER_CCRA TCCR1A
+#define STROBE_TIMER_CCRB TCCR1B
+#define STROBE_TIMER_PRESCALE (1<<CS11)
+#define STROBE_TIMER_OCR OCR1B
+#define STROBE_TIMER_TCNT TCNT1
+#define STROBE_TIMER_IFR TIFR1
+#define STROBE_TIMER_MATCH (1<<OCF1B)
+#define STROBE_TIMER_MASK TIMSK1
+#define STROBE_TIMER_INT (1<<OCIE1B)
+#define STROBE_TIMER_VECT TIMER1_COMPB_vect
+
+#define STROBE_TIMER_TICKS(usec) ((usec) * (F_CPU / 8 / 1000) / 1000)
+
+#if STROBE_TIMER_TICKS(STROBE_MIN_INTERVAL_USEC) > 0xFFFF
+#error STROBE_MIN_INTERVAL_USEC out of range
+#endif
+#if STROBE_SETTLE_USEC > 0 && STROBE_SETTLE_TRIES < 1
+#error STROBE_SETTLE_TRIES must be at least 1
+#endif
+
+#endif
+
+// With CAPTURE, each strobe is timestamped against the same Timer 1,
+// its overflow counting the high half, for DLE c to send to the host.
+#ifdef CAPTURE
+#define CAPTURE_TIMER_CCRA TCCR1A
+#define CAPTURE_TIMER_CCRB TCCR1B
+#define CAPTURE_TIMER_PRESCALE (1<<CS11)
+#define CAPTURE_TIMER_TCNT TCNT1
+#define CAPTURE_TIMER_IFR TIFR1
+#define CAPTURE_TIMER_OVERFLOW (1<<TOV1)
+#define CAPTURE_TIMER_MASK TIMSK1
+#define CAPTURE_TIMER_INT (1<<TOIE1)
+#define CAPTURE_TIMER_VECT TIMER1_OVF_vect
+#endif
+
+/*** More keyboards, strobes on D1, data latched onto B0-B7 ***/
+
+// With KBD_CHANNELS, keyboard n strobes Dn, which also clocks its data
+// lines into a latch (74HC574 or the like) whose outputs share B0-B7
+// with the others', enabled by taking Fn low. Each keyboard has its own
+// queue, decoding and CDC interface; they share the bell. D1 is no
+// longer free for direct keys, and the options that time or replay
+// strobes or change settings at runtime only know the one keyboard.
+#if KBD_CHANNELS > 1
+#if DIRECT_KEYS > 0 || defined(DIRECT_KEYS_INTERRUPT) || \
+  defined(STROBE_FILTER) || defined(CAPTURE) || defined(RUNTIME_SETTINGS)
+#error KBD_CHANNELS does not go with direct keys, STROBE_FILTER, CAPTURE or RUNTIME_SETTINGS
+#endif
+
+#define CHANNEL_STROBE(n) (1 << (n))
+#define CHANNEL_STROBE_INTERRUPT(n) (1 << (INT0 + (n)))
+#define CHANNEL_STROBE_TRIGGER(n) (CONTROL_STROBE_TRIGGER << (2 * (n)))
+
+#define CHANNEL_OE_PORT PORTF
+#define CHANNEL_OE_DDR DDRF
+#define CHANNEL_OE(n) (1 << (n))
+#define CHANNEL_OE_MASK ((1 << KBD_CHANNELS) - 1)
+
+// Enables the latch of keyboard n long enough to read it: the output
+// takes effect at the end of the first cycle and the input synchronizer
+// needs another.
+static inline uint8_t ChannelRead(uint8_t n)
+{
+  CHANNEL_OE_PORT &= ~CHANNEL_OE(n);
+  _NOP();
+  _NOP();
+  uint8_t value = CHAR_PIN;
+  CHANNEL_OE_PORT |= CHANNEL_OE(n);
+  return value;
+}
+
+// Keyboard 1 decodes with CHAR_MASK_1, CHAR_INVERT_1 (0 or 1) and
+// PARITY_CHECK_1, each defaulting to keyboard 0's, and without a table.
+#if defined(CHAR_MASK_1) || defined(CHAR_INVERT_1) || defined(PARITY_CHECK_1)
+#define DECODE_1 1
+#ifndef CHAR_MASK_1
+#define CHAR_MASK_1 CHAR_MASK
+#endif
+#ifndef PARITY_CHECK_1
+#define PARITY_CHECK_1 PARITY_CHECK
+#endif
+#ifdef CHAR_INVERT_1
+#define DECODE_INVERT_1 ((CHAR_INVERT_1) ? 0xFF : 0)
+#else
+#define DECODE_INVERT_1 DECODE_INVERT
+#endif
+#endif
+
+static inline bool ChannelDecodeChar(uint8_t channel, uint8_t raw, uint8_t *code)
+{
+#ifdef DECODE_1
+  if (channel != 0) {
+#if PARITY_CHECK_1 != PARITY_NONE
+    if (__builtin_parity(raw) != PARITY_CHECK_1) {
+      return false;
+    }
+#endif
+    *code = (raw ^ DECODE_INVERT_1) & CHAR_MASK_1;
+    return true;
+  }
+#endif
+  return DecodeChar(raw, code);
+}
+#else
+#define ChannelRead(n) CHAR_PIN
+#define ChannelDecodeChar(channel, raw, code) DecodeChar(raw, code)
+#endif
+
 /*** Direct switches on D1-D7 (ignoring LED), F0-F7 (if needed) ***/
 
 #ifndef DIRECT_KEYS
 #define DIRECT_KEYS 0
 #endif
-#if DIRECT_KEYS > 0
+
+// How many keys the code has room for; with runtime settings, the
+// settings decide how many of those are actually connected.
+#ifdef RUNTIME_SETTINGS
+#define DIRECT_KEYS_MAX SETTINGS_DIRECT_KEYS
+#else
+#define DIRECT_KEYS_MAX DIRECT_KEYS
+#endif
+
+#if DIRECT_KEYS_MAX > 0
 
 #define DIRECT_PORT PORTD
 #define DIRECT_PIN PIND
@@ -79,23 +233,22 @@ extern USB_ClassInfo_CDC_Device_t VirtualSerial_CDC_Interface;
 
 #define DIRECT_PORT_SHIFT 1
 
-#if DIRECT_KEYS < 8
+#define DIRECT_PORT_MASK_FOR(keys, unused) \
+  ((((keys) < 8 ? (1 << (keys)) - 1 : 0xFF) << DIRECT_PORT_SHIFT) & 0xFF & ~(unused))
+#define DIRECT_PORT_2_MASK_FOR(keys) ((keys) > 7 ? (1 << ((keys) - 7)) - 1 : 0)
 
-#define DIRECT_PORT_MASK ((((1<<DIRECT_KEYS) - 1) << DIRECT_PORT_SHIFT) & ~DIRECT_PORT_UNUSED)
+#if DIRECT_KEYS_MAX < 8
 typedef uint8_t direct_keys_t;
-
 #else
-
-#define DIRECT_PORT_MASK ((0xFF << DIRECT_PORT_SHIFT) & ~DIRECT_PORT_UNUSED)
 typedef uint16_t direct_keys_t;
 
 #define DIRECT_PORT_2 PORTF
 #define DIRECT_PIN_2 PINF
 #define DIRECT_DDR_2 DDRF
-#define DIRECT_PORT_2_MASK ((1<<(DIRECT_KEYS-7)) - 1)
-
 #endif
 
+#define DIRECT_KEY_MASK(n) ((direct_keys_t)1 << ((n) - 1))
+
 #ifndef DIRECT_INVERT_MASK
 #define DIRECT_INVERT_MASK 0
 #endif
@@ -104,19 +257,230 @@ typedef uint16_t direct_keys_t;
 #define DIRECT_DEBOUNCE 0
 #endif
 
+#ifdef RUNTIME_SETTINGS
+static uint8_t DirectPortMask, DirectPort2Mask;
+static direct_keys_t DirectInvertMask;
+#define DIRECT_PORT_MASK DirectPortMask
+#define DIRECT_PORT_2_MASK DirectPort2Mask
+#define DIRECT_INVERT DirectInvertMask
+#define DIRECT_DEBOUNCE_MSEC Settings.directDebounce
+#define DIRECT_ESC_MASK Settings.directEscPrefixMask
+#define DIRECT_ESC_VT100 ((Settings.flags & SETTINGS_ESC_PREFIX_VT100) != 0)
+#else
+#define DIRECT_PORT_MASK DIRECT_PORT_MASK_FOR(DIRECT_KEYS, DIRECT_PORT_UNUSED)
+#define DIRECT_PORT_2_MASK DIRECT_PORT_2_MASK_FOR(DIRECT_KEYS)
+#define DIRECT_INVERT DIRECT_INVERT_MASK
+#define DIRECT_DEBOUNCE_MSEC DIRECT_DEBOUNCE
+#ifdef DIRECT_ESC_PREFIX_MASK
+#define DIRECT_ESC_MASK DIRECT_ESC_PREFIX_MASK
+#ifdef DIRECT_ESC_PREFIX_VT100
+#define DIRECT_ESC_VT100 true
+#else
+#define DIRECT_ESC_VT100 false
+#endif
+#endif
+#endif
+
 // Return value normalized to 1 for pressed key.
 static inline direct_keys_t ReadDirectKeys(void)
 {
-  direct_keys_t result = (DIRECT_PIN & DIRECT_PORT_MASK & ~DIRECT_PORT_UNUSED) >> DIRECT_PORT_SHIFT;
-#if DIRECT_KEYS > 7
+  direct_keys_t result = (DIRECT_PIN & DIRECT_PORT_MASK) >> DIRECT_PORT_SHIFT;
+#if DIRECT_KEYS_MAX > 7
   result |= (DIRECT_PIN_2 & DIRECT_PORT_2_MASK) << 7;
 #endif
-#if DIRECT_INVERT_MASK
-  result ^= DIRECT_INVERT_MASK;
-#endif
+  result ^= DIRECT_INVERT;
   return result;
 }
 
+#ifdef DIRECT_KEYS_INTERRUPT
+// The 32U4 has no pin change interrupts on D or F, but D1-D3 are also
+// INT1-INT3. Any edge on them interrupts, and nothing polls them.
+#ifdef RUNTIME_SETTINGS
+#error DIRECT_KEYS_INTERRUPT needs the keys fixed at compile time
+#endif
+#if DIRECT_KEYS > 3
+#error DIRECT_KEYS_INTERRUPT only has INT1-INT3, so at most 3 keys
+#endif
+// INTn is Dn, so the port mask is the interrupt mask.
+#define DIRECT_INTERRUPT_MASK (DIRECT_PORT_MASK & ((1 << INT1) | (1 << INT2) | (1 << INT3)))
+#define DIRECT_INTERRUPT_ANY_EDGE(n) ((DIRECT_INTERRUPT_MASK & (1 << INT##n)) ? (1 << ISC##n##0) : 0)
+#define DIRECT_INTERRUPT_TRIGGER \
+  (DIRECT_INTERRUPT_ANY_EDGE(1) | DIRECT_INTERRUPT_ANY_EDGE(2) | DIRECT_INTERRUPT_ANY_EDGE(3))
+#endif
+
+#ifdef DIRECT_DEBOUNCE_PER_KEY
+// Each key has its own count of milliseconds that its input has
+// differed from its debounced state, kept as a vertical counter: bit
+// i of every key's count is in DebounceCount[i], so one tick updates
+// all the keys at once. A key changes state when its count reaches the
+// threshold for pressing or releasing it, and any sample that agrees
+// with the state clears it. Threshold planes are laid out the same way.
+#ifdef DIRECT_KEYS_INTERRUPT
+#error DIRECT_DEBOUNCE_PER_KEY reads the keys from the tick, not edges
+#endif
+#define DEBOUNCE_BITS 4
+#define DEBOUNCE_MAX ((1 << DEBOUNCE_BITS) - 1)
+
+// In ticks (msec). 1 acts on the first sample, e.g. an eager press.
+#ifndef DIRECT_DEBOUNCE_PRESS
+#define DIRECT_DEBOUNCE_PRESS (DIRECT_DEBOUNCE > 0 ? DIRECT_DEBOUNCE : 1)
+#endif
+#ifndef DIRECT_DEBOUNCE_RELEASE
+#define DIRECT_DEBOUNCE_RELEASE (DIRECT_DEBOUNCE > 0 ? DIRECT_DEBOUNCE : 1)
+#endif
+#if DIRECT_DEBOUNCE_PRESS < 1 || DIRECT_DEBOUNCE_PRESS > DEBOUNCE_MAX || \
+    DIRECT_DEBOUNCE_RELEASE < 1 || DIRECT_DEBOUNCE_RELEASE > DEBOUNCE_MAX
+#error Direct key debounce thresholds must be from 1 to 15 msec
+#endif
+
+// Per key overrides; zero takes the default.
+static const uint8_t DirectDebouncePress[DIRECT_KEYS_MAX] PROGMEM = {
+#ifdef DIRECT_DEBOUNCE_PRESS_1
+  [0] = DIRECT_DEBOUNCE_PRESS_1,
+#endif
+#ifdef DIRECT_DEBOUNCE_PRESS_2
+  [1] = DIRECT_DEBOUNCE_PRESS_2,
+#endif
+#ifdef DIRECT_DEBOUNCE_PRESS_3
+  [2] = DIRECT_DEBOUNCE_PRESS_3,
+#endif
+#ifdef DIRECT_DEBOUNCE_PRESS_4
+  [3] = DIRECT_DEBOUNCE_PRESS_4,
+#endif
+#ifdef DIRECT_DEBOUNCE_PRESS_5
+  [4] = DIRECT_DEBOUNCE_PRESS_5,
+#endif
+#ifdef DIRECT_DEBOUNCE_PRESS_6
+  [5] = DIRECT_DEBOUNCE_PRESS_6,
+#endif
+#ifdef DIRECT_DEBOUNCE_PRESS_7
+  [6] = DIRECT_DEBOUNCE_PRESS_7,
+#endif
+#ifdef DIRECT_DEBOUNCE_PRESS_8
+  [7] = DIRECT_DEBOUNCE_PRESS_8,
+#endif
+#ifdef DIRECT_DEBOUNCE_PRESS_9
+  [8] = DIRECT_DEBOUNCE_PRESS_9,
+#endif
+#ifdef DIRECT_DEBOUNCE_PRESS_10
+  [9] = DIRECT_DEBOUNCE_PRESS_10,
+#endif
+#ifdef DIRECT_DEBOUNCE_PRESS_11
+  [10] = DIRECT_DEBOUNCE_PRESS_11,
+#endif
+#ifdef DIRECT_DEBOUNCE_PRESS_12
+  [11] = DIRECT_DEBOUNCE_PRESS_12,
+#endif
+#ifdef DIRECT_DEBOUNCE_PRESS_13
+  [12] = DIRECT_DEBOUNCE_PRESS_13,
+#endif
+#ifdef DIRECT_DEBOUNCE_PRESS_14
+  [13] = DIRECT_DEBOUNCE_PRESS_14,
+#endif
+#ifdef DIRECT_DEBOUNCE_PRESS_15
+  [14] = DIRECT_DEBOUNCE_PRESS_15,
+#endif
+};
+
+static const uint8_t DirectDebounceRelease[DIRECT_KEYS_MAX] PROGMEM = {
+#ifdef DIRECT_DEBOUNCE_RELEASE_1
+  [0] = DIRECT_DEBOUNCE_RELEASE_1,
+#endif
+#ifdef DIRECT_DEBOUNCE_RELEASE_2
+  [1] = DIRECT_DEBOUNCE_RELEASE_2,
+#endif
+#ifdef DIRECT_DEBOUNCE_RELEASE_3
+  [2] = DIRECT_DEBOUNCE_RELEASE_3,
+#endif
+#ifdef DIRECT_DEBOUNCE_RELEASE_4
+  [3] = DIRECT_DEBOUNCE_RELEASE_4,
+#endif
+#ifdef DIRECT_DEBOUNCE_RELEASE_5
+  [4] = DIRECT_DEBOUNCE_RELEASE_5,
+#endif
+#ifdef DIRECT_DEBOUNCE_RELEASE_6
+  [5] = DIRECT_DEBOUNCE_RELEASE_6,
+#endif
+#ifdef DIRECT_DEBOUNCE_RELEASE_7
+  [6] = DIRECT_DEBOUNCE_RELEASE_7,
+#endif
+#ifdef DIRECT_DEBOUNCE_RELEASE_8
+  [7] = DIRECT_DEBOUNCE_RELEASE_8,
+#endif
+#ifdef DIRECT_DEBOUNCE_RELEASE_9
+  [8] = DIRECT_DEBOUNCE_RELEASE_9,
+#endif
+#ifdef DIRECT_DEBOUNCE_RELEASE_10
+  [9] = DIRECT_DEBOUNCE_RELEASE_10,
+#endif
+#ifdef DIRECT_DEBOUNCE_RELEASE_11
+  [10] = DIRECT_DEBOUNCE_RELEASE_11,
+#endif
+#ifdef DIRECT_DEBOUNCE_RELEASE_12
+  [11] = DIRECT_DEBOUNCE_RELEASE_12,
+#endif
+#ifdef DIRECT_DEBOUNCE_RELEASE_13
+  [12] = DIRECT_DEBOUNCE_RELEASE_13,
+#endif
+#ifdef DIRECT_DEBOUNCE_RELEASE_14
+  [13] = DIRECT_DEBOUNCE_RELEASE_14,
+#endif
+#ifdef DIRECT_DEBOUNCE_RELEASE_15
+  [14] = DIRECT_DEBOUNCE_RELEASE_15,
+#endif
+};
+
+static direct_keys_t DebounceCount[DEBOUNCE_BITS];
+static direct_keys_t DebouncePress[DEBOUNCE_BITS], DebounceRelease[DEBOUNCE_BITS];
+// Debounced keys, 1 for pressed; only written by the tick.
+static volatile direct_keys_t DebounceState;
+
+static void SetDebounceThresholds(uint8_t press, uint8_t release)
+{
+  direct_keys_t pressPlanes[DEBOUNCE_BITS] = { 0 }, releasePlanes[DEBOUNCE_BITS] = { 0 };
+  for (uint8_t key = 0; key < DIRECT_KEYS_MAX; key++) {
+    uint8_t keyPress = pgm_read_byte(DirectDebouncePress + key);
+    uint8_t keyRelease = pgm_read_byte(DirectDebounceRelease + key);
+    if (keyPress == 0) keyPress = press;
+    if (keyRelease == 0) keyRelease = release;
+    for (uint8_t i = 0; i < DEBOUNCE_BITS; i++) {
+      if (keyPress & (1 << i)) pressPlanes[i] |= (direct_keys_t)1 << key;
+      if (keyRelease & (1 << i)) releasePlanes[i] |= (direct_keys_t)1 << key;
+    }
+  }
+  cli();
+  for (uint8_t i = 0; i < DEBOUNCE_BITS; i++) {
+    DebouncePress[i] = pressPlanes[i];
+    DebounceRelease[i] = releasePlanes[i];
+    DebounceCount[i] = 0;
+  }
+  sei();
+}
+
+// Called from the tick interrupt, once a millisecond.
+static inline void DebounceTick(void)
+{
+  direct_keys_t state = DebounceState;
+  direct_keys_t differ = ReadDirectKeys() ^ state;
+  direct_keys_t carry = differ, reached = differ;
+  for (uint8_t i = 0; i < DEBOUNCE_BITS; i++) {
+    direct_keys_t bit = DebounceCount[i];
+    bit ^= carry;
+    carry &= DebounceCount[i];
+    bit &= differ;
+    DebounceCount[i] = bit;
+    direct_keys_t threshold = (state & DebounceRelease[i]) | (~state & DebouncePress[i]);
+    reached &= ~(bit ^ threshold);
+  }
+  if (reached != 0) {
+    DebounceState = state ^ reached;
+    for (uint8_t i = 0; i < DEBOUNCE_BITS; i++) {
+      DebounceCount[i] &= ~reached;
+    }
+  }
+}
+#endif
+
 #endif
 
 /*** Bell / buzzer / speaker on C6 for BEL ***/
@@ -135,7 +499,15 @@ static inline direct_keys_t ReadDirectKeys(void)
 #define BELL_MODE BELL_MODE_NONE
 #endif
 
-#if BELL_MODE == BELL_MODE_NONE
+#ifdef RUNTIME_SETTINGS
+// Set from the bell mode; sbi / cbi either way, as the ISR shares the port.
+static bool BellOnHigh, BellOffHigh;
+#define BELL_SET(high) do { if (high) BELL_PORT |= BELL_MASK; else BELL_PORT &= ~BELL_MASK; } while (0)
+#define BELL_OFF BELL_SET(BellOffHigh)
+#define BELL_ON BELL_SET(BellOnHigh)
+#define BELL_TONE (Settings.bellMode == BELL_MODE_TONE)
+#define BELL_ENABLED 1
+#elif BELL_MODE == BELL_MODE_NONE
 #define BELL_OFF {}
 #define BELL_ON {}
 #elif BELL_MODE == BELL_MODE_LOW
@@ -145,8 +517,14 @@ static inline direct_keys_t ReadDirectKeys(void)
 #define BELL_OFF BELL_PORT &= ~BELL_MASK
 #define BELL_ON BELL_PORT |= BELL_MASK
 #elif BELL_MODE == BELL_MODE_TONE
-#define BELL_OFF ToneOff()
-#define BELL_ON ToneOn(BELL_TONE_FREQUENCY)
+// Speaker starts and ends low; the timer toggles it in between.
+#define BELL_OFF BELL_PORT &= ~BELL_MASK
+#define BELL_ON BELL_PORT &= ~BELL_MASK
+#endif
+
+#ifndef BELL_ENABLED
+#define BELL_ENABLED (BELL_MODE != BELL_MODE_NONE)
+#define BELL_TONE (BELL_MODE == BELL_MODE_TONE)
 #endif
 
 #ifndef BELL_DURATION_USEC
@@ -159,45 +537,137 @@ static inline direct_keys_t ReadDirectKeys(void)
 #endif
 #endif
 
-#if BELL_MODE == BELL_MODE_TONE
+// Silence between successive bells.
+#ifndef BELL_GAP_USEC
+#define BELL_GAP_USEC 100000
+#endif
 
-// Timer 3, prescaler 8, compare A.
-#define TONE_TIMER_CCRA TCCR3A
-#define TONE_TIMER_CCRB TCCR3B
-#define TONE_TIMER_PRESCALE (1<<CS31)
-#define TONE_TIMER_OCR OCR3A
-#define TONE_TIMER_TCNT TCNT3
-#define TONE_TIMER_IFR TIFR3
-#define TONE_TIMER_MATCH (1<<OCF3A)
-#define TONE_TIMER_MASK TIMSK3
-#define TONE_TIMER_INT (1<<OCIE3A)
-#define TONE_TIMER_VECT TIMER3_COMPA_vect
+// Bells waiting behind the one ringing; any more BELs are merged.
+#ifndef BELL_PENDING_MAX
+#define BELL_PENDING_MAX 2
+#endif
 
 #ifndef BELL_TONE_FREQUENCY
 #define BELL_TONE_FREQUENCY 200
 #endif
 
-static uint16_t ToneTimerWidth;
+#if BELL_ENABLED
+
+// Timer 3, prescaler 8, compare A, times each phase of the bell so
+// that the main loop never waits for it.
+#define BELL_TIMER_CCRA TCCR3A
+#define BELL_TIMER_CCRB TCCR3B
+#define BELL_TIMER_PRESCALE (1<<CS31)
+#define BELL_TIMER_OCR OCR3A
+#define BELL_TIMER_TCNT TCNT3
+#define BELL_TIMER_IFR TIFR3
+#define BELL_TIMER_MATCH (1<<OCF3A)
+#define BELL_TIMER_MASK TIMSK3
+#define BELL_TIMER_INT (1<<OCIE3A)
+#define BELL_TIMER_VECT TIMER3_COMPA_vect
+
+#define BELL_TIMER_TICKS(usec) ((usec) * (F_CPU / 8 / 1000) / 1000)
+
+// A phase longer than the 16-bit timer can reach is counted off in
+// millisecond steps.
+#define BELL_LONG_USEC 30000
+#define BELL_STEP(usec) ((usec) > BELL_LONG_USEC ? BELL_TIMER_TICKS(1000) : BELL_TIMER_TICKS(usec))
+#define BELL_STEPS(usec) ((usec) > BELL_LONG_USEC ? ((usec) + 500) / 1000 : 1)
+
+// Each step of a tone is half a cycle.
+#define BELL_TONE_STEP(freq) ((F_CPU / 16 + (freq) / 2) / (freq))
+#define BELL_TONE_STEPS(usec, freq) ((usec) * 2UL * (freq) / 1000000)
+
+#ifdef RUNTIME_SETTINGS
+
+static uint16_t BellRingStep, BellRingSteps;
+#define BELL_RING_STEP BellRingStep
+#define BELL_RING_STEPS BellRingSteps
+
+#elif BELL_MODE == BELL_MODE_TONE
+
+#define BELL_RING_STEP BELL_TONE_STEP(BELL_TONE_FREQUENCY)
+#define BELL_RING_STEPS BELL_TONE_STEPS(BELL_DURATION_USEC, BELL_TONE_FREQUENCY)
+
+#else
+
+#define BELL_RING_STEP BELL_STEP(BELL_DURATION_USEC)
+#define BELL_RING_STEPS BELL_STEPS(BELL_DURATION_USEC)
+
+#endif
+
+#define BELL_GAP_STEP BELL_STEP(BELL_GAP_USEC)
+#define BELL_GAP_STEPS BELL_STEPS(BELL_GAP_USEC)
+
+#if BELL_GAP_STEP < 1 || BELL_GAP_STEP > 0xFFFF || BELL_GAP_STEPS < 1 || BELL_GAP_STEPS > 0xFFFF
+#error BELL_GAP_USEC out of range
+#endif
+#if !defined(RUNTIME_SETTINGS) && \
+  (BELL_RING_STEP < 1 || BELL_RING_STEP > 0xFFFF || BELL_RING_STEPS < 1 || BELL_RING_STEPS > 0xFFFF)
+#error BELL_DURATION_USEC out of range
+#endif
+
+static volatile uint8_t BellsPending;
+static bool BellRinging;
+static uint16_t BellStepsLeft;
 
-ISR(TONE_TIMER_VECT)
+ISR(BELL_TIMER_VECT)
 {
-    TONE_TIMER_OCR += ToneTimerWidth;
+  if (BELL_TONE && BellRinging) {
     BELL_PIN |= BELL_MASK;      // Toggle.
+  }
+  if (--BellStepsLeft != 0) {
+    BELL_TIMER_OCR += BellRinging ? BELL_RING_STEP : BELL_GAP_STEP;
+    return;
+  }
+  if (BellRinging) {
+    BELL_OFF;
+    BellRinging = false;
+    if (BellsPending > 0) {
+      BellStepsLeft = BELL_GAP_STEPS;
+      BELL_TIMER_OCR += BELL_GAP_STEP;
+      return;
+    }
+  }
+  if (BellsPending > 0) {
+    BellsPending--;
+    BELL_ON;
+    BellRinging = true;
+    BellStepsLeft = BELL_RING_STEPS;
+    BELL_TIMER_OCR += BELL_RING_STEP;
+  } else {
+    BELL_TIMER_MASK &= ~BELL_TIMER_INT; // Disable interrupt.
+  }
 }
 
-static inline void ToneOff() {
-  TONE_TIMER_MASK &= ~TONE_TIMER_INT; // Disable interrupt.
-}
-
-static void ToneOn(uint16_t frequency) {
-  ToneOff();                   // Just in case.
-  ToneTimerWidth = (F_CPU / 16 + frequency / 2) / frequency;
+static void BellRing(void)
+{
+#ifdef RUNTIME_SETTINGS
+  if (Settings.bellMode == BELL_MODE_NONE) {
+    return;
+  }
+#endif
   cli();
-  TONE_TIMER_IFR |= TONE_TIMER_MATCH; // Clear pending.
-  BELL_PORT &= ~BELL_MASK;
-  TONE_TIMER_OCR = TONE_TIMER_TCNT + ToneTimerWidth; // Resync.
+  if (BELL_TIMER_MASK & BELL_TIMER_INT) {
+    // Already ringing or between bells.
+    if (BellsPending < BELL_PENDING_MAX) {
+      BellsPending++;
+    }
+  } else {
+    BELL_ON;
+    BellRinging = true;
+    BellStepsLeft = BELL_RING_STEPS;
+    BELL_TIMER_IFR |= BELL_TIMER_MATCH; // Clear pending.
+    BELL_TIMER_OCR = BELL_TIMER_TCNT + BELL_RING_STEP; // Resync.
+    BELL_TIMER_MASK |= BELL_TIMER_INT; // Enable interrupt.
+  }
   sei();
-  TONE_TIMER_MASK |= TONE_TIMER_INT; // Enable interrupt.
+}
+
+#else
+
+static inline void BellRing(void)
+{
 }
 
 #endif
@@ -211,11 +681,19 @@ static void ToneOn(uint16_t frequency) {
 #define READY_ACK_MODE_NONE 0
 #define READY_ACK_MODE_DTR 2
 #define READY_ACK_MODE_KEY_ACK 3
+#define READY_ACK_MODE_FLOW 4
 
 #ifndef READY_ACK_MODE
 #define READY_ACK_MODE READY_ACK_MODE_NONE
 #endif
 
+#if READY_ACK_MODE == READY_ACK_MODE_DTR && !USB_HAS_CDC
+#error READY_ACK_MODE_DTR needs the CDC interface
+#endif
+#if READY_ACK_MODE != READY_ACK_MODE_NONE && KBD_CHANNELS > 1
+#error One ready / ack line cannot pace more than one keyboard
+#endif
+
 #define READY_ACK_ON_LOW false
 #define READY_ACK_ON_HIGH true
 
@@ -230,6 +708,14 @@ static void ToneOn(uint16_t frequency) {
 #define READY_ACK_ON_STATE READY_ACK_ON_HIGH
 #endif
 
+#ifdef RUNTIME_SETTINGS
+static bool ReadyAckOnHigh;
+#define READY_ACK_SET(high) do { if (high) READY_ACK_PORT |= READY_ACK_MASK; else READY_ACK_PORT &= ~READY_ACK_MASK; } while (0)
+#define READY_ACK_OFF READY_ACK_SET(!ReadyAckOnHigh)
+#define READY_ACK_ON READY_ACK_SET(ReadyAckOnHigh)
+#define READY_ACK_MODE_IS(mode) (Settings.readyAckMode == (mode))
+#define READY_ACK_DELAY Settings.readyAckDelayMsec
+#else
 #if READY_ACK_ON_STATE == READY_ACK_ON_LOW
 #define READY_ACK_OFF READY_ACK_PORT |= READY_ACK_MASK
 #define READY_ACK_ON READY_ACK_PORT &= ~READY_ACK_MASK
@@ -237,330 +723,2550 @@ static void ToneOn(uint16_t frequency) {
 #define READY_ACK_OFF READY_ACK_PORT &= ~READY_ACK_MASK
 #define READY_ACK_ON READY_ACK_PORT |= READY_ACK_MASK
 #endif
+#define READY_ACK_MODE_IS(mode) (READY_ACK_MODE == (mode))
+#define READY_ACK_DELAY READY_ACK_DELAY_MSEC
+#endif
 
 /*** Serial input commands ***/
 
 #define ASCII_ENQ 0x05
 #define ASCII_BEL 0x07
+#define ASCII_DLE 0x10
+
+// DLE followed by one of these is a command rather than a character.
+#define COMMAND_QUEUE_STATUS 'q'
+#define COMMAND_STROBE_STATUS 'g'
+#define COMMAND_PROFILE_DUMP 'p'
+#define COMMAND_PROFILE_RESET 'z'
+#define COMMAND_SETTINGS_READ 'r'
+#define COMMAND_SETTINGS_WRITE 'w'
+#define COMMAND_SETTINGS_SAVE 's'
+#define COMMAND_SETTINGS_LOAD 'l'
+#define COMMAND_SETTINGS_DEFAULT 'd'
+#define COMMAND_CAPTURE_START 'c'
+#define COMMAND_CAPTURE_END 'e'
 
 #ifndef ANSWERBACK
 #define ANSWERBACK "Hello\r\n"
 #endif
 
+// Types the answerback with MacroStart.
+#ifdef RUNTIME_SETTINGS
+#define ANSWERBACK_SEND(send) send(Settings.answerback)
+#else
 static const char answerback[] PROGMEM = ANSWERBACK;
+#define ANSWERBACK_SEND(send) send##_P(answerback)
+#endif
 
 /*** Character Queue ***/
 
 typedef struct {
   uint8_t charCode;
-#if DIRECT_KEYS > 0
+#if DIRECT_KEYS_MAX > 0
   direct_keys_t directKeys;
 #endif
+#ifdef DIRECT_KEYS_INTERRUPT
+  bool directOnly;              // A direct key edge, not a strobe.
+#endif
+#if defined(PROFILE) || defined(STROBE_FILTER) || defined(CAPTURE)
+  uint16_t strobeTicks;
+#endif
+#ifdef CAPTURE
+  uint16_t strobeTicksHigh;
+#endif
 } queue_entry_t;
+
+#ifndef QUEUE_SIZE
 #define QUEUE_SIZE 16
-static queue_entry_t CharQueue[QUEUE_SIZE];
-static uint8_t CharQueueIn, CharQueueOut;
+#endif
+#if (QUEUE_SIZE & (QUEUE_SIZE - 1)) != 0 || QUEUE_SIZE > 128
+#error QUEUE_SIZE must be a power of two no larger than 128
+#endif
+#define QUEUE_MASK (QUEUE_SIZE - 1)
+
+// With READY_ACK_MODE_FLOW, ready goes off once this many strobes are
+// waiting, leaving room for a few more from a keyboard slow to notice,
+// and on again once no more than QUEUE_FLOW_LOW are.
+#ifndef QUEUE_FLOW_HIGH
+#define QUEUE_FLOW_HIGH (QUEUE_SIZE - QUEUE_SIZE / 4)
+#endif
+#ifndef QUEUE_FLOW_LOW
+#define QUEUE_FLOW_LOW (QUEUE_SIZE / 4)
+#endif
+#if QUEUE_FLOW_HIGH > QUEUE_SIZE || QUEUE_FLOW_LOW >= QUEUE_FLOW_HIGH
+#error QUEUE_FLOW_LOW and QUEUE_FLOW_HIGH out of range
+#endif
+#if READY_ACK_MODE == READY_ACK_MODE_FLOW || defined(RUNTIME_SETTINGS)
+#define READY_ACK_FLOW 1
+#else
+#define READY_ACK_FLOW 0
+#endif
 
-static inline void QueueClear(void)
+typedef struct {
+  queue_entry_t entries[QUEUE_SIZE];
+  // Strobes lost to a full queue and the most entries ever waiting.
+  // Only written by the ISR.
+  volatile uint16_t overflows;
+  volatile uint8_t highWater;
+} char_queue_t;
+
+// One for each keyboard, always indexed by a constant in the ISRs.
+static char_queue_t CharQueues[KBD_CHANNELS];
+
+// Single producer (the strobe ISR) advances In; single consumer (the
+// main loop) advances Out. Both run freely and are masked on access,
+// so the difference is the count and no entry is wasted.
+static volatile uint8_t CharQueueIn[KBD_CHANNELS], CharQueueOut[KBD_CHANNELS];
+
+static inline void QueueClear(uint8_t channel)
 {
-  CharQueueIn = CharQueueOut = 0;
+  CharQueueIn[channel] = CharQueueOut[channel] = 0;
 }
 
-static inline bool QueueIsEmpty(void)
+static inline bool QueueIsEmpty(uint8_t channel)
 {
-  return (CharQueueIn == CharQueueOut);
+  return (CharQueueIn[channel] == CharQueueOut[channel]);
 }
 
-static inline bool QueueIsFull(void)
+// The oldest entry, left in the queue until QueueDrop.
+static inline queue_entry_t QueuePeek(uint8_t channel)
 {
-  // One entry wasted to be able to check this easily.
-  return (((CharQueueIn + 1) % QUEUE_SIZE) == CharQueueOut);
+  return CharQueues[channel].entries[CharQueueOut[channel] & QUEUE_MASK];
 }
 
-static inline queue_entry_t QueueRemove(void)
+static inline void QueueDrop(uint8_t channel)
 {
-  queue_entry_t entry = CharQueue[CharQueueOut];
-  CharQueueOut = (CharQueueOut + 1) % QUEUE_SIZE;
-  return entry;
+  // Entry must be read before the slot is given back to the ISR.
+  GCC_MEMORY_BARRIER();
+  CharQueueOut[channel]++;
 }
 
-static inline void QueueAdd(queue_entry_t entry)
+// Only called from the ISR.
+static inline void QueueAdd(uint8_t channel, queue_entry_t entry)
 {
-  CharQueue[CharQueueIn] = entry;
-  CharQueueIn = (CharQueueIn + 1) % QUEUE_SIZE;
+  char_queue_t *queue = &CharQueues[channel];
+  uint8_t in = CharQueueIn[channel];
+  uint8_t count = in - CharQueueOut[channel];
+  if (count >= QUEUE_SIZE) {
+    if (queue->overflows != 0xFFFF) {
+      queue->overflows++;
+    }
+    return;
+  }
+  queue->entries[in & QUEUE_MASK] = entry;
+  // Entry must be written before the main loop can see it.
+  GCC_MEMORY_BARRIER();
+  CharQueueIn[channel] = in + 1;
+  count++;
+  if (count > queue->highWater) {
+    queue->highWater = count;
+  }
+#if READY_ACK_FLOW
+  if (count >= QUEUE_FLOW_HIGH && READY_ACK_MODE_IS(READY_ACK_MODE_FLOW)) {
+    READY_ACK_OFF;
+  }
+#endif
 }
 
-/*** Actions ***/
+#if READY_ACK_FLOW
+// Called by the main loop once it has drained what it can.
+static inline void QueueFlowTask(void)
+{
+  if (!READY_ACK_MODE_IS(READY_ACK_MODE_FLOW)) {
+    return;
+  }
+  // Not between the ISR's count and its turning ready off.
+  cli();
+  if ((uint8_t)(CharQueueIn[0] - CharQueueOut[0]) <= QUEUE_FLOW_LOW) {
+    READY_ACK_ON;
+  }
+  sei();
+}
+#endif
 
-#ifdef DEBUG_ACTIONS
+/*** Auto-repeat ***/
 
-static inline char HexDigit(uint8_t i) {
-  return (i < 10) ? '0' + i : 'A' + (i - 10);
-}
+// With AUTO_REPEAT, for a keyboard that strobes once however long a key
+// is held, the last character is typed again from the millisecond tick
+// for as long as the strobe line stays on, or with AUTO_REPEAT_HELD_MASK
+// any of those direct keys: first after AUTO_REPEAT_DELAY_MSEC, then
+// every AUTO_REPEAT_INTERVAL_MSEC. Each wait starts once the main loop
+// has taken the last one, or with READY_ACK_MODE_KEY_ACK once it has
+// been acked, and everything typed has gone to the USB controller, so
+// repeats go no faster than the host reads them and do not pile up
+// while it is not reading.
+#ifdef AUTO_REPEAT
 
-static void CharAction(uint8_t charCode)
-{
-  char str[] = "00 ?\r\n";
-  str[0] = HexDigit(charCode >> 4);
-  str[1] = HexDigit(charCode & 0x0F);
-  str[3] = charCode >= ' ' && charCode <= '~' ? charCode : ' ';
-  CDC_Device_SendString(&VirtualSerial_CDC_Interface, str);
-}
+#if defined(RUNTIME_SETTINGS) || KBD_CHANNELS > 1
+#error AUTO_REPEAT follows one keyboard with fixed settings
+#endif
+#ifdef CAPTURE
+#error AUTO_REPEAT would add strobes the keyboard never made to a capture
+#endif
+#if defined(AUTO_REPEAT_HELD_MASK) && DIRECT_KEYS == 0
+#error AUTO_REPEAT_HELD_MASK needs the direct keys
+#endif
+
+#ifndef AUTO_REPEAT_DELAY_MSEC
+#define AUTO_REPEAT_DELAY_MSEC 500
+#endif
+#ifndef AUTO_REPEAT_INTERVAL_MSEC
+#define AUTO_REPEAT_INTERVAL_MSEC 67
+#endif
+#if AUTO_REPEAT_DELAY_MSEC < 1 || AUTO_REPEAT_DELAY_MSEC > 0xFFFF || \
+  AUTO_REPEAT_INTERVAL_MSEC < 1 || AUTO_REPEAT_INTERVAL_MSEC > 0xFFFF
+#error AUTO_REPEAT_DELAY_MSEC or AUTO_REPEAT_INTERVAL_MSEC out of range
+#endif
 
+#if defined(AUTO_REPEAT_HELD_MASK)
+#define REPEAT_HELD ((ReadDirectKeys() & AUTO_REPEAT_HELD_MASK) != 0)
+#elif CONTROL_STROBE_TRIGGER == TRIGGER_RISING
+#define REPEAT_HELD ((CONTROL_PIN & CONTROL_STROBE) != 0)
 #else
+#define REPEAT_HELD ((CONTROL_PIN & CONTROL_STROBE) == 0)
+#endif
 
-static inline void CharAction(uint8_t charCode)
+// Only written by the ISRs, except that the main loop clears Waiting.
+static queue_entry_t RepeatEntry;
+static bool RepeatArmed;
+static volatile bool RepeatWaiting;
+static uint16_t RepeatCountdown;
+// Only the main loop's: what it took has been typed or acked.
+static bool RepeatTyped;
+
+// From the strobe ISR, once it has queued the entry.
+static inline void RepeatStart(queue_entry_t entry)
 {
-  CDC_Device_SendByte(&VirtualSerial_CDC_Interface, charCode);
+  RepeatEntry = entry;
+  RepeatArmed = true;
+  RepeatWaiting = true;
+  RepeatCountdown = AUTO_REPEAT_DELAY_MSEC;
 }
 
+static inline void RepeatTick(void)
+{
+  if (!RepeatArmed) {
+    return;
+  }
+  if (!REPEAT_HELD) {
+    RepeatArmed = false;
+    return;
+  }
+  if (RepeatWaiting || --RepeatCountdown != 0) {
+    return;
+  }
+  queue_entry_t entry = RepeatEntry;
+  // The direct keys as they are now, not as they were at the strobe.
+#ifdef DIRECT_DEBOUNCE_PER_KEY
+  entry.directKeys = DebounceState;
+#elif DIRECT_KEYS_MAX > 0
+  entry.directKeys = ReadDirectKeys();
 #endif
+#ifdef PROFILE
+  entry.strobeTicks = PROFILE_TIMER_TCNT;
+#endif
+  QueueAdd(0, entry);
+  RepeatWaiting = true;
+  RepeatCountdown = AUTO_REPEAT_INTERVAL_MSEC;
+}
 
-#if DIRECT_KEYS > 0
-
-#ifdef DEBUG_ACTIONS
-
-static void DirectKeyAction(uint8_t key, bool pressed)
+// From the main loop, once what it took has been typed or acked.
+static inline void RepeatTaken(void)
 {
-  char str[] = "D-00:?\r\n";
-  str[2] = HexDigit(key / 10);
-  str[3] = HexDigit(key % 10);
-  str[5] = pressed ? 'D' : 'U';
-  CDC_Device_SendString(&VirtualSerial_CDC_Interface, str);
+  RepeatTyped = true;
 }
 
-#ifdef DIRECT_ESC_PREFIX_MASK
-static void CharEscPrefixAction(uint8_t charCode)
+// From the main loop, once all that has gone to the host.
+static inline void RepeatSent(void)
 {
-  char str[] = "00 ESC ?\r\n";
-  str[0] = HexDigit(charCode >> 4);
-  str[1] = HexDigit(charCode & 0x0F);
-  str[7] = charCode;
-  CDC_Device_SendString(&VirtualSerial_CDC_Interface, str);
+  if (!RepeatTyped) {
+    return;
+  }
+  RepeatTyped = false;
+  // A strobe coming in between is not the one just typed.
+  cli();
+  if (QueueIsEmpty(0)) {
+    RepeatWaiting = false;
+  }
+  sei();
 }
-#endif
 
 #else
 
-typedef void (*direct_action_t)(uint8_t key, bool pressed);
+static inline void RepeatTaken(void)
+{
+}
+
+#endif
+
+/*** Output to the terminal's display or printer on D1-D7, F0, E6 ***/
+
+// With OUTPUT_PORT, what the host sends, other than ENQ, BEL and DLE
+// commands, goes to the other half of the terminal: seven data bits
+// on D1-D7, where the direct keys would otherwise be, latched by a
+// strobe on F0, with an optional busy or ack line back on E6. It waits
+// in a queue and goes out from the millisecond tick, or in ack mode
+// from the ack of the last character, so the main loop never waits on
+// a slow printer.
+#ifdef OUTPUT_PORT
+
+#if !USB_HAS_CDC
+#error OUTPUT_PORT needs the CDC interface
+#endif
+#if DIRECT_KEYS_MAX > 0 || KBD_CHANNELS > 1
+#error OUTPUT_PORT uses the direct key pins
+#endif
+
+#define OUTPUT_DATA_PORT PORTD
+#define OUTPUT_DATA_DDR DDRD
+#define OUTPUT_DATA_SHIFT 1
+#define OUTPUT_DATA_MASK (0x7F << OUTPUT_DATA_SHIFT)
+
+#define OUTPUT_STROBE_PORT PORTF
+#define OUTPUT_STROBE_DDR DDRF
+#define OUTPUT_STROBE_MASK (1 << 0)
+
+#define OUTPUT_HANDSHAKE_PORT PORTE
+#define OUTPUT_HANDSHAKE_PIN PINE
+#define OUTPUT_HANDSHAKE_MASK (1 << 6)
+#define OUTPUT_HANDSHAKE_INTERRUPT (1 << INT6)
+#define OUTPUT_HANDSHAKE_VECT INT6_vect
+
+#define OUTPUT_HANDSHAKE_NONE 0
+#define OUTPUT_HANDSHAKE_BUSY 1 // Hold off while the line is on.
+#define OUTPUT_HANDSHAKE_ACK 2  // The line turning on ends each character.
+
+#ifndef OUTPUT_HANDSHAKE
+#define OUTPUT_HANDSHAKE OUTPUT_HANDSHAKE_NONE
+#endif
+
+// Centronics: strobe low, busy high, ack low.
+#ifndef OUTPUT_STROBE_ON_STATE
+#define OUTPUT_STROBE_ON_STATE READY_ACK_ON_LOW
+#endif
+#ifndef OUTPUT_HANDSHAKE_ON_STATE
+#if OUTPUT_HANDSHAKE == OUTPUT_HANDSHAKE_BUSY
+#define OUTPUT_HANDSHAKE_ON_STATE READY_ACK_ON_HIGH
+#else
+#define OUTPUT_HANDSHAKE_ON_STATE READY_ACK_ON_LOW
+#endif
+#endif
+
+#ifndef OUTPUT_STROBE_USEC
+#define OUTPUT_STROBE_USEC 1
+#endif
+// Fastest pace without an ack, in ticks.
+#ifndef OUTPUT_CHAR_MSEC
+#define OUTPUT_CHAR_MSEC 1
+#endif
+// How long to wait for an ack before sending the next character anyway.
+#ifndef OUTPUT_ACK_TIMEOUT_MSEC
+#define OUTPUT_ACK_TIMEOUT_MSEC 100
+#endif
+#if OUTPUT_CHAR_MSEC < 1 || OUTPUT_CHAR_MSEC > 0xFF || OUTPUT_ACK_TIMEOUT_MSEC > 0xFF
+#error OUTPUT_CHAR_MSEC or OUTPUT_ACK_TIMEOUT_MSEC out of range
+#endif
+
+#if OUTPUT_STROBE_ON_STATE == READY_ACK_ON_LOW
+#define OUTPUT_STROBE_OFF OUTPUT_STROBE_PORT |= OUTPUT_STROBE_MASK
+#define OUTPUT_STROBE_ON OUTPUT_STROBE_PORT &= ~OUTPUT_STROBE_MASK
+#else
+#define OUTPUT_STROBE_OFF OUTPUT_STROBE_PORT &= ~OUTPUT_STROBE_MASK
+#define OUTPUT_STROBE_ON OUTPUT_STROBE_PORT |= OUTPUT_STROBE_MASK
+#endif
+// Interrupt 6 on the edge that turns the line on.
+#if OUTPUT_HANDSHAKE_ON_STATE == READY_ACK_ON_LOW
+#define OUTPUT_HANDSHAKE_ON (!(OUTPUT_HANDSHAKE_PIN & OUTPUT_HANDSHAKE_MASK))
+#define OUTPUT_HANDSHAKE_TRIGGER (1 << ISC61)
+#else
+#define OUTPUT_HANDSHAKE_ON (OUTPUT_HANDSHAKE_PIN & OUTPUT_HANDSHAKE_MASK)
+#define OUTPUT_HANDSHAKE_TRIGGER ((1 << ISC61) | (1 << ISC60))
+#endif
+
+#ifndef OUTPUT_QUEUE_SIZE
+#define OUTPUT_QUEUE_SIZE 64
+#endif
+#if (OUTPUT_QUEUE_SIZE & (OUTPUT_QUEUE_SIZE - 1)) != 0 || OUTPUT_QUEUE_SIZE > 128
+#error OUTPUT_QUEUE_SIZE must be a power of two no larger than 128
+#endif
+#define OUTPUT_QUEUE_MASK (OUTPUT_QUEUE_SIZE - 1)
+
+// Filled by the main loop, emptied by the tick and the ack interrupt.
+static uint8_t OutputQueue[OUTPUT_QUEUE_SIZE];
+static volatile uint8_t OutputQueueIn, OutputQueueOut;
+// Ticks until the next character may go, or in ack mode until giving
+// up on the ack of the last one.
+static volatile uint8_t OutputWait;
+#if OUTPUT_HANDSHAKE == OUTPUT_HANDSHAKE_ACK
+static volatile bool OutputAckPending;
+#endif
 
-static void DirectBreakAction(uint8_t key, bool pressed)
+static inline bool OutputHasRoom(void)
 {
-  // There is no CDC_Device_SendBreak and the OS driver does not really do anything with this state notification.
-  if (pressed) {
-    LEDs_SetAllLEDs(LEDS_ALL_LEDS);
-    VirtualSerial_CDC_Interface.State.ControlLineStates.DeviceToHost |= CDC_CONTROL_LINE_IN_BREAK;
+  return (uint8_t)(OutputQueueIn - OutputQueueOut) < OUTPUT_QUEUE_SIZE;
+}
+
+static inline bool OutputIsEmpty(void)
+{
+  return OutputQueueIn == OutputQueueOut;
+}
+
+// From the main loop, once OutputHasRoom.
+static inline void OutputByte(uint8_t data)
+{
+  OutputQueue[OutputQueueIn & OUTPUT_QUEUE_MASK] = data;
+  // Byte must be in the slot before the ISR can see it.
+  GCC_MEMORY_BARRIER();
+  OutputQueueIn++;
+}
+
+// With interrupts off: puts the next character on the data lines and
+// strobes it.
+static void OutputSend(void)
+{
+  uint8_t data = OutputQueue[OutputQueueOut++ & OUTPUT_QUEUE_MASK];
+  OUTPUT_DATA_PORT = (OUTPUT_DATA_PORT & ~OUTPUT_DATA_MASK) |
+    ((data << OUTPUT_DATA_SHIFT) & OUTPUT_DATA_MASK);
+  OUTPUT_STROBE_ON;
+  _delay_us(OUTPUT_STROBE_USEC);
+  OUTPUT_STROBE_OFF;
+#if OUTPUT_HANDSHAKE == OUTPUT_HANDSHAKE_ACK
+  OutputAckPending = true;
+  OutputWait = OUTPUT_ACK_TIMEOUT_MSEC;
+#else
+  OutputWait = OUTPUT_CHAR_MSEC;
+#endif
+}
+
+// Each millisecond, from the tick.
+static inline void OutputTick(void)
+{
+  if (OutputWait > 0 && --OutputWait > 0) {
+    return;
+  }
+#if OUTPUT_HANDSHAKE == OUTPUT_HANDSHAKE_ACK
+  // Timed out, or no character since the last ack.
+  OutputAckPending = false;
+#elif OUTPUT_HANDSHAKE == OUTPUT_HANDSHAKE_BUSY
+  if (OUTPUT_HANDSHAKE_ON) {
+    return;
+  }
+#endif
+  if (!OutputIsEmpty()) {
+    OutputSend();
+  }
+}
+
+#if OUTPUT_HANDSHAKE == OUTPUT_HANDSHAKE_ACK
+// The printer has taken the last character; send the next at once,
+// rather than waiting for the tick.
+ISR(OUTPUT_HANDSHAKE_VECT)
+{
+  if (!OutputAckPending) {
+    return;
+  }
+  OutputAckPending = false;
+  if (!OutputIsEmpty()) {
+    OutputSend();
   } else {
-    VirtualSerial_CDC_Interface.State.ControlLineStates.DeviceToHost &= ~CDC_CONTROL_LINE_IN_BREAK;
-    LEDs_SetAllLEDs(LEDS_NO_LEDS);
+    OutputWait = 0;
+  }
+}
+#endif
+
+static void OutputInit(void)
+{
+  OUTPUT_DATA_DDR |= OUTPUT_DATA_MASK;
+  OUTPUT_STROBE_OFF;
+  OUTPUT_STROBE_DDR |= OUTPUT_STROBE_MASK;
+#if OUTPUT_HANDSHAKE != OUTPUT_HANDSHAKE_NONE
+  // Pulled up rather than left floating.
+  OUTPUT_HANDSHAKE_PORT |= OUTPUT_HANDSHAKE_MASK;
+#endif
+#if OUTPUT_HANDSHAKE == OUTPUT_HANDSHAKE_ACK
+  EICRB |= OUTPUT_HANDSHAKE_TRIGGER;
+  EIFR = OUTPUT_HANDSHAKE_INTERRUPT;
+  EIMSK |= OUTPUT_HANDSHAKE_INTERRUPT;
+#endif
+}
+
+#endif
+
+/*** Millisecond Clock on Timer 0 ***/
+
+// Anything timed in milliseconds counts Timer 0 compare interrupts,
+// which run before enumeration and through suspend, and do not move
+// with the host's frame timing. Sleeping relies on the same tick to
+// wake for host input, timeouts and direct keys.
+#if (DIRECT_DEBOUNCE > 0) || defined(DIRECT_DEBOUNCE_PER_KEY) || (READY_ACK_DELAY_MSEC > 0) || \
+  (TX_COALESCE_FRAMES > 0) || defined(RUNTIME_SETTINGS) || defined(SLEEP_IDLE) || defined(OUTPUT_PORT) || \
+  defined(AUTO_REPEAT)
+#define TICK_TIMER 1
+#endif
+
+// Only the HID class driver's idle period still counts USB frames.
+#if USB_HAS_HID && !defined(ENABLE_SOF_EVENTS)
+#error ENABLE_SOF_EVENTS must be turned on for HID
+#endif
+
+#ifdef ENABLE_SOF_EVENTS
+void EVENT_USB_Device_StartOfFrame(void)
+{
+#if USB_HAS_HID
+  HID_Device_MillisecondElapsed(&Keyboard_HID_Interface);
+#endif
+}
+#endif
+
+#ifdef TICK_TIMER
+// Free running with prescaler 64 (4 usec ticks at 16MHz), the compare
+// moving on a millisecond each time.
+#define TICK_TIMER_CCRA TCCR0A
+#define TICK_TIMER_CCRB TCCR0B
+#define TICK_TIMER_PRESCALE ((1<<CS01)|(1<<CS00))
+#define TICK_TIMER_OCR OCR0A
+#define TICK_TIMER_TCNT TCNT0
+#define TICK_TIMER_IFR TIFR0
+#define TICK_TIMER_MATCH (1<<OCF0A)
+#define TICK_TIMER_MASK TIMSK0
+#define TICK_TIMER_INT (1<<OCIE0A)
+#define TICK_TIMER_VECT TIMER0_COMPA_vect
+#define TICK_TIMER_STEP (F_CPU / 64 / 1000)
+#if TICK_TIMER_STEP > 0xFF
+#error TICK_TIMER_STEP does not fit in Timer 0
+#endif
+
+// Milliseconds since startup, wrapping. Only written by the tick.
+static volatile uint16_t millisCounter = 0;
+
+typedef struct {
+  uint16_t millis;
+  uint8_t ticks;                // Into the millisecond.
+} clock_time_t;
+
+ISR(TICK_TIMER_VECT)
+{
+  TICK_TIMER_OCR += TICK_TIMER_STEP;
+  millisCounter++;
+#ifdef DIRECT_DEBOUNCE_PER_KEY
+  DebounceTick();
+#endif
+#ifdef OUTPUT_PORT
+  OutputTick();
+#endif
+#ifdef AUTO_REPEAT
+  RepeatTick();
+#endif
+}
+
+// From the main loop, which may see the counter mid-update otherwise.
+static inline uint16_t Millis(void)
+{
+  cli();
+  uint16_t result = millisCounter;
+  sei();
+  return result;
+}
+
+// Only READY_ACK_DELAY times anything finer than a millisecond.
+#if READY_ACK_DELAY_MSEC > 0 || defined(RUNTIME_SETTINGS)
+static clock_time_t ClockNow(void)
+{
+  clock_time_t result;
+  cli();
+  result.millis = millisCounter;
+  result.ticks = TICK_TIMER_TCNT - (uint8_t)(TICK_TIMER_OCR - TICK_TIMER_STEP);
+  sei();
+  // Matched, but the interrupt has not run yet.
+  if (result.ticks >= TICK_TIMER_STEP) {
+    result.millis++;
+    result.ticks -= TICK_TIMER_STEP;
+  }
+  return result;
+}
+
+// Ticks since then, good for a minute.
+static uint32_t ClockElapsed(clock_time_t then)
+{
+  clock_time_t now = ClockNow();
+  return (uint32_t)(uint16_t)(now.millis - then.millis) * TICK_TIMER_STEP + now.ticks - then.ticks;
+}
+#endif
+#endif
+
+/*** Transmit Queue ***/
+
+// Everything for the host waits here and is handed to the IN endpoint
+// a packet at a time, whenever it has a bank free, rather than a byte
+// at a time with autoflush. The main loop never waits for the host
+// this way: keys are only taken from the strobe queue while there is
+// room for the longest output of one, so when the host is not reading,
+// they wait there instead.
+#ifndef TX_QUEUE_SIZE
+#define TX_QUEUE_SIZE 64
+#endif
+#if (TX_QUEUE_SIZE & (TX_QUEUE_SIZE - 1)) != 0 || TX_QUEUE_SIZE > 128
+#error TX_QUEUE_SIZE must be a power of two no larger than 128
+#endif
+#define TX_QUEUE_MASK (TX_QUEUE_SIZE - 1)
+
+#define TX_QUEUE_RESERVE 16
+#if TX_QUEUE_SIZE < 2 * TX_QUEUE_RESERVE || TX_QUEUE_SIZE < CDC_TXRX_EPSIZE
+#error TX_QUEUE_SIZE too small
+#endif
+
+#ifndef TX_COALESCE_FRAMES
+// How many frames to hold a partial packet waiting for more.
+#define TX_COALESCE_FRAMES 0
+#endif
+
+
+#ifdef PROFILE
+// Strobe time of the earliest character not yet handed to the USB controller.
+static uint16_t TxStrobeTicks;
+static bool TxStrobePending;
+
+static inline void TxStrobeSent(void)
+{
+  if (TxStrobePending) {
+    PROFILE_END(PROFILE_LATENCY, TxStrobeTicks);
+    TxStrobePending = false;
+  }
+}
+#endif
+
+#if USB_HAS_CDC
+
+typedef struct {
+  uint8_t data[TX_QUEUE_SIZE];
+  uint8_t in, out;
+  // The last packet was full, so the host needs a short one to end the
+  // transfer.
+  bool shortPending;
+#if TX_COALESCE_FRAMES > 0
+  uint16_t startMillis;
+#endif
+} tx_queue_t;
+
+// One for each keyboard's CDC interface. Everything here works on the
+// one that TxSelect last chose, so that replies go back to the port that
+// asked and a keyboard's characters to its own port.
+static tx_queue_t TxQueues[KBD_CHANNELS];
+
+#if KBD_CHANNELS > 1
+static USB_ClassInfo_CDC_Device_t *const TxInterfaces[KBD_CHANNELS] = {
+  &VirtualSerial_CDC_Interface, &VirtualSerial_CDC_Interface_1
+};
+static uint8_t TxChannel;
+#define TX_INTERFACE (TxInterfaces[TxChannel])
+#else
+#define TxChannel 0
+#define TX_INTERFACE (&VirtualSerial_CDC_Interface)
+#endif
+#define TX (TxQueues[TxChannel])
+
+static inline void TxSelect(uint8_t channel)
+{
+#if KBD_CHANNELS > 1
+  TxChannel = channel;
+#endif
+}
+
+static inline uint8_t TxCount(void)
+{
+  return TX.in - TX.out;
+}
+
+// Whether anything is waiting for the endpoint.
+static inline bool TxPending(void)
+{
+  return (TxCount() > 0) || TX.shortPending;
+}
+
+// Hands up to a packet to the IN endpoint if it has a bank free.
+// Returns whether it was sent.
+static bool TxPacket(void)
+{
+  if (USB_DeviceState != DEVICE_STATE_Configured ||
+      TX_INTERFACE->State.LineEncoding.BaudRateBPS == 0) {
+    // No port open to read it.
+    TX.out = TX.in;
+    TX.shortPending = false;
+    return false;
   }
+  Endpoint_SelectEndpoint(TX_INTERFACE->Config.DataINEndpoint.Address);
+  if (!Endpoint_IsINReady()) {
+    return false;
+  }
+  uint8_t length = TxCount();
+  if (length > CDC_TXRX_EPSIZE) {
+    length = CDC_TXRX_EPSIZE;
+  }
+  for (uint8_t i = 0; i < length; i++) {
+    Endpoint_Write_8(TX.data[TX.out++ & TX_QUEUE_MASK]);
+  }
+  Endpoint_ClearIN();
+  TX.shortPending = (length == CDC_TXRX_EPSIZE);
+#if defined(PROFILE) && !USB_HAS_HID
+  if (length > 0) {
+    TxStrobeSent();
+  }
+#endif
+  return true;
+}
+
+// A CDC break goes over the notification endpoint, so it waits here
+// until everything typed before it has gone to the data endpoint: how
+// many times it has changed since the host was last told.
+#if DIRECT_KEYS_MAX > 0 && !defined(DEBUG_ACTIONS) && !USB_HAS_HID
+#define TX_BREAK
+static uint8_t TxBreakChanges;
+
+static inline void TxBreakChange(void)
+{
+  TxBreakChanges++;
+}
+
+// One change each pass, once the queue ahead of it is empty.
+static inline void TxBreakTask(void)
+{
+  if (TxBreakChanges == 0 || TxCount() > 0) {
+    return;
+  }
+  TxBreakChanges--;
+  // There is no CDC_Device_SendBreak and the OS driver does not really do anything with this state notification.
+  VirtualSerial_CDC_Interface.State.ControlLineStates.DeviceToHost ^= CDC_CONTROL_LINE_IN_BREAK;
   CDC_Device_SendControlLineStateChange(&VirtualSerial_CDC_Interface);
 }
+#endif
+
+static void TxByte(uint8_t data)
+{
+  // Everything that writes here checks for room first, keys against
+  // TX_QUEUE_RESERVE and replies a part at a time, so this never waits
+  // for the host; should it ever be full, the byte is dropped.
+  if (TxCount() >= TX_QUEUE_SIZE) {
+    return;
+  }
+#if TX_COALESCE_FRAMES > 0
+  if (TxCount() == 0) {
+    TX.startMillis = Millis();
+  }
+#endif
+  TX.data[TX.in++ & TX_QUEUE_MASK] = data;
+}
 
-#define DIRECT_BREAK DirectBreakAction
+static void TxString(const char *str)
+{
+  while (*str != '\0') {
+    TxByte(*str++);
+  }
+}
 
-static void DirectAnswerbackAction(uint8_t key, bool pressed)
+// Called once per main loop pass, after everything has been staged.
+// Sends as many packets as each endpoint has banks free for.
+static inline void TxTask(void)
 {
-  if (pressed) {
-    CDC_Device_SendString_P(&VirtualSerial_CDC_Interface, answerback);
+  for (uint8_t channel = 0; channel < KBD_CHANNELS; channel++) {
+    TxSelect(channel);
+    while (TxPending()) {
+#if TX_COALESCE_FRAMES > 0
+      // Only a full packet has nothing to wait for.
+      if (TxCount() > 0 && TxCount() < CDC_TXRX_EPSIZE &&
+          (uint16_t)(Millis() - TX.startMillis) < TX_COALESCE_FRAMES) {
+        break;
+      }
+#endif
+      if (!TxPacket()) {
+        break;
+      }
+    }
   }
+#ifdef TX_BREAK
+  TxBreakTask();
+#endif
 }
 
-#define DIRECT_HERE_IS DirectAnswerbackAction
+// What the host sends is taken off the OUT endpoint a bank at a time
+// into here, freeing the bank for the next packet, and then handled as
+// a stream by HostInputTask, rather than a byte each main loop pass.
+#ifndef RX_QUEUE_SIZE
+#define RX_QUEUE_SIZE CDC_TXRX_EPSIZE
+#endif
+#if (RX_QUEUE_SIZE & (RX_QUEUE_SIZE - 1)) != 0 || RX_QUEUE_SIZE > 128
+#error RX_QUEUE_SIZE must be a power of two no larger than 128
+#endif
+#define RX_QUEUE_MASK (RX_QUEUE_SIZE - 1)
 
-#ifdef ANSWERBACK_2
-static void DirectAnswerback2Action(uint8_t key, bool pressed)
+typedef struct {
+  uint8_t data[RX_QUEUE_SIZE];
+  uint8_t in, out;
+  // DLE, or a command still taking input.
+  uint8_t command;
+} rx_queue_t;
+
+// One for each CDC interface, like TxQueues, chosen by TxSelect.
+static rx_queue_t RxQueues[KBD_CHANNELS];
+#define RX (RxQueues[TxChannel])
+
+static inline uint8_t RxCount(void)
 {
-  static const char answerback_2[] PROGMEM = ANSWERBACK_2;
-  if (pressed) {
-    CDC_Device_SendString_P(&VirtualSerial_CDC_Interface, answerback_2);
+  return RX.in - RX.out;
+}
+
+// Moves as much of the OUT bank as there is room for into the queue.
+// Returns whether anything was there.
+static bool RxFill(void)
+{
+  if (USB_DeviceState != DEVICE_STATE_Configured ||
+      TX_INTERFACE->State.LineEncoding.BaudRateBPS == 0) {
+    return false;
   }
+  Endpoint_SelectEndpoint(TX_INTERFACE->Config.DataOUTEndpoint.Address);
+  if (!Endpoint_IsOUTReceived()) {
+    return false;
+  }
+  uint8_t room = RX_QUEUE_SIZE - RxCount();
+  while (room > 0 && Endpoint_BytesInEndpoint() > 0) {
+    RX.data[RX.in++ & RX_QUEUE_MASK] = Endpoint_Read_8();
+    room--;
+  }
+  if (Endpoint_BytesInEndpoint() == 0) {
+    // Including a zero length packet.
+    Endpoint_ClearOUT();
+  }
+  return true;
 }
-#define DIRECT_ANSWERBACK_2 DirectAnswerback2Action
+
 #endif
 
-#ifdef ANSWERBACK_3
-static void DirectAnswerback3Action(uint8_t key, bool pressed)
+/*** HID Keyboard ***/
+
+#if USB_HAS_HID
+
+// What the keyboard types waits here, as ASCII with bit 7 for META, for
+// the class driver to ask for the next report. Only the main loop uses it.
+#ifndef KEY_QUEUE_SIZE
+#define KEY_QUEUE_SIZE 64
+#endif
+#if (KEY_QUEUE_SIZE & (KEY_QUEUE_SIZE - 1)) != 0 || KEY_QUEUE_SIZE > 128
+#error KEY_QUEUE_SIZE must be a power of two no larger than 128
+#endif
+#define KEY_QUEUE_MASK (KEY_QUEUE_SIZE - 1)
+
+// Room to leave for the longest output of one strobe; until there is,
+// strobes wait in the character queue instead.
+#define KEY_QUEUE_RESERVE 16
+#if KEY_QUEUE_SIZE < 2 * KEY_QUEUE_RESERVE
+#error KEY_QUEUE_SIZE too small
+#endif
+
+static uint8_t KeyQueue[KEY_QUEUE_SIZE];
+static uint8_t KeyQueueIn, KeyQueueOut;
+
+// Held down from the next report once the queue ahead of it is empty.
+static bool KeyBreakNext, KeyBreakDown;
+
+static inline bool KeyQueueHasRoom(void)
 {
-  static const char answerback_3[] PROGMEM = ANSWERBACK_3;
-  if (pressed) {
-    CDC_Device_SendString_P(&VirtualSerial_CDC_Interface, answerback_3);
+  return (uint8_t)(KeyQueueIn - KeyQueueOut) <= KEY_QUEUE_SIZE - KEY_QUEUE_RESERVE;
+}
+
+static void KeyByte(uint8_t data)
+{
+  if (KeyQueueIn == KeyQueueOut) {
+    // The class driver only asks for a report once a frame, even when it
+    // did not change; let it ask again in this one.
+    Keyboard_HID_Interface.State.PrevFrameNum = 0xFFFF;
+  }
+  // Only an escape sequence longer than the reserve can find it full.
+  if ((uint8_t)(KeyQueueIn - KeyQueueOut) < KEY_QUEUE_SIZE) {
+    KeyQueue[KeyQueueIn++ & KEY_QUEUE_MASK] = data;
   }
 }
-#define DIRECT_ANSWERBACK_3 DirectAnswerback3Action
+
+// How many more bytes KeyByte can take.
+static inline uint8_t KeyRoom(void)
+{
+  return KEY_QUEUE_SIZE - (uint8_t)(KeyQueueIn - KeyQueueOut);
+}
+
+// Whether every key typed has gone into a report.
+static inline bool KeysSent(void)
+{
+  return KeyQueueIn == KeyQueueOut;
+}
+
+// US layout usage for each ASCII character, with the shift bit. Control
+// characters without a key of their own are zero, and typed with CTRL.
+#define KEY_SHIFT 0x80
+#define S(usage) (KEY_SHIFT | (usage))
+
+static const uint8_t AsciiToHid[128] PROGMEM = {
+  /* 00 */ 0,       0,       0,       0,       0,       0,       0,       0,  // ^@ ^A ^B ^C ^D ^E ^F ^G
+  /* 08 */ 0x2A,    0x2B,    0,       0,       0,       0x28,    0,       0,  // BS HT ^J ^K ^L CR ^N ^O
+  /* 10 */ 0,       0,       0,       0,       0,       0,       0,       0,  // ^P ^Q ^R ^S ^T ^U ^V ^W
+  /* 18 */ 0,       0,       0,       0x29,    0,       0,       0,       0,  // ^X ^Y ^Z ESC ^\ ^] ^^ ^_
+  /* 20 */ 0x2C,    S(0x1E), S(0x34), S(0x20), S(0x21), S(0x22), S(0x24), 0x34,  // SP ! " # $ % & '
+  /* 28 */ S(0x26), S(0x27), S(0x25), S(0x2E), 0x36,    0x2D,    0x37,    0x38,  // ( ) * + , - . /
+  /* 30 */ 0x27,    0x1E,    0x1F,    0x20,    0x21,    0x22,    0x23,    0x24,  // 0 1 2 3 4 5 6 7
+  /* 38 */ 0x25,    0x26,    S(0x33), 0x33,    S(0x36), 0x2E,    S(0x37), S(0x38),  // 8 9 : ; < = > ?
+  /* 40 */ S(0x1F), S(0x04), S(0x05), S(0x06), S(0x07), S(0x08), S(0x09), S(0x0A),  // @ A B C D E F G
+  /* 48 */ S(0x0B), S(0x0C), S(0x0D), S(0x0E), S(0x0F), S(0x10), S(0x11), S(0x12),  // H I J K L M N O
+  /* 50 */ S(0x13), S(0x14), S(0x15), S(0x16), S(0x17), S(0x18), S(0x19), S(0x1A),  // P Q R S T U V W
+  /* 58 */ S(0x1B), S(0x1C), S(0x1D), 0x2F,    0x31,    0x30,    S(0x23), S(0x2D),  // X Y Z [ \ ] ^ _
+  /* 60 */ 0x35,    0x04,    0x05,    0x06,    0x07,    0x08,    0x09,    0x0A,  // ` a b c d e f g
+  /* 68 */ 0x0B,    0x0C,    0x0D,    0x0E,    0x0F,    0x10,    0x11,    0x12,  // h i j k l m n o
+  /* 70 */ 0x13,    0x14,    0x15,    0x16,    0x17,    0x18,    0x19,    0x1A,  // p q r s t u v w
+  /* 78 */ 0x1B,    0x1C,    0x1D,    S(0x2F), S(0x31), S(0x30), S(0x35), 0x4C,  // x y z { | } ~ DEL
+};
+
+#undef S
+
+// Usage and modifiers for typing key, or zero usage for none.
+static uint8_t KeyUsage(uint8_t key, uint8_t *modifier)
+{
+  uint8_t mods = 0;
+  if (key & 0x80) {
+    mods = HID_KEYBOARD_MODIFIER_LEFTALT;
+    key &= 0x7F;
+  }
+  uint8_t code = pgm_read_byte(&AsciiToHid[key]);
+  if (code == 0 && key < ' ') {
+    mods |= HID_KEYBOARD_MODIFIER_LEFTCTRL;
+    // ^A - ^Z on the unshifted letters, the rest on @ [ \ ] ^ _.
+    key |= (key >= 1 && key <= 26) ? 0x60 : 0x40;
+    code = pgm_read_byte(&AsciiToHid[key]);
+  }
+  if (code & KEY_SHIFT) {
+    mods |= HID_KEYBOARD_MODIFIER_LEFTSHIFT;
+  }
+  *modifier = mods;
+  return code & ~KEY_SHIFT;
+}
+
+// Called by the class driver at most once a frame, when the endpoint is
+// free; it sends the report whenever it differs from the last.
+bool CALLBACK_HID_Device_CreateHIDReport(USB_ClassInfo_HID_Device_t* const HIDInterfaceInfo,
+                                         uint8_t* const ReportID,
+                                         const uint8_t ReportType,
+                                         void* ReportData,
+                                         uint16_t* const ReportSize)
+{
+  USB_KeyboardReport_Data_t* KeyboardReport = (USB_KeyboardReport_Data_t*)ReportData;
+  *ReportSize = sizeof(USB_KeyboardReport_Data_t);
+
+  // Each character presses its key and so releases the one before, which
+  // the host sees as a rollover. Only typing the same key again needs a
+  // report with it released in between.
+  static uint8_t keyDown = 0;
+  uint8_t modifier = 0, usage = 0;
+  while (KeyQueueOut != KeyQueueIn) {
+    usage = KeyUsage(KeyQueue[KeyQueueOut & KEY_QUEUE_MASK], &modifier);
+    if (usage == 0) {
+      // Nothing on the keyboard types this.
+      KeyQueueOut++;
+      modifier = 0;
+      continue;
+    }
+    if (usage == keyDown) {
+      usage = modifier = 0;
+      break;
+    }
+    KeyQueueOut++;
+#ifdef PROFILE
+    TxStrobeSent();
 #endif
+    break;
+  }
+  if (KeyQueueOut == KeyQueueIn) {
+    KeyBreakDown = KeyBreakNext;
+  }
+  keyDown = usage;
 
-#ifdef DIRECT_ESC_PREFIX_MASK
-static void CharEscPrefixAction(uint8_t charCode)
+  KeyboardReport->Modifier = modifier;
+  KeyboardReport->KeyCode[0] = usage;
+  if (KeyBreakDown) {
+    KeyboardReport->KeyCode[1] = HID_KEYBOARD_SC_PAUSE;
+  }
+  return false;
+}
+
+void CALLBACK_HID_Device_ProcessHIDReport(USB_ClassInfo_HID_Device_t* const HIDInterfaceInfo,
+                                          const uint8_t ReportID,
+                                          const uint8_t ReportType,
+                                          const void* ReportData,
+                                          const uint16_t ReportSize)
 {
-  uint8_t esc[3];
-  uint8_t i = 0;
-  esc[i++] = '\e';
-#ifdef DIRECT_ESC_PREFIX_VT100
-  esc[i++] = '[';
+  // There are no lock LEDs to drive.
+}
+
+#else
+
+static inline bool KeyQueueHasRoom(void)
+{
+  return TxCount() <= TX_QUEUE_SIZE - TX_QUEUE_RESERVE;
+}
+
+static inline void KeyByte(uint8_t data)
+{
+  TxByte(data);
+}
+
+// How many more bytes KeyByte can take without waiting for the host.
+static inline uint8_t KeyRoom(void)
+{
+  return TX_QUEUE_SIZE - TxCount();
+}
+
+// Whether everything typed has gone into a packet.
+static inline bool KeysSent(void)
+{
+  return TxCount() == 0;
+}
+
+#endif
+
+// What the keyboard types, as opposed to replies to the host.
+#if DIRECT_KEYS_MAX > 0 && defined(DIRECT_ESC_MASK) && !defined(DEBUG_ACTIONS)
+static void KeyData(const uint8_t *data, uint8_t length)
+{
+  while (length-- > 0) {
+    KeyByte(*data++);
+  }
+}
+#endif
+
+#ifdef DEBUG_ACTIONS
+static void KeyString(const char *str)
+{
+  while (*str != '\0') {
+    KeyByte(*str++);
+  }
+}
+#endif
+
+/*** Macros ***/
+
+// MACRO_1 to MACRO_8 are strings in flash that a direct key
+// (DIRECT_MACRO_n) or a character code (MACRO_CHAR_n) types instead.
+// A macro plays out as fast as there is room for it in the transmit or
+// key queue each main loop pass, so that a long one never holds up the
+// USB tasks. The strobe queue is not drained while one
+// plays, so what is typed after it comes after it.
+
+#ifdef MACRO_1
+static const char macro_1[] PROGMEM = MACRO_1;
+#endif
+#ifdef MACRO_2
+static const char macro_2[] PROGMEM = MACRO_2;
+#endif
+#ifdef MACRO_3
+static const char macro_3[] PROGMEM = MACRO_3;
+#endif
+#ifdef MACRO_4
+static const char macro_4[] PROGMEM = MACRO_4;
+#endif
+#ifdef MACRO_5
+static const char macro_5[] PROGMEM = MACRO_5;
+#endif
+#ifdef MACRO_6
+static const char macro_6[] PROGMEM = MACRO_6;
+#endif
+#ifdef MACRO_7
+static const char macro_7[] PROGMEM = MACRO_7;
+#endif
+#ifdef MACRO_8
+static const char macro_8[] PROGMEM = MACRO_8;
+#endif
+
+// Macros started while another plays wait behind it; any more are dropped.
+#ifndef MACRO_QUEUE_SIZE
+#define MACRO_QUEUE_SIZE 4
+#endif
+#if (MACRO_QUEUE_SIZE & (MACRO_QUEUE_SIZE - 1)) != 0 || MACRO_QUEUE_SIZE > 128
+#error MACRO_QUEUE_SIZE must be a power of two no larger than 128
+#endif
+#define MACRO_QUEUE_MASK (MACRO_QUEUE_SIZE - 1)
+
+typedef struct {
+  const char *next;             // Advanced as it plays.
+  bool progmem;
+#if KBD_CHANNELS > 1
+  uint8_t channel;              // Whose port it types on.
+#endif
+} macro_t;
+
+// The one at Out is playing. Only the main loop uses these.
+static macro_t MacroQueue[MACRO_QUEUE_SIZE];
+static uint8_t MacroQueueIn, MacroQueueOut;
+
+static inline bool MacroPlaying(void)
+{
+  return (MacroQueueIn != MacroQueueOut);
+}
+
+static void MacroAdd(const char *str, bool progmem)
+{
+  if ((uint8_t)(MacroQueueIn - MacroQueueOut) < MACRO_QUEUE_SIZE) {
+    macro_t *macro = &MacroQueue[MacroQueueIn++ & MACRO_QUEUE_MASK];
+    macro->next = str;
+    macro->progmem = progmem;
+#if KBD_CHANNELS > 1
+    macro->channel = TxChannel;
+#endif
+  }
+}
+
+static inline void MacroStart(const char *str)
+{
+  MacroAdd(str, false);
+}
+
+static inline void MacroStart_P(const char *str)
+{
+  MacroAdd(str, true);
+}
+
+// Called once per main loop pass, before the strobe queue is drained.
+static void MacroTask(void)
+{
+  while (MacroPlaying()) {
+    macro_t *macro = &MacroQueue[MacroQueueOut & MACRO_QUEUE_MASK];
+#if KBD_CHANNELS > 1
+    TxSelect(macro->channel);
+#endif
+    uint8_t room = KeyRoom();
+    for (;;) {
+      char ch = macro->progmem ? pgm_read_byte(macro->next) : *macro->next;
+      if (ch == '\0') {
+        break;
+      }
+      if (room == 0) {
+        return;
+      }
+      KeyByte(ch);
+      macro->next++;
+      room--;
+    }
+    MacroQueueOut++;
+  }
+}
+
+// The macro that a character types instead of itself, or NULL.
+static inline const char *CharMacro(uint8_t charCode)
+{
+  switch (charCode) {
+#ifdef MACRO_CHAR_1
+  case MACRO_CHAR_1: return macro_1;
+#endif
+#ifdef MACRO_CHAR_2
+  case MACRO_CHAR_2: return macro_2;
+#endif
+#ifdef MACRO_CHAR_3
+  case MACRO_CHAR_3: return macro_3;
+#endif
+#ifdef MACRO_CHAR_4
+  case MACRO_CHAR_4: return macro_4;
+#endif
+#ifdef MACRO_CHAR_5
+  case MACRO_CHAR_5: return macro_5;
+#endif
+#ifdef MACRO_CHAR_6
+  case MACRO_CHAR_6: return macro_6;
+#endif
+#ifdef MACRO_CHAR_7
+  case MACRO_CHAR_7: return macro_7;
+#endif
+#ifdef MACRO_CHAR_8
+  case MACRO_CHAR_8: return macro_8;
+#endif
+  default: return NULL;
+  }
+}
+
+/*** Actions ***/
+
+static inline char HexDigit(uint8_t i) {
+  return (i < 10) ? '0' + i : 'A' + (i - 10);
+}
+
+#ifdef DEBUG_ACTIONS
+
+static void CharAction(uint8_t charCode)
+{
+  char str[] = "00 ?\r\n";
+  str[0] = HexDigit(charCode >> 4);
+  str[1] = HexDigit(charCode & 0x0F);
+  str[3] = charCode >= ' ' && charCode <= '~' ? charCode : ' ';
+  KeyString(str);
+}
+
+#else
+
+static inline void CharAction(uint8_t charCode)
+{
+  KeyByte(charCode);
+}
+
+#endif
+
+#if DIRECT_KEYS_MAX > 0
+
+#ifdef DEBUG_ACTIONS
+
+static void DirectKeyAction(uint8_t key, bool pressed)
+{
+  char str[] = "D-00:?\r\n";
+  str[2] = HexDigit(key / 10);
+  str[3] = HexDigit(key % 10);
+  str[5] = pressed ? 'D' : 'U';
+  KeyString(str);
+}
+
+#ifdef DIRECT_ESC_MASK
+static void CharEscPrefixAction(uint8_t charCode)
+{
+  char str[] = "00 ESC ?\r\n";
+  str[0] = HexDigit(charCode >> 4);
+  str[1] = HexDigit(charCode & 0x0F);
+  str[7] = charCode;
+  KeyString(str);
+}
+#endif
+
+#else
+
+typedef void (*direct_action_t)(uint8_t key, bool pressed);
+
+// Inline, so that those no DIRECT_KEY_n names cost nothing and do not
+// warn; runtime settings still take their addresses.
+#if USB_HAS_HID
+
+static inline void DirectBreakAction(uint8_t key, bool pressed)
+{
+  // Pause / Break, held for as long as the key is.
+  KeyBreakNext = pressed;
+  LEDs_SetAllLEDs(pressed ? LEDS_ALL_LEDS : LEDS_NO_LEDS);
+}
+
+#else
+
+static inline void DirectBreakAction(uint8_t key, bool pressed)
+{
+  // Characters typed before the break go first.
+  TxBreakChange();
+  LEDs_SetAllLEDs(pressed ? LEDS_ALL_LEDS : LEDS_NO_LEDS);
+}
+
+#endif
+
+#define DIRECT_BREAK DirectBreakAction
+
+static inline void DirectAnswerbackAction(uint8_t key, bool pressed)
+{
+  if (pressed) {
+    ANSWERBACK_SEND(MacroStart);
+  }
+}
+
+#define DIRECT_HERE_IS DirectAnswerbackAction
+
+#ifdef ANSWERBACK_2
+static inline void DirectAnswerback2Action(uint8_t key, bool pressed)
+{
+  static const char answerback_2[] PROGMEM = ANSWERBACK_2;
+  if (pressed) {
+    MacroStart_P(answerback_2);
+  }
+}
+#define DIRECT_ANSWERBACK_2 DirectAnswerback2Action
+#endif
+
+#ifdef ANSWERBACK_3
+static inline void DirectAnswerback3Action(uint8_t key, bool pressed)
+{
+  static const char answerback_3[] PROGMEM = ANSWERBACK_3;
+  if (pressed) {
+    MacroStart_P(answerback_3);
+  }
+}
+#define DIRECT_ANSWERBACK_3 DirectAnswerback3Action
+#endif
+
+#define DIRECT_MACRO_ACTION(n) \
+  static inline void DirectMacro##n##Action(uint8_t key, bool pressed) \
+  { \
+    if (pressed) { \
+      MacroStart_P(macro_##n); \
+    } \
+  }
+
+#ifdef MACRO_1
+DIRECT_MACRO_ACTION(1)
+#define DIRECT_MACRO_1 DirectMacro1Action
+#endif
+#ifdef MACRO_2
+DIRECT_MACRO_ACTION(2)
+#define DIRECT_MACRO_2 DirectMacro2Action
+#endif
+#ifdef MACRO_3
+DIRECT_MACRO_ACTION(3)
+#define DIRECT_MACRO_3 DirectMacro3Action
+#endif
+#ifdef MACRO_4
+DIRECT_MACRO_ACTION(4)
+#define DIRECT_MACRO_4 DirectMacro4Action
+#endif
+#ifdef MACRO_5
+DIRECT_MACRO_ACTION(5)
+#define DIRECT_MACRO_5 DirectMacro5Action
+#endif
+#ifdef MACRO_6
+DIRECT_MACRO_ACTION(6)
+#define DIRECT_MACRO_6 DirectMacro6Action
+#endif
+#ifdef MACRO_7
+DIRECT_MACRO_ACTION(7)
+#define DIRECT_MACRO_7 DirectMacro7Action
+#endif
+#ifdef MACRO_8
+DIRECT_MACRO_ACTION(8)
+#define DIRECT_MACRO_8 DirectMacro8Action
+#endif
+
+#ifdef DIRECT_ESC_MASK
+static void CharEscPrefixAction(uint8_t charCode)
+{
+  uint8_t esc[3];
+  uint8_t i = 0;
+  esc[i++] = '\e';
+  if (DIRECT_ESC_VT100) {
+    esc[i++] = '[';
+  }
+  esc[i++] = charCode;
+  KeyData(esc, i);
+}
+#endif
+
+#ifdef RUNTIME_SETTINGS
+
+static const direct_action_t DirectActionFunctions[DIRECT_ACTION_COUNT] PROGMEM = {
+  [DIRECT_ACTION_BREAK] = DirectBreakAction,
+  [DIRECT_ACTION_HERE_IS] = DirectAnswerbackAction,
+#ifdef ANSWERBACK_2
+  [DIRECT_ACTION_ANSWERBACK_2] = DirectAnswerback2Action,
+#endif
+#ifdef ANSWERBACK_3
+  [DIRECT_ACTION_ANSWERBACK_3] = DirectAnswerback3Action,
+#endif
+#ifdef MACRO_1
+  [DIRECT_ACTION_MACRO_1] = DirectMacro1Action,
+#endif
+#ifdef MACRO_2
+  [DIRECT_ACTION_MACRO_2] = DirectMacro2Action,
+#endif
+#ifdef MACRO_3
+  [DIRECT_ACTION_MACRO_3] = DirectMacro3Action,
+#endif
+#ifdef MACRO_4
+  [DIRECT_ACTION_MACRO_4] = DirectMacro4Action,
+#endif
+#ifdef MACRO_5
+  [DIRECT_ACTION_MACRO_5] = DirectMacro5Action,
+#endif
+#ifdef MACRO_6
+  [DIRECT_ACTION_MACRO_6] = DirectMacro6Action,
+#endif
+#ifdef MACRO_7
+  [DIRECT_ACTION_MACRO_7] = DirectMacro7Action,
+#endif
+#ifdef MACRO_8
+  [DIRECT_ACTION_MACRO_8] = DirectMacro8Action,
+#endif
+};
+
+static direct_action_t DirectActions[DIRECT_KEYS_MAX+1];
+
+static void SetDirectActions(const uint8_t *codes)
+{
+  for (uint8_t i = 0; i < DIRECT_KEYS_MAX; i++) {
+    DirectActions[i + 1] = (direct_action_t)pgm_read_ptr(DirectActionFunctions + codes[i]);
+  }
+}
+
+static void DirectKeyAction(uint8_t key, bool pressed)
+{
+  direct_action_t action = DirectActions[key];
+  if (action != NULL) {
+    (*action)(key, pressed);
+  }
+}
+
+#elif defined(DIRECT_DISPATCH_LOOP)
+
+// The table in flash that the dispatch below replaces, for make bench
+// to compare with it.
+static const direct_action_t DirectActions[DIRECT_KEYS_MAX+1] PROGMEM = {
+  NULL,
+#ifdef DIRECT_KEY_1
+  [1] = DIRECT_KEY_1,
+#endif
+#ifdef DIRECT_KEY_2
+  [2] = DIRECT_KEY_2,
+#endif
+#ifdef DIRECT_KEY_3
+  [3] = DIRECT_KEY_3,
+#endif
+#ifdef DIRECT_KEY_4
+  [4] = DIRECT_KEY_4,
+#endif
+#ifdef DIRECT_KEY_5
+  [5] = DIRECT_KEY_5,
+#endif
+#ifdef DIRECT_KEY_6
+  [6] = DIRECT_KEY_6,
+#endif
+#ifdef DIRECT_KEY_7
+  [7] = DIRECT_KEY_7,
+#endif
+#ifdef DIRECT_KEY_8
+  [8] = DIRECT_KEY_8,
+#endif
+#ifdef DIRECT_KEY_9
+  [9] = DIRECT_KEY_9,
+#endif
+#ifdef DIRECT_KEY_10
+  [10] = DIRECT_KEY_10,
+#endif
+#ifdef DIRECT_KEY_11
+  [11] = DIRECT_KEY_11,
+#endif
+#ifdef DIRECT_KEY_12
+  [12] = DIRECT_KEY_12,
+#endif
+#ifdef DIRECT_KEY_13
+  [13] = DIRECT_KEY_13,
+#endif
+#ifdef DIRECT_KEY_14
+  [14] = DIRECT_KEY_14,
+#endif
+#ifdef DIRECT_KEY_15
+  [15] = DIRECT_KEY_15,
+#endif
+};
+
+static void DirectKeyAction(uint8_t key, bool pressed)
+{
+  direct_action_t action = (direct_action_t)pgm_read_ptr(DirectActions + key);
+  if (action != NULL) {
+    (*action)(key, pressed);
+  }
+}
+
+#else
+
+// Each DIRECT_KEY_n is resolved here, so its action is called directly
+// with a constant key and mask, where the compiler can inline it, and a
+// key without one costs nothing.
+#define DIRECT_KEY_DISPATCH(n, action) \
+  if (changed & DIRECT_KEY_MASK(n)) { \
+    action(n, (directKeys & DIRECT_KEY_MASK(n)) != 0); \
+  }
+
+static inline void DirectKeysChanged(direct_keys_t changed, direct_keys_t directKeys)
+{
+#ifdef DIRECT_KEY_1
+  DIRECT_KEY_DISPATCH(1, DIRECT_KEY_1)
+#endif
+#ifdef DIRECT_KEY_2
+  DIRECT_KEY_DISPATCH(2, DIRECT_KEY_2)
+#endif
+#ifdef DIRECT_KEY_3
+  DIRECT_KEY_DISPATCH(3, DIRECT_KEY_3)
+#endif
+#ifdef DIRECT_KEY_4
+  DIRECT_KEY_DISPATCH(4, DIRECT_KEY_4)
+#endif
+#ifdef DIRECT_KEY_5
+  DIRECT_KEY_DISPATCH(5, DIRECT_KEY_5)
+#endif
+#ifdef DIRECT_KEY_6
+  DIRECT_KEY_DISPATCH(6, DIRECT_KEY_6)
+#endif
+#ifdef DIRECT_KEY_7
+  DIRECT_KEY_DISPATCH(7, DIRECT_KEY_7)
+#endif
+#ifdef DIRECT_KEY_8
+  DIRECT_KEY_DISPATCH(8, DIRECT_KEY_8)
+#endif
+#ifdef DIRECT_KEY_9
+  DIRECT_KEY_DISPATCH(9, DIRECT_KEY_9)
+#endif
+#ifdef DIRECT_KEY_10
+  DIRECT_KEY_DISPATCH(10, DIRECT_KEY_10)
+#endif
+#ifdef DIRECT_KEY_11
+  DIRECT_KEY_DISPATCH(11, DIRECT_KEY_11)
+#endif
+#ifdef DIRECT_KEY_12
+  DIRECT_KEY_DISPATCH(12, DIRECT_KEY_12)
+#endif
+#ifdef DIRECT_KEY_13
+  DIRECT_KEY_DISPATCH(13, DIRECT_KEY_13)
+#endif
+#ifdef DIRECT_KEY_14
+  DIRECT_KEY_DISPATCH(14, DIRECT_KEY_14)
+#endif
+#ifdef DIRECT_KEY_15
+  DIRECT_KEY_DISPATCH(15, DIRECT_KEY_15)
+#endif
+}
+
+#endif
+#endif
+
+#if defined(DEBUG_ACTIONS) || defined(RUNTIME_SETTINGS) || defined(DIRECT_DISPATCH_LOOP)
+// Only the keys that changed, lowest first, found by their trailing
+// zeros rather than by testing every key.
+static inline void DirectKeysChanged(direct_keys_t changed, direct_keys_t directKeys)
+{
+  while (changed != 0) {
+    direct_keys_t bit = changed & -changed;
+    DirectKeyAction(__builtin_ctz(changed) + 1, (directKeys & bit) != 0);
+    changed ^= bit;
+  }
+}
+#endif
+#endif
+
+/*** Strobe Filter ***/
+
+#ifdef STROBE_FILTER
+
+// Strobes dropped as too soon after the last, data lines that changed
+// when read again, and strobes dropped because they never agreed.
+// Only written by the ISR.
+static volatile uint16_t StrobeBounces, StrobeGlitches, StrobeUnsettled;
+static volatile bool StrobeHoldoff;
+
+static inline void StrobeCount(volatile uint16_t *counter)
+{
+  if (*counter != 0xFFFF) {
+    (*counter)++;
+  }
+}
+
+ISR(STROBE_TIMER_VECT)
+{
+  StrobeHoldoff = false;
+  STROBE_TIMER_MASK &= ~STROBE_TIMER_INT; // Disable interrupt.
+}
+
+// Only called from the strobe ISR, which may have re-read the data.
+static inline bool StrobeAccept(uint8_t *charCode)
+{
+  if (StrobeHoldoff) {
+    StrobeCount(&StrobeBounces);
+    return false;
+  }
+#if STROBE_SETTLE_USEC > 0
+  uint8_t tries = STROBE_SETTLE_TRIES;
+  for (;;) {
+    _delay_us(STROBE_SETTLE_USEC);
+    uint8_t again = CHAR_PIN;
+    if (again == *charCode) {
+      break;
+    }
+    StrobeCount(&StrobeGlitches);
+    *charCode = again;
+    if (--tries == 0) {
+      StrobeCount(&StrobeUnsettled);
+      return false;
+    }
+  }
+#endif
+#if STROBE_MIN_INTERVAL_USEC > 0
+  // Hold off from when the data was last read.
+  StrobeHoldoff = true;
+  STROBE_TIMER_IFR |= STROBE_TIMER_MATCH; // Clear pending.
+  STROBE_TIMER_OCR = STROBE_TIMER_TCNT + STROBE_TIMER_TICKS(STROBE_MIN_INTERVAL_USEC);
+  STROBE_TIMER_MASK |= STROBE_TIMER_INT; // Enable interrupt.
+#endif
+  return true;
+}
+
+#endif
+
+/*** Strobe Capture ***/
+
+#ifdef CAPTURE
+#if !USB_HAS_CDC
+#error CAPTURE needs the CDC interface
+#endif
+
+// Between DLE c and DLE e, strobes and direct key changes go to the
+// host as frames (see Capture.h) instead of being decoded.
+static bool Capturing, CaptureFirst;
+static uint32_t CaptureLastTicks;
+// CharQueues[0].overflows as of the last frame.
+static uint16_t CaptureLastOverflows;
+// Timer 1 overflows, the high half of the capture time.
+static volatile uint16_t CaptureTicksOverflows;
+
+ISR(CAPTURE_TIMER_VECT)
+{
+  CaptureTicksOverflows++;
+}
+
+// The high half of the time whose low half was just read, with
+// interrupts off.
+static inline uint16_t CaptureTicksHigh(uint16_t ticks)
+{
+  uint16_t high = CaptureTicksOverflows;
+  // Wrapped before it was read, but not yet counted.
+  if ((CAPTURE_TIMER_IFR & CAPTURE_TIMER_OVERFLOW) && ticks < 0x8000) {
+    high++;
+  }
+  return high;
+}
+
+static uint32_t CaptureNow(void)
+{
+  cli();
+  uint16_t ticks = CAPTURE_TIMER_TCNT;
+  uint16_t high = CaptureTicksHigh(ticks);
+  sei();
+  return ((uint32_t)high << 16) | ticks;
+}
+
+static void CaptureFrame(uint8_t kind, uint8_t charCode, uint16_t directKeys, uint32_t ticks)
+{
+  cli();
+  uint16_t overflows = CharQueues[0].overflows;
+  sei();
+  if (overflows != CaptureLastOverflows) {
+    kind |= CAPTURE_FRAME_LOST;
+    CaptureLastOverflows = overflows;
+  }
+  TxByte(CAPTURE_FRAME | kind);
+  if (kind & CAPTURE_FRAME_STROBE) {
+    TxByte(charCode);
+  }
+  if (kind & CAPTURE_FRAME_KEYS) {
+    TxByte(directKeys & 0xFF);
+    TxByte(directKeys >> 8);
+  }
+  uint32_t delta = CaptureFirst ? 0 : ticks - CaptureLastTicks;
+  CaptureFirst = false;
+  CaptureLastTicks = ticks;
+  while (delta >= 0x80) {
+    TxByte(0x80 | (delta & 0x7F));
+    delta >>= 7;
+  }
+  TxByte(delta);
+}
+
+// Drains the strobe queue in place of decoding it, as long as the
+// frames fit without waiting for the host.
+static inline void CaptureTask(void)
+{
+  while (!QueueIsEmpty(0) && TxCount() <= TX_QUEUE_SIZE - CAPTURE_FRAME_MAX) {
+    queue_entry_t entry = QueuePeek(0);
+    QueueDrop(0);
+    uint8_t kind = CAPTURE_FRAME_STROBE;
+    uint16_t directKeys = 0;
+#if DIRECT_KEYS_MAX > 0
+    kind |= CAPTURE_FRAME_KEYS;
+    directKeys = entry.directKeys;
+#endif
+#ifdef DIRECT_KEYS_INTERRUPT
+    if (entry.directOnly) {
+      kind &= ~CAPTURE_FRAME_STROBE;
+    }
+#endif
+    CaptureFrame(kind, entry.charCode, directKeys,
+                 ((uint32_t)entry.strobeTicksHigh << 16) | entry.strobeTicks);
+  }
+}
+
+#endif
+
+/*** Interrupt Handler ***/
+
+ISR(INT0_vect)
+{
+  queue_entry_t entry;
+
+  entry.charCode = ChannelRead(0);
+  PROFILE_BEGIN(isrStart);
+#ifdef PROFILE
+  entry.strobeTicks = isrStart;
+#elif defined(STROBE_FILTER)
+  entry.strobeTicks = STROBE_TIMER_TCNT;
+#elif defined(CAPTURE)
+  entry.strobeTicks = CAPTURE_TIMER_TCNT;
+#endif
+#ifdef CAPTURE
+  entry.strobeTicksHigh = CaptureTicksHigh(entry.strobeTicks);
+#endif
+#ifdef STROBE_FILTER
+  if (!StrobeAccept(&entry.charCode)) {
+    PROFILE_END(PROFILE_STROBE_ISR, isrStart);
+    return;
+  }
+#endif
+#ifdef DIRECT_DEBOUNCE_PER_KEY
+  entry.directKeys = DebounceState;
+#elif DIRECT_KEYS_MAX > 0
+  entry.directKeys = ReadDirectKeys();
+#endif
+#ifdef DIRECT_KEYS_INTERRUPT
+  entry.directOnly = false;
+#endif
+
+  QueueAdd(0, entry);
+#ifdef AUTO_REPEAT
+  RepeatStart(entry);
+#endif
+  PROFILE_END(PROFILE_STROBE_ISR, isrStart);
+}
+
+#if KBD_CHANNELS > 1
+// The second keyboard, which has nothing else to look at.
+ISR(INT1_vect)
+{
+  queue_entry_t entry;
+
+  entry.charCode = ChannelRead(1);
+  PROFILE_BEGIN(isrStart);
+#ifdef PROFILE
+  entry.strobeTicks = isrStart;
+#endif
+
+  QueueAdd(1, entry);
+  PROFILE_END(PROFILE_STROBE_ISR, isrStart);
+}
+#endif
+
+#ifdef DIRECT_KEYS_INTERRUPT
+// Set when the direct keys need reading by the main loop: at startup
+// and, when debouncing, after an edge.
+static volatile bool DirectKeysDirty = true;
+#if DIRECT_DEBOUNCE > 0
+static volatile uint16_t DirectKeysEdgeMillis;
+#endif
+
+static inline void DirectKeysEdge(void)
+{
+#if DIRECT_DEBOUNCE > 0
+  // Wait for them to be quiet for the debounce interval.
+  DirectKeysEdgeMillis = millisCounter;
+  DirectKeysDirty = true;
+#else
+  // Into the same queue as strobes, so the order between them is kept.
+  queue_entry_t entry;
+  entry.charCode = 0;
+  entry.directKeys = ReadDirectKeys();
+  entry.directOnly = true;
+#ifdef PROFILE
+  entry.strobeTicks = PROFILE_TIMER_TCNT;
+#elif defined(STROBE_FILTER)
+  entry.strobeTicks = STROBE_TIMER_TCNT;
+#elif defined(CAPTURE)
+  entry.strobeTicks = CAPTURE_TIMER_TCNT;
+#endif
+#ifdef CAPTURE
+  entry.strobeTicksHigh = CaptureTicksHigh(entry.strobeTicks);
+#endif
+  QueueAdd(0, entry);
+#endif
+}
+
+ISR(INT1_vect)
+{
+  DirectKeysEdge();
+}
+
+ISR(INT2_vect)
+{
+  DirectKeysEdge();
+}
+
+ISR(INT3_vect)
+{
+  DirectKeysEdge();
+}
+
+// Whether the main loop should read the direct keys now.
+static inline bool DirectKeysDue(void)
+{
+  if (!DirectKeysDirty) {
+    return false;
+  }
+#if DIRECT_DEBOUNCE > 0
+  cli();
+  bool due = (uint16_t)(millisCounter - DirectKeysEdgeMillis) > DIRECT_DEBOUNCE;
+  if (due) {
+    DirectKeysDirty = false;
+  }
+  sei();
+  return due;
+#else
+  DirectKeysDirty = false;
+  return true;
+#endif
+}
+#endif
+
+
+#if READY_ACK_MODE == READY_ACK_MODE_DTR || defined(RUNTIME_SETTINGS)
+void EVENT_CDC_Device_ControLineStateChanged(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo)
+{
+  if (!READY_ACK_MODE_IS(READY_ACK_MODE_DTR)) {
+    return;
+  }
+  if (CDCInterfaceInfo->State.ControlLineStates.HostToDevice & CDC_CONTROL_LINE_OUT_DTR) {
+    READY_ACK_ON;
+  } else {
+    READY_ACK_OFF;
+  }
+}
+#endif
+
+#if DIRECT_KEYS_MAX > 0
+#ifdef DIRECT_KEYS_INTERRUPT
+// Read by DirectKeysDue instead.
+#elif defined(DIRECT_DEBOUNCE_PER_KEY)
+static inline bool ReadDirectKeysDebounce(direct_keys_t *ret)
+{
+  // Already debounced by the tick.
+#if DIRECT_KEYS_MAX > 7
+  cli();
+  *ret = DebounceState;
+  sei();
+#else
+  *ret = DebounceState;
+#endif
+  return true;
+}
+#elif DIRECT_DEBOUNCE == 0 && !defined(RUNTIME_SETTINGS)
+static inline bool ReadDirectKeysDebounce(direct_keys_t *ret)
+{
+  *ret = ReadDirectKeys();
+  return true;
+}
+#else
+static bool ReadDirectKeysDebounce(direct_keys_t *ret)
+{
+  static bool debounceInProgress = false;
+  static direct_keys_t debounceKeys = 0;
+  static uint16_t debounceStart;
+  direct_keys_t current = ReadDirectKeys();
+#ifdef RUNTIME_SETTINGS
+  if (DIRECT_DEBOUNCE_MSEC == 0) {
+    *ret = current;
+    return true;
+  }
+#endif
+  if (debounceInProgress) {
+    if (debounceKeys == current) {
+      *ret = current;
+      return true;
+    }
+  } else {
+    if (debounceKeys == current &&
+        (uint16_t)(Millis() - debounceStart) > DIRECT_DEBOUNCE_MSEC) {
+      debounceInProgress = false;
+      *ret = current;
+      return true;
+    }
+  }
+  debounceKeys = current;
+  debounceInProgress = true;
+  debounceStart = Millis();
+  return false;
+}
+#endif
+
+// Not inlined, so that make budget can find and count it.
+static void __attribute__((noinline)) UpdateDirectKeys(direct_keys_t directKeysNext)
+{
+  static direct_keys_t directKeysPrev = 0;
+  if (directKeysPrev != directKeysNext) {
+#ifdef CAPTURE
+    if (Capturing) {
+      // Polled, so only the time it was noticed.
+      CaptureFrame(CAPTURE_FRAME_KEYS, 0, directKeysNext, CaptureNow());
+      directKeysPrev = directKeysNext;
+      return;
+    }
 #endif
-  esc[i++] = charCode;
-  CDC_Device_SendData(&VirtualSerial_CDC_Interface, esc, i);
+    DirectKeysChanged(directKeysPrev ^ directKeysNext, directKeysNext);
+    directKeysPrev = directKeysNext;
+  }
 }
 #endif
 
-static const direct_action_t direct_actions[DIRECT_KEYS+1] PROGMEM = {
-  NULL,
+/*** Runtime Settings ***/
+
+#ifdef RUNTIME_SETTINGS
+
+// DIRECT_KEY_n name stored action codes here, rather than functions.
+#undef DIRECT_BREAK
+#undef DIRECT_HERE_IS
+#undef DIRECT_ANSWERBACK_2
+#undef DIRECT_ANSWERBACK_3
+#define DIRECT_BREAK DIRECT_ACTION_BREAK
+#define DIRECT_HERE_IS DIRECT_ACTION_HERE_IS
+#define DIRECT_ANSWERBACK_2 DIRECT_ACTION_ANSWERBACK_2
+#define DIRECT_ANSWERBACK_3 DIRECT_ACTION_ANSWERBACK_3
+#undef DIRECT_MACRO_1
+#undef DIRECT_MACRO_2
+#undef DIRECT_MACRO_3
+#undef DIRECT_MACRO_4
+#undef DIRECT_MACRO_5
+#undef DIRECT_MACRO_6
+#undef DIRECT_MACRO_7
+#undef DIRECT_MACRO_8
+#define DIRECT_MACRO_1 DIRECT_ACTION_MACRO_1
+#define DIRECT_MACRO_2 DIRECT_ACTION_MACRO_2
+#define DIRECT_MACRO_3 DIRECT_ACTION_MACRO_3
+#define DIRECT_MACRO_4 DIRECT_ACTION_MACRO_4
+#define DIRECT_MACRO_5 DIRECT_ACTION_MACRO_5
+#define DIRECT_MACRO_6 DIRECT_ACTION_MACRO_6
+#define DIRECT_MACRO_7 DIRECT_ACTION_MACRO_7
+#define DIRECT_MACRO_8 DIRECT_ACTION_MACRO_8
+
+#if DIRECT_KEYS > SETTINGS_DIRECT_KEYS
+#error DIRECT_KEYS out of range
+#endif
+
+_Static_assert(sizeof(ANSWERBACK) <= SETTINGS_ANSWERBACK_SIZE, "ANSWERBACK too long for RUNTIME_SETTINGS");
+
+// What the build options say; used when no saved settings are.
+const kbd_settings_t DefaultSettings PROGMEM = {
+  .version = SETTINGS_VERSION,
+  .flags = 0
+#if CONTROL_STROBE_TRIGGER == TRIGGER_RISING
+    | SETTINGS_STROBE_RISING
+#endif
+#ifdef CHAR_INVERT
+    | SETTINGS_CHAR_INVERT
+#endif
+#ifdef DIRECT_ESC_PREFIX_VT100
+    | SETTINGS_ESC_PREFIX_VT100
+#endif
+#if READY_ACK_ON_STATE == READY_ACK_ON_HIGH
+    | SETTINGS_READY_ACK_ON_HIGH
+#endif
+    ,
+  .charMask = CHAR_MASK,
+  .parityCheck = PARITY_CHECK,
+  .directKeys = DIRECT_KEYS,
+  .directPortUnused = DIRECT_PORT_UNUSED,
+  .directInvertMask = DIRECT_INVERT_MASK,
+#ifdef DIRECT_ESC_PREFIX_MASK
+  .directEscPrefixMask = DIRECT_ESC_PREFIX_MASK,
+#endif
+  .directDebounce = DIRECT_DEBOUNCE,
+  .directActions = {
 #ifdef DIRECT_KEY_1
-  [1] = DIRECT_KEY_1,
+    [0] = DIRECT_KEY_1,
 #endif
 #ifdef DIRECT_KEY_2
-  [2] = DIRECT_KEY_2,
+    [1] = DIRECT_KEY_2,
 #endif
 #ifdef DIRECT_KEY_3
-  [3] = DIRECT_KEY_3,
+    [2] = DIRECT_KEY_3,
 #endif
 #ifdef DIRECT_KEY_4
-  [4] = DIRECT_KEY_4,
+    [3] = DIRECT_KEY_4,
 #endif
 #ifdef DIRECT_KEY_5
-  [5] = DIRECT_KEY_5,
+    [4] = DIRECT_KEY_5,
 #endif
 #ifdef DIRECT_KEY_6
-  [6] = DIRECT_KEY_6,
+    [5] = DIRECT_KEY_6,
 #endif
 #ifdef DIRECT_KEY_7
-  [7] = DIRECT_KEY_7,
+    [6] = DIRECT_KEY_7,
 #endif
 #ifdef DIRECT_KEY_8
-  [8] = DIRECT_KEY_8,
+    [7] = DIRECT_KEY_8,
 #endif
 #ifdef DIRECT_KEY_9
-  [9] = DIRECT_KEY_9,
+    [8] = DIRECT_KEY_9,
 #endif
 #ifdef DIRECT_KEY_10
-  [10] = DIRECT_KEY_10,
+    [9] = DIRECT_KEY_10,
 #endif
 #ifdef DIRECT_KEY_11
-  [11] = DIRECT_KEY_11,
+    [10] = DIRECT_KEY_11,
 #endif
 #ifdef DIRECT_KEY_12
-  [12] = DIRECT_KEY_12,
+    [11] = DIRECT_KEY_12,
 #endif
 #ifdef DIRECT_KEY_13
-  [13] = DIRECT_KEY_13,
+    [12] = DIRECT_KEY_13,
 #endif
 #ifdef DIRECT_KEY_14
-  [14] = DIRECT_KEY_14,
+    [13] = DIRECT_KEY_14,
 #endif
 #ifdef DIRECT_KEY_15
-  [15] = DIRECT_KEY_15,
-#endif
+    [14] = DIRECT_KEY_15,
+#endif
+  },
+  .bellMode = BELL_MODE,
+  .bellDurationUsec = BELL_DURATION_USEC,
+  .bellToneFrequency = BELL_TONE_FREQUENCY,
+  .readyAckMode = READY_ACK_MODE,
+  .readyAckDelayMsec = READY_ACK_DELAY_MSEC,
+  .answerback = ANSWERBACK,
 };
 
-static void DirectKeyAction(uint8_t key, bool pressed)
+// Anything that would leave the timers or tables out of range is refused.
+static bool SettingsValid(const kbd_settings_t *settings)
 {
-  direct_action_t action = (direct_action_t)pgm_read_ptr(direct_actions + key);
-  if (action != NULL) {
-    (*action)(key, pressed);
+  if (settings->version != SETTINGS_VERSION ||
+      settings->parityCheck < PARITY_NONE || settings->parityCheck > PARITY_ODD ||
+      settings->directKeys > SETTINGS_DIRECT_KEYS ||
+      settings->bellMode < BELL_MODE_NONE || settings->bellMode > BELL_MODE_TONE ||
+      (settings->readyAckMode != READY_ACK_MODE_NONE &&
+       settings->readyAckMode != READY_ACK_MODE_DTR &&
+       settings->readyAckMode != READY_ACK_MODE_KEY_ACK &&
+       settings->readyAckMode != READY_ACK_MODE_FLOW)) {
+    return false;
   }
+  for (uint8_t i = 0; i < SETTINGS_DIRECT_KEYS; i++) {
+    if (settings->directActions[i] >= DIRECT_ACTION_COUNT) {
+      return false;
+    }
+  }
+  if (settings->bellMode != BELL_MODE_NONE) {
+    uint32_t usec = settings->bellDurationUsec;
+    if (usec < 1 || usec > 2000000) {
+      return false;
+    }
+    if (settings->bellMode == BELL_MODE_TONE) {
+      uint16_t freq = settings->bellToneFrequency;
+      if (freq < 16 || freq > 1000 || BELL_TONE_STEPS(usec, freq) < 1) {
+        return false;
+      }
+    }
+  }
+  return memchr(settings->answerback, '\0', SETTINGS_ANSWERBACK_SIZE) != NULL;
+}
+
+// The data line pullups the settings last turned on.
+static uint8_t CharPortMask;
+
+// Puts Settings into effect.
+static void ApplySettings(void)
+{
+#ifdef DIRECT_DEBOUNCE_PER_KEY
+  // Both ways, clamped to what the counters hold.
+  uint8_t debounce = Settings.directDebounce;
+  if (debounce < 1) debounce = 1;
+  if (debounce > DEBOUNCE_MAX) debounce = DEBOUNCE_MAX;
+  SetDebounceThresholds(debounce, debounce);
+#endif
+
+  cli();
+
+  uint8_t flags = Settings.flags;
+  // Pullups move with the data lines in use; CHAR_PULLUP_MASK keeps its own.
+  uint8_t charPortMask = ((Settings.parityCheck == PARITY_NONE) ? Settings.charMask : 0xFF) | CHAR_PULLUP_MASK;
+  CHAR_PORT = (CHAR_PORT & ~CharPortMask) | charPortMask;
+  CharPortMask = charPortMask;
+  EICRA = (EICRA & ~TRIGGER_RISING) | ((flags & SETTINGS_STROBE_RISING) ? TRIGGER_RISING : TRIGGER_FALLING);
+  Decode_Build(Settings.charMask, (flags & SETTINGS_CHAR_INVERT) != 0, Settings.parityCheck);
+
+  // Pullups move with the keys.
+  uint8_t portMask = DIRECT_PORT_MASK_FOR(Settings.directKeys, Settings.directPortUnused);
+  DIRECT_PORT = (DIRECT_PORT & ~DirectPortMask) | portMask;
+  DirectPortMask = portMask;
+  uint8_t port2Mask = DIRECT_PORT_2_MASK_FOR(Settings.directKeys);
+  DIRECT_PORT_2 = (DIRECT_PORT_2 & ~DirectPort2Mask) | port2Mask;
+  DirectPort2Mask = port2Mask;
+  DirectInvertMask = Settings.directInvertMask & (((direct_keys_t)1 << Settings.directKeys) - 1);
+#ifndef DEBUG_ACTIONS
+  SetDirectActions(Settings.directActions);
+#endif
+
+  // Any bell in progress is cut short.
+  BELL_TIMER_MASK &= ~BELL_TIMER_INT;
+  BellsPending = 0;
+  BellRinging = false;
+  uint32_t usec = Settings.bellDurationUsec;
+  switch (Settings.bellMode) {
+  case BELL_MODE_LOW:
+    BellOnHigh = false;
+    BellOffHigh = true;
+    break;
+  case BELL_MODE_HIGH:
+    BellOnHigh = true;
+    BellOffHigh = false;
+    break;
+  default:
+    BellOnHigh = BellOffHigh = false;
+    break;
+  }
+  if (Settings.bellMode == BELL_MODE_TONE) {
+    BellRingStep = BELL_TONE_STEP(Settings.bellToneFrequency);
+    BellRingSteps = BELL_TONE_STEPS(usec, Settings.bellToneFrequency);
+  } else {
+    BellRingStep = BELL_STEP(usec);
+    BellRingSteps = BELL_STEPS(usec);
+  }
+  BELL_OFF;
+  if (Settings.bellMode != BELL_MODE_NONE) {
+    BELL_DDR |= BELL_MASK;
+  } else {
+    BELL_DDR &= ~BELL_MASK;
+  }
+
+  ReadyAckOnHigh = (flags & SETTINGS_READY_ACK_ON_HIGH) != 0;
+  if (Settings.readyAckMode != READY_ACK_MODE_NONE) {
+    READY_ACK_OFF;
+    READY_ACK_DDR |= READY_ACK_MASK;
+  } else {
+    READY_ACK_DDR &= ~READY_ACK_MASK;
+    READY_ACK_PORT &= ~READY_ACK_MASK;
+  }
+  EVENT_CDC_Device_ControLineStateChanged(&VirtualSerial_CDC_Interface);
+
+  sei();
 }
 
 #endif
+
+/*** Host Commands ***/
+
+#if USB_HAS_CDC
+
+// A reply that may be longer than the room in the transmit queue goes
+// out a part at a time, each no longer than TX_QUEUE_RESERVE or the
+// room left, as HostInputTask finds room, so that the main loop never
+// waits on the host. One at a time: other ports leave their input until
+// it is done.
+typedef struct {
+  uint8_t command;              // What it answers, or 0 for none.
+#if KBD_CHANNELS > 1
+  uint8_t channel;
 #endif
+  uint8_t part;                 // Counted by the command.
+  const char *next;             // The rest of a string, NULL for none.
+} reply_t;
 
-/*** Interrupt Handler ***/
+static reply_t Reply;
 
-ISR(INT0_vect)
+static inline bool ReplyPending(void)
 {
-  queue_entry_t entry;
+  return Reply.command != 0;
+}
 
-  entry.charCode = CHAR_PIN;
-#if DIRECT_KEYS > 0
-  entry.directKeys = ReadDirectKeys();
+static void ReplyStart(uint8_t command, const char *str)
+{
+  Reply.command = command;
+#if KBD_CHANNELS > 1
+  Reply.channel = TxChannel;
 #endif
+  Reply.part = 0;
+  Reply.next = str;
+}
 
-  if (!QueueIsFull()) {
-    QueueAdd(entry);
+// Sends as much of the string at Reply.next as there is room for,
+// clearing it once it has all gone. The answerback in flash and the
+// profile lines need it.
+#if !defined(RUNTIME_SETTINGS) || defined(PROFILE)
+static void ReplyStringPart(bool progmem)
+{
+  while (TxCount() < TX_QUEUE_SIZE) {
+    char ch = progmem ? pgm_read_byte(Reply.next) : *Reply.next;
+    if (ch == '\0') {
+      Reply.next = NULL;
+      return;
+    }
+    TxByte(ch);
+    Reply.next++;
   }
 }
+#endif
+
+// Reply is Q size high-water overflows, all in hex, for the keyboard
+// on the port that asked.
+static void QueueStatusCommand(void)
+{
+  cli();
+  uint16_t overflows = CharQueues[TxChannel].overflows;
+  uint8_t highWater = CharQueues[TxChannel].highWater;
+  sei();
+  char str[] = "Q 00 00 0000\r\n";
+  str[2] = HexDigit(QUEUE_SIZE >> 4);
+  str[3] = HexDigit(QUEUE_SIZE & 0x0F);
+  str[5] = HexDigit(highWater >> 4);
+  str[6] = HexDigit(highWater & 0x0F);
+  str[8] = HexDigit(overflows >> 12);
+  str[9] = HexDigit((overflows >> 8) & 0x0F);
+  str[10] = HexDigit((overflows >> 4) & 0x0F);
+  str[11] = HexDigit(overflows & 0x0F);
+  TxString(str);
+}
 
-#if (DIRECT_DEBOUNCE > 0) || (READY_ACK_DELAY_MSEC > 0)
-#ifndef ENABLE_SOF_EVENTS
-#error ENABLE_SOF_EVENTS must be turned on as well
+#ifdef STROBE_FILTER
+// Reply is G bounces glitches unsettled, all in hex.
+static void StrobeStatusCommand(void)
+{
+  cli();
+  uint16_t counts[3] = { StrobeBounces, StrobeGlitches, StrobeUnsettled };
+  sei();
+  char str[] = "G 0000 0000 0000\r\n";
+  for (uint8_t i = 0; i < 3; i++) {
+    char *digits = str + 2 + i * 5;
+    for (uint8_t j = 0; j < 4; j++) {
+      digits[j] = HexDigit((counts[i] >> (12 - j * 4)) & 0x0F);
+    }
+  }
+  TxString(str);
+}
 #endif
+
+#ifdef PROFILE
+// One line per phase: name count min max histogram, all in hex. Each
+// line is longer than a part. Returns whether there is more.
+static bool ProfileDumpPart(void)
+{
+  static char line[PROFILE_FORMAT_SIZE];
+  if (Reply.next == NULL) {
+    if (Reply.part == PROFILE_NPHASES) {
+      return false;
+    }
+    Profile_FormatPhase(Reply.part++, line);
+    Reply.next = line;
+  }
+  ReplyStringPart(false);
+  return true;
+}
 #endif
 
-#ifdef ENABLE_SOF_EVENTS
-static uint16_t millisCounter = 0;
+#ifdef CAPTURE
+// Reply is C, then frames until the E reply to DLE e.
+static void CaptureStartCommand(void)
+{
+  TxString("C\r\n");
+  cli();
+  CaptureLastOverflows = CharQueues[0].overflows;
+  sei();
+  CaptureFirst = true;
+  Capturing = true;
+}
 
-void EVENT_USB_Device_StartOfFrame(void)
+static void CaptureEndCommand(void)
 {
-  millisCounter++;
+  Capturing = false;
+  TxString("E\r\n");
 }
 #endif
 
-#if READY_ACK_MODE == READY_ACK_MODE_DTR
-void EVENT_CDC_Device_ControLineStateChanged(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo)
+#ifdef RUNTIME_SETTINGS
+
+// Settings being written by the host, two hex digits per byte.
+static kbd_settings_t SettingsPending;
+static uint8_t SettingsPendingDigits;
+static bool SettingsPendingError;
+
+static void SettingsReply(char reply, bool ok)
 {
-  if (CDCInterfaceInfo->State.ControlLineStates.HostToDevice & CDC_CONTROL_LINE_OUT_DTR) {
-    READY_ACK_ON;
-  } else {
-    READY_ACK_OFF;
+  char str[] = "?\r\n";
+  if (ok) {
+    str[0] = reply;
   }
+  TxString(str);
 }
-#endif
 
-#if DIRECT_KEYS > 0
-#if DIRECT_DEBOUNCE == 0
-static inline bool ReadDirectKeysDebounce(direct_keys_t *ret)
+// Runs with settings and makes them the ones used at startup.
+static void SettingsUse(const kbd_settings_t *settings, uint8_t slot)
 {
-  *ret = ReadDirectKeys();
-  return true;
+  Settings = *settings;
+  ApplySettings();
+  Settings_SetBootSlot(slot);
 }
-#else
-static bool ReadDirectKeysDebounce(direct_keys_t *ret)
+
+// Reply is R and the running settings, in hex, with part counting the
+// bytes sent. Returns whether there is more.
+static bool SettingsReadPart(void)
 {
-  static bool debounceInProgress = false;
-  static direct_keys_t debounceKeys = 0;
-  static uint16_t debounceStart;
-  direct_keys_t current = ReadDirectKeys();
-  if (debounceInProgress) {
-    if (debounceKeys == current) {
-      *ret = current;
-      return true;
+  const uint8_t *bytes = (const uint8_t *)&Settings;
+  if (Reply.part == 0) {
+    TxString("R ");
+  }
+  // Leaves room in the part for the R or the CR LF.
+  uint8_t end = Reply.part + (TX_QUEUE_RESERVE - 2) / 2;
+  if (end > sizeof(kbd_settings_t)) {
+    end = sizeof(kbd_settings_t);
+  }
+  for (; Reply.part < end; Reply.part++) {
+    TxByte(HexDigit(bytes[Reply.part] >> 4));
+    TxByte(HexDigit(bytes[Reply.part] & 0x0F));
+  }
+  if (Reply.part < sizeof(kbd_settings_t)) {
+    return true;
+  }
+  TxString("\r\n");
+  return false;
+}
+
+// Takes hex up to a CR, then runs with it if it is valid. Returns
+// whether more is wanted.
+static bool SettingsWriteCommand(uint8_t in)
+{
+  if (in == '\r') {
+    bool ok = !SettingsPendingError &&
+      SettingsPendingDigits == 2 * sizeof(kbd_settings_t) &&
+      SettingsValid(&SettingsPending);
+    if (ok) {
+      Settings = SettingsPending;
+      ApplySettings();
     }
+    SettingsReply('W', ok);
+    SettingsPendingDigits = 0;
+    SettingsPendingError = false;
+    return false;
+  }
+  uint8_t digit;
+  if (in >= '0' && in <= '9') {
+    digit = in - '0';
+  } else if ((in | 0x20) >= 'a' && (in | 0x20) <= 'f') {
+    digit = (in | 0x20) - 'a' + 10;
   } else {
-    if (debounceKeys == current &&
-        millisCounter - debounceStart > DIRECT_DEBOUNCE) {
-      debounceInProgress = false;
-      *ret = current;
-      return true;
-    }
+    SettingsPendingError = true;
+    return true;
   }
-  debounceKeys = current;
-  debounceInProgress = true;
-  debounceStart = millisCounter;
-  return false;
+  if (SettingsPendingDigits >= 2 * sizeof(kbd_settings_t)) {
+    SettingsPendingError = true;
+    return true;
+  }
+  uint8_t *byte = (uint8_t *)&SettingsPending + SettingsPendingDigits / 2;
+  *byte = (SettingsPendingDigits & 1) ? (*byte | digit) : (digit << 4);
+  SettingsPendingDigits++;
+  return true;
+}
+
+static void SettingsSaveCommand(uint8_t slot)
+{
+  bool ok = Settings_Save(slot, &Settings);
+  if (ok) {
+    Settings_SetBootSlot(slot);
+  }
+  SettingsReply('S', ok);
+}
+
+static void SettingsLoadCommand(uint8_t slot)
+{
+  bool ok = Settings_Load(slot, &SettingsPending) && SettingsValid(&SettingsPending);
+  if (ok) {
+    SettingsUse(&SettingsPending, slot);
+  }
+  SettingsReply('L', ok);
+}
+
+static void SettingsDefaultCommand(void)
+{
+  memcpy_P(&SettingsPending, &DefaultSettings, sizeof(kbd_settings_t));
+  SettingsUse(&SettingsPending, SETTINGS_SLOT_DEFAULT);
+  SettingsReply('D', true);
+}
+
+// The rest of a command that takes more than one byte; returns the
+// command while it still wants more.
+static uint8_t HostCommandInput(uint8_t command, uint8_t in)
+{
+  switch (command) {
+  case COMMAND_SETTINGS_WRITE:
+    return SettingsWriteCommand(in) ? command : 0;
+  case COMMAND_SETTINGS_SAVE:
+    SettingsSaveCommand(in - '0');
+    break;
+  case COMMAND_SETTINGS_LOAD:
+    SettingsLoadCommand(in - '0');
+    break;
+  }
+  return 0;
 }
+
 #endif
 
-static void UpdateDirectKeys(direct_keys_t directKeysNext)
+// Returns the command if it takes more input, for HostCommandInput.
+static uint8_t HostCommand(uint8_t command)
 {
-  static direct_keys_t directKeysPrev = 0;
-  if (directKeysPrev != directKeysNext) {
-    direct_keys_t directKeysDiff = directKeysPrev ^ directKeysNext;
-    for (uint8_t i = 0; i < DIRECT_KEYS; i++) {
-      if (directKeysDiff & (1 << i)) {
-        DirectKeyAction(i + 1, (directKeysNext & (1 << i)) != 0);
+  switch (command) {
+  case COMMAND_QUEUE_STATUS:
+    QueueStatusCommand();
+    break;
+#ifdef STROBE_FILTER
+  case COMMAND_STROBE_STATUS:
+    StrobeStatusCommand();
+    break;
+#endif
+#ifdef PROFILE
+  case COMMAND_PROFILE_DUMP:
+    ReplyStart(command, NULL);
+    break;
+  case COMMAND_PROFILE_RESET:
+    Profile_Reset();
+    break;
+#endif
+#ifdef CAPTURE
+  case COMMAND_CAPTURE_START:
+    CaptureStartCommand();
+    break;
+  case COMMAND_CAPTURE_END:
+    CaptureEndCommand();
+    break;
+#endif
+#ifdef RUNTIME_SETTINGS
+  case COMMAND_SETTINGS_READ:
+    ReplyStart(command, NULL);
+    break;
+  case COMMAND_SETTINGS_DEFAULT:
+    SettingsDefaultCommand();
+    break;
+  case COMMAND_SETTINGS_WRITE:
+  case COMMAND_SETTINGS_SAVE:
+  case COMMAND_SETTINGS_LOAD:
+    return command;
+#endif
+  }
+  return 0;
+}
+
+// Sends the next part of Reply; returns whether there is more.
+static bool ReplyPart(void)
+{
+  switch (Reply.command) {
+#ifdef PROFILE
+  case COMMAND_PROFILE_DUMP:
+    return ProfileDumpPart();
+#endif
+#ifdef RUNTIME_SETTINGS
+  case COMMAND_SETTINGS_READ:
+    return SettingsReadPart();
+#else
+  case ASCII_ENQ:
+    ReplyStringPart(true);
+    return Reply.next != NULL;
+#endif
+  }
+  return false;
+}
+
+// Handles what is waiting from the host on the selected port, while a
+// reply would still leave the keyboard its room, so that a burst of
+// requests cannot hold up keys. The rest waits, and the OUT bank with
+// it, until the host has read some replies, or with OUTPUT_PORT until
+// the printer has taken some characters. A reply in parts may fill the
+// queue, so that it goes in full packets; keys only wait behind it.
+static void HostInputTask(void)
+{
+  for (;;) {
+    if (ReplyPending()) {
+#if KBD_CHANNELS > 1
+      if (Reply.channel != TxChannel) {
+        break;
+      }
+#endif
+      if (TxCount() > TX_QUEUE_SIZE - TX_QUEUE_RESERVE) {
+        break;
+      }
+      if (!ReplyPart()) {
+        Reply.command = 0;
       }
+      continue;
+    }
+    if (RxCount() == 0 || TxCount() > TX_QUEUE_SIZE - 2 * TX_QUEUE_RESERVE) {
+      break;
+    }
+    uint8_t in = RX.data[RX.out & RX_QUEUE_MASK];
+#ifdef OUTPUT_PORT
+    if (RX.command == 0 && in != ASCII_DLE && in != ASCII_ENQ && in != ASCII_BEL) {
+      if (!OutputHasRoom()) {
+        break;
+      }
+      OutputByte(in);
+      RX.out++;
+      continue;
+    }
+#endif
+    RX.out++;
+    if (in == 0) {
+      continue;
+    }
+    if (RX.command == ASCII_DLE) {
+      RX.command = HostCommand(in);
+#ifdef RUNTIME_SETTINGS
+    } else if (RX.command != 0) {
+      RX.command = HostCommandInput(RX.command, in);
+#endif
+    } else if (in == ASCII_DLE) {
+      RX.command = ASCII_DLE;
+    } else if (in == ASCII_ENQ) {
+#ifdef RUNTIME_SETTINGS
+      // No longer than the room there is.
+      TxString(Settings.answerback);
+#else
+      ReplyStart(ASCII_ENQ, answerback);
+#endif
+    } else if (in == ASCII_BEL) {
+      BellRing();
     }
-    directKeysPrev = directKeysNext;
   }
 }
+
 #endif
 
 /*** Keyboard Interface ***/
 
 void Parallel_Kbd_Init(void)
 {
-  QueueClear();
+  for (uint8_t channel = 0; channel < KBD_CHANNELS; channel++) {
+    QueueClear(channel);
+  }
+
+#ifdef TICK_TIMER
+  // Free running, normal mode.
+  TICK_TIMER_CCRA = 0;
+  TICK_TIMER_CCRB = TICK_TIMER_PRESCALE;
+  TICK_TIMER_OCR = TICK_TIMER_TCNT + TICK_TIMER_STEP;
+  TICK_TIMER_IFR = TICK_TIMER_MATCH;
+  TICK_TIMER_MASK |= TICK_TIMER_INT;
+#endif
+#if defined(DIRECT_DEBOUNCE_PER_KEY) && !defined(RUNTIME_SETTINGS)
+  SetDebounceThresholds(DIRECT_DEBOUNCE_PRESS, DIRECT_DEBOUNCE_RELEASE);
+#endif
+
+#ifdef STROBE_FILTER
+  // Free running, normal mode.
+  STROBE_TIMER_CCRA = 0;
+  STROBE_TIMER_CCRB = STROBE_TIMER_PRESCALE;
+#endif
+#ifdef CAPTURE
+  CAPTURE_TIMER_CCRA = 0;
+  CAPTURE_TIMER_CCRB = CAPTURE_TIMER_PRESCALE;
+  CAPTURE_TIMER_MASK |= CAPTURE_TIMER_INT;
+#endif
+
+#ifdef RUNTIME_SETTINGS
+  CONTROL_PORT |= CONTROL_STROBE;
+  EIMSK |= CONTROL_STROBE_INTERRUPT;
+  BELL_TIMER_CCRA = 0;
+  BELL_TIMER_CCRB = BELL_TIMER_PRESCALE;
 
+  if (!Settings_Load(Settings_BootSlot(), &Settings) || !SettingsValid(&Settings)) {
+    memcpy_P(&Settings, &DefaultSettings, sizeof(kbd_settings_t));
+  }
+  ApplySettings();
+#else
   // Enable pullups.
   CHAR_PORT |= CHAR_PULLUP_MASK;
   CONTROL_PORT |= CONTROL_STROBE;
@@ -576,93 +3282,220 @@ void Parallel_Kbd_Init(void)
   EIMSK |= CONTROL_STROBE_INTERRUPT;
   EICRA |= CONTROL_STROBE_TRIGGER;
 
+#if KBD_CHANNELS > 1
+  // Every latch off the bus until its strobe, and the other keyboards'
+  // strobes the same as the first's.
+  CHANNEL_OE_PORT |= CHANNEL_OE_MASK;
+  CHANNEL_OE_DDR |= CHANNEL_OE_MASK;
+  for (uint8_t n = 1; n < KBD_CHANNELS; n++) {
+    CONTROL_PORT |= CHANNEL_STROBE(n);
+    EICRA |= CHANNEL_STROBE_TRIGGER(n);
+    EIMSK |= CHANNEL_STROBE_INTERRUPT(n);
+  }
+#endif
+
+#ifdef DIRECT_KEYS_INTERRUPT
+  // Interrupts 1-3 on either edge of the direct keys.
+  EICRA |= DIRECT_INTERRUPT_TRIGGER;
+  EIFR = DIRECT_INTERRUPT_MASK;
+  EIMSK |= DIRECT_INTERRUPT_MASK;
+#endif
+
 #if BELL_MODE != BELL_MODE_NONE
   BELL_DDR |= BELL_MASK;
   BELL_OFF;
-#if BELL_MODE == BELL_MODE_TONE
-  TONE_TIMER_CCRA = 0;
-  TONE_TIMER_CCRB = TONE_TIMER_PRESCALE;
-#endif
+  BELL_TIMER_CCRA = 0;
+  BELL_TIMER_CCRB = BELL_TIMER_PRESCALE;
 #endif
 
 #if READY_ACK_MODE != READY_ACK_MODE_NONE
   READY_ACK_DDR |= READY_ACK_MASK;
   READY_ACK_OFF;
 #endif
+#endif
+
+#ifdef OUTPUT_PORT
+  OutputInit();
+#endif
 }
 
+#ifdef SLEEP_IDLE
+// The host sent something, so there may be more waiting.
+static bool HostInputPending;
+#endif
+
 void Parallel_Kbd_Task(void)
 {
-  // Read from serial input.
-  int16_t in = CDC_Device_ReceiveByte(&VirtualSerial_CDC_Interface);
-  if (in > 0) {
-    if (in == ASCII_ENQ) {
-      CDC_Device_SendString_P(&VirtualSerial_CDC_Interface, answerback);
-    } else if (in == ASCII_BEL) {
-      BELL_ON;
-      _delay_us(BELL_DURATION_USEC);
-      BELL_OFF;
-    }
+#if USB_HAS_CDC
+  // Take in what each port has sent and act on it.
+#ifdef SLEEP_IDLE
+  HostInputPending = false;
+#endif
+  for (uint8_t channel = 0; channel < KBD_CHANNELS; channel++) {
+    TxSelect(channel);
+#ifdef SLEEP_IDLE
+    HostInputPending |= RxFill();
+#else
+    RxFill();
+#endif
+    HostInputTask();
   }
+#endif
+
+  MacroTask();
 
-  // Check interrupt queue.
+  // Check interrupt queues, unless a macro is still playing: a strobe
+  // from each keyboard in turn, while any has one and room for what it
+  // types, so that one sending a burst cannot hold up the others.
   bool sent = false;
-  while (!QueueIsEmpty()) {
-    queue_entry_t entry = QueueRemove();
-#if DIRECT_KEYS > 0
+#ifdef CAPTURE
+  if (Capturing)
+    CaptureTask();
+  else
+#endif
+  for (uint8_t channel = 0, idle = 0; idle < KBD_CHANNELS && !MacroPlaying();
+       channel = (channel + 1) % KBD_CHANNELS) {
+#if USB_HAS_CDC
+    TxSelect(channel);
+#endif
+    if (QueueIsEmpty(channel) || !KeyQueueHasRoom()) {
+      idle++;
+      continue;
+    }
+    idle = 0;
+    queue_entry_t entry = QueuePeek(channel);
+#if DIRECT_KEYS_MAX > 0
     UpdateDirectKeys(entry.directKeys);
-#endif
-    uint8_t charCode = entry.charCode;
-#if PARITY_CHECK != PARITY_NONE
-    uint8_t parity = 0;
-    for (uint8_t i = 0; i < 8; i++) {
-      if ((charCode & (1 << i)) != 0) {
-        parity ^= 1;
-      }
+    if (MacroPlaying()) {
+      // A direct key pressed before this strobe started a macro; the
+      // character goes after it. The keys will not change again.
+      break;
     }
-    if (parity != PARITY_CHECK) {
+#endif
+    QueueDrop(channel);
+#ifdef DIRECT_KEYS_INTERRUPT
+    if (entry.directOnly) {
       continue;
     }
 #endif
-#ifdef CHAR_INVERT
-    charCode = ~charCode;
+    uint8_t charCode;
+    if (!ChannelDecodeChar(channel, entry.charCode, &charCode)) {
+      continue;
+    }
+#ifdef PROFILE
+    if (!TxStrobePending) {
+      TxStrobeTicks = entry.strobeTicks;
+      TxStrobePending = true;
+    }
 #endif
-    charCode &= CHAR_MASK;
-#ifdef DIRECT_ESC_PREFIX_MASK
-    if ((entry.directKeys & DIRECT_ESC_PREFIX_MASK) != 0)
+#ifdef DIRECT_ESC_MASK
+    if ((entry.directKeys & DIRECT_ESC_MASK) != 0)
       CharEscPrefixAction(charCode);
     else
+#endif
+#ifndef DEBUG_ACTIONS
+    if (CharMacro(charCode) != NULL)
+      MacroStart_P(CharMacro(charCode));
+    else
 #endif
     CharAction(charCode);
     sent = true;
   }
-#if READY_ACK_MODE == READY_ACK_MODE_KEY_ACK
-#if READY_ACK_DELAY_MSEC == 0
+#if READY_ACK_MODE == READY_ACK_MODE_KEY_ACK || defined(RUNTIME_SETTINGS)
+  if (READY_ACK_MODE_IS(READY_ACK_MODE_KEY_ACK)) {
+    if (READY_ACK_DELAY == 0) {
+      if (sent) {
+        READY_ACK_ON;
+        _delay_us(READY_ACK_DURATION_USEC);
+        READY_ACK_OFF;
+        RepeatTaken();
+      }
+    }
+#if READY_ACK_DELAY_MSEC > 0 || defined(RUNTIME_SETTINGS)
+    else {
+      static clock_time_t lastSent;
+      static bool readyAckPending;
+      if (sent) {
+        lastSent = ClockNow();
+        readyAckPending = true;
+      } else if (readyAckPending && ClockElapsed(lastSent) >= (uint32_t)READY_ACK_DELAY * TICK_TIMER_STEP) {
+        READY_ACK_ON;
+        _delay_us(READY_ACK_DURATION_USEC);
+        READY_ACK_OFF;
+        readyAckPending = false;
+        RepeatTaken();
+      }
+    }
+#endif
+  } else
+#endif
   if (sent) {
-      READY_ACK_ON;
-      _delay_us(READY_ACK_DURATION_USEC);
-      READY_ACK_OFF;
+    RepeatTaken();
   }
+
+#if READY_ACK_FLOW
+  QueueFlowTask();
+#endif
+
+#if DIRECT_KEYS_MAX > 0
+  // Check direct keys, once the strobes still waiting, which saw them
+  // earlier, have been handled.
+  if (QueueIsEmpty(0)) {
+#ifdef DIRECT_KEYS_INTERRUPT
+    if (DirectKeysDue()) {
+      UpdateDirectKeys(ReadDirectKeys());
+    }
 #else
-  static uint16_t lastSentMillis;
-  static bool readyAckPending;
-  if (sent) {
-    lastSentMillis = millisCounter;
-    readyAckPending = true;
-  } else if (readyAckPending && millisCounter - lastSentMillis > READY_ACK_DELAY_MSEC) {
-    READY_ACK_ON;
-    _delay_us(READY_ACK_DURATION_USEC);
-    READY_ACK_OFF;
-    readyAckPending = false;
+    direct_keys_t directKeysNext;
+    if (ReadDirectKeysDebounce(&directKeysNext)) {
+      UpdateDirectKeys(directKeysNext);
+    }
+#endif
   }
 #endif
+
+#if USB_HAS_CDC
+  TxTask();
 #endif
 
-#if DIRECT_KEYS > 0
-  // Check direct keys
-  direct_keys_t directKeysNext;
-  if (ReadDirectKeysDebounce(&directKeysNext)) {
-    UpdateDirectKeys(directKeysNext);
+#ifdef AUTO_REPEAT
+  if (KeysSent()) {
+    RepeatSent();
   }
 #endif
 }
+
+#ifdef SLEEP_IDLE
+// Idle sleep until the next interrupt, if there is nothing to do yet:
+// a strobe wakes it at once, and the Timer 0 tick each millisecond
+// covers host input, the HID and transmit timers and the direct keys.
+void Parallel_Kbd_Idle(void)
+{
+  cli();
+  bool busy = HostInputPending || MacroPlaying();
+#if USB_HAS_CDC
+  busy = busy || ReplyPending();
+#endif
+  for (uint8_t channel = 0; channel < KBD_CHANNELS; channel++) {
+    busy = busy || !QueueIsEmpty(channel);
+#if USB_HAS_CDC
+    // A bank coming free does not interrupt.
+    TxSelect(channel);
+    busy = busy || TxPending() || RxCount() > 0;
+#endif
+  }
+  if (busy) {
+    sei();
+    return;
+  }
+  PROFILE_BEGIN(sleepStart);
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_enable();
+  // The instruction after sei always runs, so a strobe that has come in
+  // since the check wakes the sleep rather than waiting behind it.
+  sei();
+  sleep_cpu();
+  sleep_disable();
+  PROFILE_END(PROFILE_SLEEP, sleepStart);
+}
+#endif
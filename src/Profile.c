@@ -0,0 +1,103 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Optional timing of the main loop and strobe interrupt.
+ */
+
+#ifdef PROFILE
+
+#include <string.h>
+
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#include "Profile.h"
+
+typedef struct {
+  uint32_t count;
+  uint16_t min, max;
+  uint16_t buckets[PROFILE_BUCKETS];
+} profile_phase_t;
+
+static profile_phase_t ProfilePhases[PROFILE_NPHASES];
+
+static const char ProfileNames[PROFILE_NPHASES][5] PROGMEM = {
+  [PROFILE_LOOP] = "LOOP",
+  [PROFILE_KBD_TASK] = "KBD ",
+  [PROFILE_CDC_TASK] = "CDC ",
+  [PROFILE_USB_TASK] = "USB ",
+  [PROFILE_STROBE_ISR] = "INT0",
+  [PROFILE_LATENCY] = "LAT ",
+  [PROFILE_SLEEP] = "IDLE",
+};
+
+void Profile_Init(void)
+{
+  // Free running, normal mode.
+  PROFILE_TIMER_CCRA = 0;
+  PROFILE_TIMER_CCRB = PROFILE_TIMER_PRESCALE;
+  Profile_Reset();
+}
+
+void Profile_Reset(void)
+{
+  cli();
+  memset(ProfilePhases, 0, sizeof(ProfilePhases));
+  sei();
+}
+
+// Also called from interrupt handlers; each phase only ever has one writer.
+void Profile_Record(uint8_t phase, uint16_t ticks)
+{
+  profile_phase_t *p = &ProfilePhases[phase];
+  if (p->count == 0 || ticks < p->min) {
+    p->min = ticks;
+  }
+  if (ticks > p->max) {
+    p->max = ticks;
+  }
+  p->count++;
+  uint8_t bucket = 0;
+  while (ticks != 0 && bucket < PROFILE_BUCKETS - 1) {
+    ticks >>= 1;
+    bucket++;
+  }
+  if (p->buckets[bucket] != 0xFFFF) {
+    p->buckets[bucket]++;
+  }
+}
+
+static char *FormatHex(char *str, uint32_t value, uint8_t digits)
+{
+  *str++ = ' ';
+  while (digits-- > 0) {
+    uint8_t digit = (value >> (digits * 4)) & 0x0F;
+    *str++ = (digit < 10) ? '0' + digit : 'A' + (digit - 10);
+  }
+  return str;
+}
+
+// name count min max buckets..., all in hex ticks.
+void Profile_FormatPhase(uint8_t phase, char *str)
+{
+  profile_phase_t p;
+  cli();
+  p = ProfilePhases[phase];
+  sei();
+  strcpy_P(str, ProfileNames[phase]);
+  str += 4;
+  str = FormatHex(str, p.count, 8);
+  str = FormatHex(str, p.min, 4);
+  str = FormatHex(str, p.max, 4);
+  for (uint8_t i = 0; i < PROFILE_BUCKETS; i++) {
+    str = FormatHex(str, p.buckets[i], 4);
+  }
+  *str++ = '\r';
+  *str++ = '\n';
+  *str = '\0';
+}
+
+#endif
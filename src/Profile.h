@@ -0,0 +1,64 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Header file for Profile.c.
+ *
+ *  With PROFILE defined, the main loop phases, the strobe interrupt and the
+ *  strobe-to-send latency are timed against free-running Timer 1 and kept as
+ *  min / max / log2 histogram, for dumping over the CDC link. Without it, the
+ *  macros here compile to nothing.
+ */
+
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+  /* Includes: */
+    #include <avr/io.h>
+    #include <stdint.h>
+
+  /* Macros: */
+    /** Phases that are timed. */
+    #define PROFILE_LOOP            0   /**< One pass of the main loop. */
+    #define PROFILE_KBD_TASK        1   /**< Parallel_Kbd_Task. */
+    #define PROFILE_CDC_TASK        2   /**< CDC_Device_USBTask and HID_Device_USBTask. */
+    #define PROFILE_USB_TASK        3   /**< USB_USBTask. */
+    #define PROFILE_STROBE_ISR      4   /**< Strobe interrupt handler. */
+    #define PROFILE_LATENCY         5   /**< Strobe to handing the packet to the USB controller. */
+    #define PROFILE_SLEEP           6   /**< Idle sleep, with SLEEP_IDLE. */
+    #define PROFILE_NPHASES         7
+
+    /** Histogram bucket n counts times of 2^(n-1) to 2^n - 1 ticks; the last takes anything longer. */
+    #define PROFILE_BUCKETS         12
+
+    /** Timer 1, prescaler 8: a tick is 8 cycles (0.5 usec at 16MHz) and it wraps in 32 msec. */
+    #define PROFILE_TIMER_CCRA      TCCR1A
+    #define PROFILE_TIMER_CCRB      TCCR1B
+    #define PROFILE_TIMER_PRESCALE  (1 << CS11)
+    #define PROFILE_TIMER_TCNT      TCNT1
+
+    /** Longest line from Profile_FormatPhase, including the terminating null. */
+    #define PROFILE_FORMAT_SIZE     (4 + 1 + 8 + 2 * 5 + PROFILE_BUCKETS * 5 + 3)
+
+    #ifdef PROFILE
+      #define PROFILE_BEGIN(var) uint16_t var = PROFILE_TIMER_TCNT
+      #define PROFILE_LAP(phase, var) do { uint16_t _now = PROFILE_TIMER_TCNT; \
+                                           Profile_Record(phase, _now - var); var = _now; } while (0)
+      #define PROFILE_END(phase, var) Profile_Record(phase, PROFILE_TIMER_TCNT - var)
+    #else
+      #define PROFILE_BEGIN(var)
+      #define PROFILE_LAP(phase, var)
+      #define PROFILE_END(phase, var)
+    #endif
+
+  /* Function Prototypes: */
+    #ifdef PROFILE
+      void Profile_Init(void);
+      void Profile_Reset(void);
+      void Profile_Record(uint8_t phase, uint16_t ticks);
+      void Profile_FormatPhase(uint8_t phase, char *str);
+    #endif
+
+#endif
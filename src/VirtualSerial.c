@@ -42,6 +42,7 @@
  *  passed to all CDC Class driver functions, so that multiple instances of the same class
  *  within a device can be differentiated from one another.
  */
+#if USB_HAS_CDC
 USB_ClassInfo_CDC_Device_t VirtualSerial_CDC_Interface =
   {
     .Config =
@@ -51,13 +52,13 @@ USB_ClassInfo_CDC_Device_t VirtualSerial_CDC_Interface =
           {
             .Address          = CDC_TX_EPADDR,
             .Size             = CDC_TXRX_EPSIZE,
-            .Banks            = 1,
+            .Banks            = CDC_TXRX_BANKS,
           },
         .DataOUTEndpoint =
           {
             .Address          = CDC_RX_EPADDR,
             .Size             = CDC_TXRX_EPSIZE,
-            .Banks            = 1,
+            .Banks            = CDC_TXRX_BANKS,
           },
         .NotificationEndpoint =
           {
@@ -68,8 +69,66 @@ USB_ClassInfo_CDC_Device_t VirtualSerial_CDC_Interface =
       },
   };
 
+#if KBD_CHANNELS > 1
+/** The same for the second keyboard's CDC interface. */
+USB_ClassInfo_CDC_Device_t VirtualSerial_CDC_Interface_1 =
+  {
+    .Config =
+      {
+        .ControlInterfaceNumber   = INTERFACE_ID_CDC_1_CCI,
+        .DataINEndpoint           =
+          {
+            .Address          = CDC_1_TX_EPADDR,
+            .Size             = CDC_TXRX_EPSIZE,
+            .Banks            = CDC_TXRX_BANKS,
+          },
+        .DataOUTEndpoint =
+          {
+            .Address          = CDC_1_RX_EPADDR,
+            .Size             = CDC_TXRX_EPSIZE,
+            .Banks            = CDC_TXRX_BANKS,
+          },
+        .NotificationEndpoint =
+          {
+            .Address          = CDC_1_NOTIFICATION_EPADDR,
+            .Size             = CDC_NOTIFICATION_EPSIZE,
+            .Banks            = 1,
+          },
+      },
+  };
+#endif
+#endif
+
+#if USB_HAS_HID
+/** Buffer to hold the previously generated Keyboard HID report, for comparison purposes inside the HID class driver. */
+static uint8_t PrevKeyboardHIDReportBuffer[sizeof(USB_KeyboardReport_Data_t)];
+
+/** LUFA HID Class driver interface configuration and state information. This structure is
+ *  passed to all HID Class driver functions, so that multiple instances of the same class
+ *  within a device can be differentiated from one another.
+ */
+USB_ClassInfo_HID_Device_t Keyboard_HID_Interface =
+  {
+    .Config =
+      {
+        .InterfaceNumber              = INTERFACE_ID_Keyboard,
+        .ReportINEndpoint             =
+          {
+            .Address              = KEYBOARD_EPADDR,
+            .Size                 = KEYBOARD_EPSIZE,
+            .Banks                = 1,
+          },
+        .PrevReportINBuffer           = PrevKeyboardHIDReportBuffer,
+        .PrevReportINBufferSize       = sizeof(PrevKeyboardHIDReportBuffer),
+      },
+  };
+#endif
+
 extern void Parallel_Kbd_Init(void);
 extern void Parallel_Kbd_Task(void);
+#ifdef SLEEP_IDLE
+extern void Parallel_Kbd_Idle(void);
+#endif
 
 /** Main program entry point. This routine contains the overall program flow, including initial
  *  setup of all components and the main program loop.
@@ -83,10 +142,30 @@ int main(void)
 
   for (;;)
   {
+    PROFILE_BEGIN(loopStart);
+    PROFILE_BEGIN(phaseStart);
+
     Parallel_Kbd_Task();
+    PROFILE_LAP(PROFILE_KBD_TASK, phaseStart);
 
+#if USB_HAS_CDC
     CDC_Device_USBTask(&VirtualSerial_CDC_Interface);
+#endif
+#if KBD_CHANNELS > 1
+    CDC_Device_USBTask(&VirtualSerial_CDC_Interface_1);
+#endif
+#if USB_HAS_HID
+    HID_Device_USBTask(&Keyboard_HID_Interface);
+#endif
+    PROFILE_LAP(PROFILE_CDC_TASK, phaseStart);
     USB_USBTask();
+    PROFILE_END(PROFILE_USB_TASK, phaseStart);
+
+    PROFILE_END(PROFILE_LOOP, loopStart);
+
+#ifdef SLEEP_IDLE
+    Parallel_Kbd_Idle();
+#endif
   }
 }
 
@@ -113,6 +192,9 @@ void SetupHardware(void)
 #endif
 
   /* Hardware Initialization */
+#ifdef PROFILE
+  Profile_Init();
+#endif
   Parallel_Kbd_Init();
   LEDs_Init();
   USB_Init();
@@ -135,7 +217,15 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 {
   bool ConfigSuccess = true;
 
+#if USB_HAS_CDC
   ConfigSuccess &= CDC_Device_ConfigureEndpoints(&VirtualSerial_CDC_Interface);
+#endif
+#if KBD_CHANNELS > 1
+  ConfigSuccess &= CDC_Device_ConfigureEndpoints(&VirtualSerial_CDC_Interface_1);
+#endif
+#if USB_HAS_HID
+  ConfigSuccess &= HID_Device_ConfigureEndpoints(&Keyboard_HID_Interface);
+#endif
 
 #ifdef ENABLE_SOF_EVENTS
   USB_Device_EnableSOFEvents();
@@ -147,5 +237,13 @@ void EVENT_USB_Device_ConfigurationChanged(void)
 /** Event handler for the library USB Control Request reception event. */
 void EVENT_USB_Device_ControlRequest(void)
 {
+#if USB_HAS_CDC
   CDC_Device_ProcessControlRequest(&VirtualSerial_CDC_Interface);
+#endif
+#if KBD_CHANNELS > 1
+  CDC_Device_ProcessControlRequest(&VirtualSerial_CDC_Interface_1);
+#endif
+#if USB_HAS_HID
+  HID_Device_ProcessControlRequest(&Keyboard_HID_Interface);
+#endif
 }
@@ -47,6 +47,7 @@
     #include <stdio.h>
 
     #include "Descriptors.h"
+    #include "Profile.h"
 
     #include <LUFA/Drivers/Board/LEDs.h>
     #include <LUFA/Drivers/USB/USB.h>
@@ -0,0 +1,32 @@
+#!/bin/sh
+# One line per measurement of a firmware image: flash and RAM in bytes,
+# then the size in bytes and static cycles (see isr-cycles.awk) of each
+# function named, or - if the compiler did not keep it.
+#
+#   budget.sh profile image.elf function...
+
+profile=$1
+elf=$2
+shift 2
+
+AVR_SIZE=${AVR_SIZE:-avr-size}
+AVR_NM=${AVR_NM:-avr-nm}
+AVR_OBJDUMP=${AVR_OBJDUMP:-avr-objdump}
+here=$(dirname "$0")
+
+# Berkeley format: text data bss dec hex filename.
+$AVR_SIZE -B "$elf" | awk -v p="$profile" 'NR == 2 {
+  print p, "flash", $1 + $2
+  print p, "ram", $2 + $3
+}'
+
+for fn in "$@"; do
+  hex=$($AVR_NM -S "$elf" | awk -v f="$fn" '$4 == f && $3 ~ /[tT]/ { print $2; exit }')
+  if [ -z "$hex" ]; then
+    echo "$profile size $fn -"
+    echo "$profile cycles $fn -"
+    continue
+  fi
+  echo "$profile size $fn $((0x$hex))"
+  echo "$profile cycles $fn $($AVR_OBJDUMP -d --disassemble="$fn" "$elf" | awk -f "$here/isr-cycles.awk")"
+done
@@ -0,0 +1,27 @@
+# Compares budget lines against a baseline of the same form, reading the
+# baseline first. Reports every change, and exits 1 if RAM or the cycles
+# of an interrupt handler grew for any profile.
+#
+#   awk -f compare.awk baseline.txt budget.txt
+
+NR == FNR {
+  base[$1 " " $2 " " $3] = $NF
+  next
+}
+
+{
+  key = $1 " " $2 " " $3
+  if (!(key in base) || base[key] == $NF) next
+  print "  " key ": " base[key] " -> " $NF
+  if (base[key] == "-" || $NF == "-") next
+  if ($NF + 0 > base[key] + 0 && ($2 == "ram" || ($2 == "cycles" && $3 ~ /_vect$/))) {
+    grew = 1
+  }
+}
+
+END {
+  if (grew) {
+    print "over budget: RAM or interrupt cycles grew"
+    exit 1
+  }
+}
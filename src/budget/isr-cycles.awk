@@ -0,0 +1,34 @@
+# Static cycle count of one function from avr-objdump -d output, for the
+# ATmega32U4 (AVRe+ core): the sum over every instruction, taking each
+# branch and skip. That is an upper bound for code without loops and
+# moves with the code either way; calls are counted but not followed.
+#
+#   avr-objdump -d --disassemble=INT0_vect image.elf | awk -f isr-cycles.awk
+
+BEGIN {
+  split("ld ldd lds st std sts push pop adiw sbiw mul muls mulsu fmul fmuls fmulsu " \
+        "rjmp ijmp sbi cbi", two)
+  for (i in two) cycles[two[i]] = 2
+  split("lpm elpm jmp rcall icall cpse sbrc sbrs sbic sbis", three)
+  for (i in three) cycles[three[i]] = 3
+  split("call ret reti", four)
+  for (i in four) cycles[four[i]] = 4
+  total = 0
+}
+
+# Instruction lines look like "  1a4:	0f 92       	push	r0".
+/^ *[0-9a-f]+:\t/ {
+  n = split($0, fields, "\t")
+  if (n < 3) next
+  op = fields[3]
+  sub(/[ \t].*/, "", op)
+  if (op == "" || op == ".word") next
+  if (op in cycles)
+    total += cycles[op]
+  else if (op ~ /^br/)
+    total += 2
+  else
+    total += 1
+}
+
+END { print total }
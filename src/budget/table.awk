@@ -0,0 +1,31 @@
+# Lays budget lines out as a table, one row per profile: flash and RAM,
+# then size / cycles for each function, in the order first seen.
+
+{
+  if (!($1 in seen)) {
+    seen[$1] = 1
+    profiles[++nprofiles] = $1
+  }
+  if ($2 == "size" || $2 == "cycles") {
+    if (!($3 in fnseen)) {
+      fnseen[$3] = 1
+      fns[++nfns] = $3
+    }
+    value[$1, $2, $3] = $4
+  } else {
+    value[$1, $2] = $3
+  }
+}
+
+END {
+  printf "%-20s %6s %5s", "profile", "flash", "ram"
+  for (f = 1; f <= nfns; f++) printf " %18s", fns[f]
+  printf "\n"
+  for (p = 1; p <= nprofiles; p++) {
+    name = profiles[p]
+    printf "%-20s %6s %5s", name, value[name, "flash"], value[name, "ram"]
+    for (f = 1; f <= nfns; f++)
+      printf " %18s", value[name, "size", fns[f]] "/" value[name, "cycles", fns[f]]
+    printf "\n"
+  }
+}
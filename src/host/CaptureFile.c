@@ -0,0 +1,85 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Reads the capture frames described in Capture.h.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "CaptureFile.h"
+
+int CaptureFile_Parse(const uint8_t *data, size_t length, capture_frame_t *frame)
+{
+  if (length == 0) return 0;
+  uint8_t kind = data[0];
+  if ((kind & ~CAPTURE_FRAME_KINDS) != CAPTURE_FRAME) return -1;
+  frame->kind = kind & CAPTURE_FRAME_KINDS;
+  size_t i = 1;
+  if (frame->kind & CAPTURE_FRAME_STROBE) {
+    if (i >= length) return 0;
+    frame->charPins = data[i++];
+  } else {
+    frame->charPins = 0;
+  }
+  if (frame->kind & CAPTURE_FRAME_KEYS) {
+    if (i + 2 > length) return 0;
+    frame->directKeys = data[i] | (data[i + 1] << 8);
+    i += 2;
+  } else {
+    frame->directKeys = 0;
+  }
+  if ((frame->kind & (CAPTURE_FRAME_STROBE | CAPTURE_FRAME_KEYS)) == 0) return -1;
+  frame->ticks = 0;
+  for (int shift = 0; ; shift += 7) {
+    // No more than 32 bits.
+    if (shift > 28) return -1;
+    if (i >= length) return 0;
+    uint8_t b = data[i++];
+    frame->ticks |= (uint32_t)(b & 0x7F) << shift;
+    if (!(b & 0x80)) break;
+  }
+  return i;
+}
+
+capture_frame_t *CaptureFile_Read(const char *file, size_t *count)
+{
+  FILE *in = fopen(file, "rb");
+  if (in == NULL) {
+    perror(file);
+    return NULL;
+  }
+  size_t size = 0, length = 0;
+  uint8_t *data = NULL;
+  for (;;) {
+    if (length == size) {
+      size = size ? size * 2 : 4096;
+      data = realloc(data, size);
+    }
+    size_t n = fread(data + length, 1, size - length, in);
+    if (n == 0) break;
+    length += n;
+  }
+  fclose(in);
+
+  // Never more frames than bytes.
+  capture_frame_t *frames = malloc((length + 1) * sizeof(capture_frame_t));
+  size_t offset = 0;
+  *count = 0;
+  while (offset < length) {
+    int n = CaptureFile_Parse(data + offset, length - offset, &frames[*count]);
+    if (n <= 0) {
+      fprintf(stderr, "%s: %s frame at offset %zu\n", file, (n < 0) ? "bad" : "incomplete", offset);
+      free(frames);
+      free(data);
+      return NULL;
+    }
+    offset += n;
+    (*count)++;
+  }
+  free(data);
+  return frames;
+}
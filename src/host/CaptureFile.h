@@ -0,0 +1,43 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Header file for CaptureFile.c.
+ *
+ *  Reading the frames of Capture.h, for KbdCapture and the replay command of
+ *  KbdSim. A capture file is just the frames, as the keyboard sent them
+ *  between its C and E replies.
+ */
+
+#ifndef _CAPTURE_FILE_H_
+#define _CAPTURE_FILE_H_
+
+  /* Includes: */
+    #include <stddef.h>
+    #include <stdint.h>
+
+    #include "Capture.h"
+
+  /* Type Defines: */
+    typedef struct {
+      uint8_t kind;             /**< CAPTURE_FRAME_STROBE, CAPTURE_FRAME_KEYS and CAPTURE_FRAME_LOST. */
+      uint8_t charPins;         /**< The raw data lines, with CAPTURE_FRAME_STROBE. */
+      uint16_t directKeys;      /**< The direct keys down, key 1 in bit 0, with CAPTURE_FRAME_KEYS. */
+      uint32_t ticks;           /**< Timer 1 ticks since the frame before. */
+    } capture_frame_t;
+
+  /* Function Prototypes: */
+    /** Parses the frame at the start of data. Returns its length, 0 if
+     *  more data is needed, or -1 if data does not start with a frame.
+     */
+    int CaptureFile_Parse(const uint8_t *data, size_t length, capture_frame_t *frame);
+
+    /** Reads a whole capture file into a malloc'ed array, setting count.
+     *  Returns NULL, having said why, if it cannot be read or is not all
+     *  frames.
+     */
+    capture_frame_t *CaptureFile_Read(const char *file, size_t *count);
+
+#endif
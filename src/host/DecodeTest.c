@@ -0,0 +1,76 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Checks DecodeChar, and so the generated decode table, against the
+ *  straightforward parity loop, inversion and mask, for every raw port value.
+ *  Built with the same PARALLEL_KBD_OPTS as the firmware; -p prints the
+ *  table. With RUNTIME_SETTINGS, checks the table Decode_Build makes from
+ *  those options instead.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "Decode.h"
+
+/** How Parallel_Kbd_Task used to decode a strobe. */
+static bool ReferenceDecode(uint8_t raw, uint8_t *code)
+{
+  uint8_t charCode = raw;
+#if PARITY_CHECK != PARITY_NONE
+  uint8_t parity = 0;
+  for (uint8_t i = 0; i < 8; i++) {
+    if ((charCode & (1 << i)) != 0) {
+      parity ^= 1;
+    }
+  }
+  if (parity != PARITY_CHECK) {
+    return false;
+  }
+#endif
+#ifdef CHAR_INVERT
+  charCode = ~charCode;
+#endif
+  charCode &= CHAR_MASK;
+  *code = charCode;
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  bool print = (argc > 1 && strcmp(argv[1], "-p") == 0);
+  unsigned errors = 0, accepted = 0;
+#ifdef RUNTIME_SETTINGS
+  Decode_Build(CHAR_MASK, DECODE_INVERT != 0, PARITY_CHECK);
+#endif
+  for (unsigned raw = 0; raw < 256; raw++) {
+    uint8_t expected = 0, actual = 0;
+    bool expectedOk = ReferenceDecode(raw, &expected);
+    bool actualOk = DecodeChar(raw, &actual);
+    if (expectedOk != actualOk || (expectedOk && expected != actual)) {
+      printf("raw %02X: expected %s %02X, got %s %02X\n", raw,
+             expectedOk ? "accept" : "reject", expected,
+             actualOk ? "accept" : "reject", actual);
+      errors++;
+    }
+    if (actualOk) accepted++;
+    if (print) {
+      if (actualOk)
+        printf(" %02X", actual);
+      else
+        printf(" --");
+      if (raw % 16 == 15) putchar('\n');
+    }
+  }
+#ifdef RUNTIME_SETTINGS
+  printf("decode      %u accepted %u errors (runtime, reject %03X)\n", accepted, errors,
+         CharDecodeReject);
+#else
+  printf("decode      %u accepted %u errors (%s, %u-byte entries)\n", accepted, errors,
+         CHAR_DECODE_TABLE ? "table" : "inline", (unsigned)sizeof(char_decode_t));
+#endif
+  return (errors > 0) ? 1 : 0;
+}
@@ -0,0 +1,94 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Times UpdateDirectKeys on the host for a fixed sequence of direct key
+ *  changes and reports the cost per key transition. Built with the same
+ *  PARALLEL_KBD_OPTS as the firmware, once as is and once with
+ *  DIRECT_DISPATCH_LOOP, so that make bench can compare the dispatch at
+ *  compile time with the loop over the table. Includes ParallelKeyboard.c
+ *  itself, since UpdateDirectKeys is static there; HostSim.c supplies the
+ *  ports and endpoints. The figures are host nanoseconds, so only the
+ *  ratio between the two builds carries over to the device.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "HostSim.h"
+#include "../ParallelKeyboard.c"
+
+#define STATES 4096
+#define ROUNDS 2000
+#define RUNS 10
+
+// DEBUG_ACTIONS reports every key, so always through the loop.
+#if DIRECT_KEYS_MAX > 0 && !defined(DEBUG_ACTIONS)
+
+static direct_keys_t States[STATES];
+
+// One or two keys change each step, drawn from a fixed seed, so that every
+// build sees the same sequence.
+static unsigned MakeStates(void)
+{
+  uint32_t seed = 0x2545F491;
+  direct_keys_t keys = 0;
+  unsigned transitions = 0;
+  for (unsigned i = 0; i < STATES; i++) {
+    uint8_t changes = 1 + (i & 1);
+    for (uint8_t j = 0; j < changes; j++) {
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      keys ^= DIRECT_KEY_MASK(1 + seed % DIRECT_KEYS_MAX);
+    }
+    transitions += __builtin_popcount((direct_keys_t)(keys ^ (i ? States[i - 1] : 0)));
+    States[i] = keys;
+  }
+  // Back to none down, so that each round starts the same.
+  transitions += __builtin_popcount(keys);
+  return transitions;
+}
+
+static double Seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+  const char *label = (argc > 1) ? argv[1] : "UpdateDirectKeys";
+  HostSim_Init();
+  unsigned transitions = MakeStates();
+  // The fastest of a few runs, as the least disturbed by the rest of the host.
+  double best = 0;
+  for (unsigned run = 0; run < RUNS; run++) {
+    double start = Seconds();
+    for (unsigned round = 0; round < ROUNDS; round++) {
+      for (unsigned i = 0; i < STATES; i++) {
+        UpdateDirectKeys(States[i]);
+      }
+      UpdateDirectKeys(0);
+    }
+    double elapsed = Seconds() - start;
+    if (run == 0 || elapsed < best) best = elapsed;
+  }
+  printf("%-28s %11u %9.2f\n", label, transitions * ROUNDS, best * 1e9 / ((double)transitions * ROUNDS));
+  return 0;
+}
+
+#else
+
+int main(int argc, char **argv)
+{
+  printf("%-28s %11s %9s\n", (argc > 1) ? argv[1] : "UpdateDirectKeys", "-", "-");
+  return 0;
+}
+
+#endif
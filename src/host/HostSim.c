@@ -0,0 +1,1582 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Simulated ATmega32U4 ports, timers and interrupts, and fake CDC and HID
+ *  device endpoints, for running ParallelKeyboard.c on the host.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+
+#include "Descriptors.h"
+#include "Profile.h"
+#include "HostSim.h"
+
+/*** Registers ***/
+
+volatile uint8_t PINB, PORTB, DDRB;
+volatile uint8_t PINC, PORTC, DDRC;
+volatile uint8_t PIND, PORTD, DDRD;
+volatile uint8_t PINE, PORTE, DDRE;
+volatile uint8_t PINF, PORTF, DDRF;
+volatile uint8_t EIMSK, EICRA, EICRB, EIFR;
+volatile uint8_t TCCR0A, TCCR0B, TIFR0, TIMSK0;
+volatile uint8_t OCR0A;
+volatile uint8_t TCCR1A, TCCR1B, TIFR1, TIMSK1;
+volatile uint16_t OCR1B;
+volatile uint8_t TCCR3A, TCCR3B, TIFR3, TIMSK3;
+volatile uint16_t OCR3A;
+
+volatile uint8_t USB_DeviceState;
+uint8_t HostSim_LEDs;
+
+/*** Firmware entry points, only some of which a given configuration has ***/
+
+extern void Parallel_Kbd_Init(void);
+extern void Parallel_Kbd_Task(void);
+extern void Parallel_Kbd_Idle(void);
+
+extern void INT0_vect(void) __attribute__((weak));
+extern void INT1_vect(void) __attribute__((weak));
+extern void INT2_vect(void) __attribute__((weak));
+extern void INT3_vect(void) __attribute__((weak));
+extern void INT6_vect(void) __attribute__((weak));
+extern void TIMER0_COMPA_vect(void) __attribute__((weak));
+extern void TIMER1_COMPB_vect(void) __attribute__((weak));
+extern void TIMER1_OVF_vect(void) __attribute__((weak));
+extern void TIMER3_COMPA_vect(void) __attribute__((weak));
+extern void EVENT_USB_Device_StartOfFrame(void) __attribute__((weak));
+extern void EVENT_CDC_Device_ControLineStateChanged(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo) __attribute__((weak));
+
+/** Same configuration as VirtualSerial.c. */
+#if USB_HAS_CDC
+USB_ClassInfo_CDC_Device_t VirtualSerial_CDC_Interface =
+  {
+    .Config =
+      {
+        .ControlInterfaceNumber   = INTERFACE_ID_CDC_CCI,
+        .DataINEndpoint           =
+          {
+            .Address          = CDC_TX_EPADDR,
+            .Size             = CDC_TXRX_EPSIZE,
+            .Banks            = CDC_TXRX_BANKS,
+          },
+        .DataOUTEndpoint =
+          {
+            .Address          = CDC_RX_EPADDR,
+            .Size             = CDC_TXRX_EPSIZE,
+            .Banks            = CDC_TXRX_BANKS,
+          },
+        .NotificationEndpoint =
+          {
+            .Address          = CDC_NOTIFICATION_EPADDR,
+            .Size             = CDC_NOTIFICATION_EPSIZE,
+            .Banks            = 1,
+          },
+      },
+  };
+
+#if KBD_CHANNELS > 1
+/** The same for the second keyboard's CDC interface. */
+USB_ClassInfo_CDC_Device_t VirtualSerial_CDC_Interface_1 =
+  {
+    .Config =
+      {
+        .ControlInterfaceNumber   = INTERFACE_ID_CDC_1_CCI,
+        .DataINEndpoint           =
+          {
+            .Address          = CDC_1_TX_EPADDR,
+            .Size             = CDC_TXRX_EPSIZE,
+            .Banks            = CDC_TXRX_BANKS,
+          },
+        .DataOUTEndpoint =
+          {
+            .Address          = CDC_1_RX_EPADDR,
+            .Size             = CDC_TXRX_EPSIZE,
+            .Banks            = CDC_TXRX_BANKS,
+          },
+        .NotificationEndpoint =
+          {
+            .Address          = CDC_1_NOTIFICATION_EPADDR,
+            .Size             = CDC_NOTIFICATION_EPSIZE,
+            .Banks            = 1,
+          },
+      },
+  };
+#endif
+#endif
+
+#if USB_HAS_HID
+static uint8_t PrevKeyboardHIDReportBuffer[sizeof(USB_KeyboardReport_Data_t)];
+
+USB_ClassInfo_HID_Device_t Keyboard_HID_Interface =
+  {
+    .Config =
+      {
+        .InterfaceNumber              = INTERFACE_ID_Keyboard,
+        .ReportINEndpoint             =
+          {
+            .Address              = KEYBOARD_EPADDR,
+            .Size                 = KEYBOARD_EPSIZE,
+            .Banks                = 1,
+          },
+        .PrevReportINBuffer           = PrevKeyboardHIDReportBuffer,
+        .PrevReportINBufferSize       = sizeof(PrevKeyboardHIDReportBuffer),
+      },
+  };
+#endif
+
+/*** Clock and cost model ***/
+
+uint64_t HostSim_Now;
+HostSim_Costs_t HostSim_Costs = {
+  .LoopCycles = 200,
+  .IsrCycles = 40,
+  .ByteCycles = 30,
+  .HostPollCycles = 1000,
+  .StrobeCycles = 10 * HOSTSIM_CYCLES_PER_USEC,
+  .SleepStepCycles = 16,
+  .PrintCycles = 100 * HOSTSIM_CYCLES_PER_USEC,
+};
+HostSim_Stats_t HostSim_Stats;
+bool HostSim_Verbose;
+FILE *HostSim_Record;
+
+#define NEVER UINT64_MAX
+
+static bool InterruptsEnabled;
+static bool InAdvance;
+// An interrupt handler has run since interrupts were last disabled.
+static bool Woken;
+static bool Int0Pending, Int6Pending, Timer0APending, Timer1BPending, Timer1OvfPending, Timer3Pending, SOFPending;
+// INT1-INT3 flags, as in EIFR.
+static uint8_t IntDirectPending;
+// In a main loop pass, and whether it has had any keyboard or endpoint
+// work, for BusyCycles.
+static bool InPass, PassWork;
+
+static void __attribute__((format(printf, 1, 2))) Trace(const char *fmt, ...)
+{
+  if (!HostSim_Verbose) return;
+  va_list args;
+  va_start(args, fmt);
+  printf("%12.3f ms ", (double)HostSim_Now / HOSTSIM_CYCLES_PER_MSEC);
+  vprintf(fmt, args);
+  putchar('\n');
+  va_end(args);
+}
+
+static void TraceBytes(const char *label, const uint8_t *data, uint16_t len)
+{
+  if (!HostSim_Verbose) return;
+  char buf[256];
+  char *p = buf;
+  for (uint16_t i = 0; i < len && p < buf + sizeof(buf) - 8; i++) {
+    uint8_t b = data[i];
+    if (b >= ' ' && b <= '~' && b != '"' && b != '\\')
+      *p++ = b;
+    else
+      p += sprintf(p, "\\x%02X", b);
+  }
+  *p = '\0';
+  Trace("%s %2u \"%s\"", label, len, buf);
+}
+
+/*** Bell on C6 ***/
+
+// A ring starts with an edge on the bell line after it has been quiet
+// for longer than half a tone cycle, and shorter than the gap between
+// bells. Writing a one to PINC toggles the pin, as on the AVR, once
+// seen here: after each interrupt handler and each step of the clock.
+#define BELL_MASK (1 << 6)
+#define BELL_QUIET_CYCLES (20 * HOSTSIM_CYCLES_PER_MSEC)
+
+static bool BellOutput, BellLevel;
+static uint64_t BellLastEdge, BellLastRing;
+static int32_t BellsExpected = -1;
+static uint64_t BellSpacing;
+
+void HostSim_ExpectBells(uint32_t count, uint32_t spacingMsec)
+{
+  BellsExpected = count;
+  BellSpacing = (uint64_t)spacingMsec * HOSTSIM_CYCLES_PER_MSEC;
+}
+
+static void BellSample(void)
+{
+  if (PINC & BELL_MASK) {
+    PINC &= ~BELL_MASK;
+    PORTC ^= BELL_MASK;
+  }
+  if (!(DDRC & BELL_MASK)) return;
+  bool level = (PORTC & BELL_MASK) != 0;
+  if (!BellOutput) {
+    // Idle, as first driven.
+    BellOutput = true;
+    BellLevel = level;
+    return;
+  }
+  if (level == BellLevel) return;
+  BellLevel = level;
+  if (HostSim_Stats.Bells == 0 || HostSim_Now - BellLastEdge > BELL_QUIET_CYCLES) {
+    if (HostSim_Stats.Bells > 0 && HostSim_Now - BellLastRing < BellSpacing) {
+      Trace("BELL EARLY");
+      HostSim_Stats.Dropped++;
+    } else {
+      Trace("BELL");
+    }
+    HostSim_Stats.Bells++;
+    BellLastRing = HostSim_Now;
+  }
+  BellLastEdge = HostSim_Now;
+}
+
+/*** Interrupts ***/
+
+// A strobe or direct key interrupt, or an endpoint byte.
+static void Work(void)
+{
+  PassWork = true;
+}
+
+static void RunISR(void (*isr)(void))
+{
+  if (isr == NULL) return;
+  // The hardware clears I on entry and RETI sets it again.
+  InterruptsEnabled = false;
+  (*isr)();
+  InterruptsEnabled = true;
+  BellSample();
+  HostSim_Now += HostSim_Costs.IsrCycles;
+  HostSim_Stats.Interrupts++;
+  Woken = true;
+}
+
+static void RunKeyISR(void (*isr)(void))
+{
+  if (isr == NULL) return;
+  if (InPass)
+    Work();
+  else
+    HostSim_Stats.BusyCycles += HostSim_Costs.IsrCycles;
+  RunISR(isr);
+}
+
+static void RunPendingISRs(void)
+{
+  while (InterruptsEnabled && (Int0Pending || IntDirectPending || Int6Pending || Timer0APending ||
+                              Timer1BPending || Timer1OvfPending || Timer3Pending || SOFPending)) {
+    // Vector order is priority order.
+    if (Int0Pending) {
+      Int0Pending = false;
+      RunKeyISR(INT0_vect);
+    } else if (IntDirectPending & (1 << INT1)) {
+      IntDirectPending &= ~(1 << INT1);
+      RunKeyISR(INT1_vect);
+    } else if (IntDirectPending & (1 << INT2)) {
+      IntDirectPending &= ~(1 << INT2);
+      RunKeyISR(INT2_vect);
+    } else if (IntDirectPending & (1 << INT3)) {
+      IntDirectPending &= ~(1 << INT3);
+      RunKeyISR(INT3_vect);
+    } else if (Int6Pending) {
+      Int6Pending = false;
+      RunISR(INT6_vect);
+    } else if (SOFPending) {
+      SOFPending = false;
+      RunISR(EVENT_USB_Device_StartOfFrame);
+    } else if (Timer1BPending) {
+      Timer1BPending = false;
+      RunISR(TIMER1_COMPB_vect);
+    } else if (Timer1OvfPending) {
+      // The only flag read back, so the only one cleared on entry.
+      Timer1OvfPending = false;
+      TIFR1 &= ~(1 << TOV1);
+      RunISR(TIMER1_OVF_vect);
+    } else if (Timer0APending) {
+      Timer0APending = false;
+      RunISR(TIMER0_COMPA_vect);
+    } else if (Timer3Pending) {
+      Timer3Pending = false;
+      RunISR(TIMER3_COMPA_vect);
+    }
+  }
+}
+
+void HostSim_InterruptsEnable(bool enable)
+{
+  InterruptsEnabled = enable;
+  if (enable && !InAdvance) {
+    RunPendingISRs();
+  } else if (!enable) {
+    Woken = false;
+  }
+}
+
+// The pending interrupt run by the sei just before counts as a wake-up,
+// since the AVR runs the instruction after sei before any handler.
+void HostSim_Sleep(void)
+{
+  uint64_t start = HostSim_Now;
+  while (!Woken) {
+    HostSim_Advance(HostSim_Costs.SleepStepCycles);
+  }
+  HostSim_Stats.Sleeps++;
+  HostSim_Stats.SleepCycles += HostSim_Now - start;
+}
+
+/*** Timers ***/
+
+// The first multiple of period from since on that comes after last,
+// which was already taken. It may have gone by while an interrupt
+// handler ran, and is then taken late rather than skipped.
+static uint64_t NextPeriod(uint64_t period, uint64_t last, uint64_t since)
+{
+  uint64_t next = (since + period - 1) / period * period;
+  if (next <= last) next = (last / period + 1) * period;
+  return next;
+}
+
+static uint64_t LastSOF;
+
+static uint32_t TimerPrescale(uint8_t tccrb)
+{
+  static const uint16_t prescales[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+  return prescales[tccrb & 0x07];
+}
+
+// When a counter wrapping at top next equals ocr, in cycles, not counting
+// the match at lastMatch ticks.
+static uint64_t TimerNextCompare(uint32_t prescale, uint32_t top, uint16_t ocr, uint64_t lastMatch)
+{
+  uint64_t ticks = HostSim_Now / prescale;
+  uint32_t delta = (ocr - (uint32_t)ticks) & (top - 1);
+  uint64_t match = ticks + delta;
+  if (match <= lastMatch) match += top;
+  return match * prescale;
+}
+
+static inline uint32_t Timer0Prescale(void)
+{
+  return TimerPrescale(TCCR0B);
+}
+
+uint8_t HostSim_TCNT0(void)
+{
+  uint32_t prescale = Timer0Prescale();
+  return (prescale == 0) ? 0 : (uint8_t)(HostSim_Now / prescale);
+}
+
+static uint64_t Timer0ALastMatch;
+
+static uint64_t Timer0ANextCompare(void)
+{
+  uint32_t prescale = Timer0Prescale();
+  if (prescale == 0 || !(TIMSK0 & (1 << OCIE0A))) return NEVER;
+  return TimerNextCompare(prescale, 0x100, OCR0A, Timer0ALastMatch);
+}
+
+static inline uint32_t Timer1Prescale(void)
+{
+  return TimerPrescale(TCCR1B);
+}
+
+uint16_t HostSim_TCNT1(void)
+{
+  uint32_t prescale = Timer1Prescale();
+  return (prescale == 0) ? 0 : (uint16_t)(HostSim_Now / prescale);
+}
+
+static uint64_t Timer1BLastMatch;
+
+static uint64_t Timer1BNextCompare(void)
+{
+  uint32_t prescale = Timer1Prescale();
+  if (prescale == 0 || !(TIMSK1 & (1 << OCIE1B))) return NEVER;
+  return TimerNextCompare(prescale, 0x10000, OCR1B, Timer1BLastMatch);
+}
+
+static uint64_t Timer1OvfLastMatch;
+
+// When the counter next wraps to zero.
+static uint64_t Timer1OvfNext(void)
+{
+  uint32_t prescale = Timer1Prescale();
+  if (prescale == 0 || !(TIMSK1 & (1 << TOIE1))) return NEVER;
+  return TimerNextCompare(prescale, 0x10000, 0, Timer1OvfLastMatch);
+}
+
+static inline uint32_t Timer3Prescale(void)
+{
+  return TimerPrescale(TCCR3B);
+}
+
+uint16_t HostSim_TCNT3(void)
+{
+  uint32_t prescale = Timer3Prescale();
+  return (prescale == 0) ? 0 : (uint16_t)(HostSim_Now / prescale);
+}
+
+static uint64_t Timer3LastMatch;
+
+static uint64_t Timer3NextCompare(void)
+{
+  uint32_t prescale = Timer3Prescale();
+  if (prescale == 0 || !(TIMSK3 & (1 << OCIE3A))) return NEVER;
+  return TimerNextCompare(prescale, 0x10000, OCR3A, Timer3LastMatch);
+}
+
+/*** EEPROM ***/
+
+// A byte write (erase and program) takes 3.4 msec, busy waiting.
+#define EEPROM_WRITE_CYCLES (34 * HOSTSIM_CYCLES_PER_MSEC / 10)
+
+uint8_t eeprom_read_byte(const uint8_t *addr)
+{
+  return *addr;
+}
+
+void eeprom_update_byte(uint8_t *addr, uint8_t value)
+{
+  if (*addr != value) {
+    *addr = value;
+    HostSim_Advance(EEPROM_WRITE_CYCLES);
+  }
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+  memcpy(dst, src, n);
+}
+
+void eeprom_update_block(const void *src, void *dst, size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    eeprom_update_byte((uint8_t *)dst + i, ((const uint8_t *)src)[i]);
+  }
+}
+
+/*** Fake USB ***/
+
+// One CDC port for each keyboard; HID keys count as port 0's.
+#define PORTS KBD_CHANNELS
+
+// Packets handed to the hardware and waiting for an IN token.
+#define IN_MAX_BANKS 2
+#define IN_MAX_SIZE 64
+#define OUT_FIFO_SIZE 1024
+// Characters the host is waiting for, with the time their strobe fired.
+#define EXPECT_SIZE 4096
+
+typedef struct {
+  struct {
+    uint8_t len;
+    uint8_t data[IN_MAX_SIZE];
+  } inBanks[IN_MAX_BANKS];
+  uint8_t inBanksBusy, inBankNext;
+  uint64_t lastHostPoll, inBusySince;
+#if USB_HAS_CDC
+  // The bank being filled by firmware.
+  uint8_t inFill[IN_MAX_SIZE];
+  uint8_t inFillLen;
+  uint8_t outFifo[OUT_FIFO_SIZE];
+  uint16_t outFifoIn, outFifoOut;
+  // Still to be read from the packet in the OUT bank.
+  uint8_t outBankLen;
+#endif
+  struct {
+    uint8_t data;
+    uint64_t strobed;
+  } expects[EXPECT_SIZE];
+  uint16_t expectIn, expectOut;
+  // Of each byte, how many have arrived, and how many should in all.
+  uint32_t received[256];
+  bool counted[256];
+  uint32_t countMin[256], countMax[256];
+} port_t;
+
+static port_t Ports[PORTS];
+
+static void ExpectReceived(port_t *port, uint8_t data)
+{
+  port->received[data]++;
+  for (uint16_t i = port->expectOut; i != port->expectIn; i = (i + 1) % EXPECT_SIZE) {
+    if (port->expects[i].data == data) {
+      // Anything ahead of this in line is not coming.
+      while (port->expectOut != i) {
+        Trace("DROPPED %02X", port->expects[port->expectOut].data);
+        HostSim_Stats.Dropped++;
+        port->expectOut = (port->expectOut + 1) % EXPECT_SIZE;
+      }
+      uint64_t latency = HostSim_Now - port->expects[i].strobed;
+      if (HostSim_Stats.Delivered == 0 || latency < HostSim_Stats.LatencyMin)
+        HostSim_Stats.LatencyMin = latency;
+      if (latency > HostSim_Stats.LatencyMax)
+        HostSim_Stats.LatencyMax = latency;
+      HostSim_Stats.LatencyTotal += latency;
+      HostSim_Stats.Delivered++;
+      port->expectOut = (i + 1) % EXPECT_SIZE;
+      return;
+    }
+  }
+}
+
+// The host is not reading, as with the terminal program closed.
+static bool HostHold;
+
+static uint64_t HostNextPoll(port_t *port)
+{
+  if (port->inBanksBusy == 0 || HostHold) return NEVER;
+  return NextPeriod(HostSim_Costs.HostPollCycles, port->lastHostPoll, port->inBusySince);
+}
+
+static void HostPoll(port_t *port)
+{
+  uint8_t bank = (port->inBankNext + IN_MAX_BANKS - port->inBanksBusy) % IN_MAX_BANKS;
+  uint8_t len = port->inBanks[bank].len;
+  const uint8_t *data = port->inBanks[bank].data;
+  TraceBytes(port == &Ports[0] ? "IN " : "IN1", data, len);
+  for (uint8_t i = 0; i < len; i++) {
+    ExpectReceived(port, data[i]);
+  }
+  if (HostSim_Record != NULL && port == &Ports[0])
+    fwrite(data, 1, len, HostSim_Record);
+  if (HostSim_Stats.InPackets == 0)
+    HostSim_Stats.InFirst = HostSim_Now;
+  HostSim_Stats.InLast = HostSim_Now;
+  HostSim_Stats.InPackets++;
+  HostSim_Stats.InBytes += len;
+  port->inBanksBusy--;
+}
+
+#if USB_HAS_CDC
+
+static USB_ClassInfo_CDC_Device_t *const PortInterfaces[PORTS] = {
+  &VirtualSerial_CDC_Interface,
+#if KBD_CHANNELS > 1
+  &VirtualSerial_CDC_Interface_1,
+#endif
+};
+
+static port_t *CdcPort(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo)
+{
+  for (uint8_t i = 0; i < PORTS; i++) {
+    if (PortInterfaces[i] == CDCInterfaceInfo) return &Ports[i];
+  }
+  fprintf(stderr, "CDC interface not simulated\n");
+  exit(2);
+}
+
+// The port whose endpoint Endpoint_SelectEndpoint last chose, and
+// whether it was the OUT one.
+static port_t *SelectedPort = &Ports[0];
+static bool SelectedOut;
+
+static inline uint8_t InBankCount(void)
+{
+  return VirtualSerial_CDC_Interface.Config.DataINEndpoint.Banks;
+}
+
+static inline uint8_t InBankSize(void)
+{
+  return VirtualSerial_CDC_Interface.Config.DataINEndpoint.Size;
+}
+
+// Endpoint_ClearIN: hand the filled bank to the hardware.
+static void InClear(port_t *port)
+{
+  memcpy(port->inBanks[port->inBankNext].data, port->inFill, port->inFillLen);
+  port->inBanks[port->inBankNext].len = port->inFillLen;
+  port->inBankNext = (port->inBankNext + 1) % IN_MAX_BANKS;
+  if (port->inBanksBusy++ == 0) port->inBusySince = HostSim_Now;
+  port->inFillLen = 0;
+}
+
+// Endpoint_WaitUntilReady: spin until the host frees a bank.
+static uint8_t InWaitUntilReady(port_t *port)
+{
+  uint64_t timeout = HostSim_Now + 100 * HOSTSIM_CYCLES_PER_MSEC;
+  while (port->inBanksBusy >= InBankCount()) {
+    if (HostSim_Now >= timeout) return ENDPOINT_READYWAIT_Timeout;
+    uint64_t poll = HostNextPoll(port);
+    HostSim_Advance(poll > HostSim_Now ? poll - HostSim_Now : 0);
+  }
+  return ENDPOINT_READYWAIT_NoError;
+}
+
+static uint8_t InWrite(port_t *port, uint8_t data)
+{
+  if (port->inFillLen >= InBankSize() || port->inBanksBusy >= InBankCount()) {
+    if (port->inFillLen > 0) InClear(port);
+    uint8_t error = InWaitUntilReady(port);
+    if (error != ENDPOINT_READYWAIT_NoError) return error;
+  }
+  port->inFill[port->inFillLen++] = data;
+  Work();
+  HostSim_Advance(HostSim_Costs.ByteCycles);
+  return ENDPOINT_RWSTREAM_NoError;
+}
+
+static bool CDC_Ready(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo)
+{
+  return USB_DeviceState == DEVICE_STATE_Configured &&
+    CDCInterfaceInfo->State.LineEncoding.BaudRateBPS != 0;
+}
+
+uint8_t CDC_Device_SendByte(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo, const uint8_t Data)
+{
+  if (!CDC_Ready(CDCInterfaceInfo)) return ENDPOINT_RWSTREAM_DeviceDisconnected;
+  return InWrite(CdcPort(CDCInterfaceInfo), Data);
+}
+
+uint8_t CDC_Device_SendData(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo, const void* const Buffer, const uint16_t Length)
+{
+  if (!CDC_Ready(CDCInterfaceInfo)) return ENDPOINT_RWSTREAM_DeviceDisconnected;
+  for (uint16_t i = 0; i < Length; i++) {
+    uint8_t error = InWrite(CdcPort(CDCInterfaceInfo), ((const uint8_t *)Buffer)[i]);
+    if (error != ENDPOINT_RWSTREAM_NoError) return error;
+  }
+  return ENDPOINT_RWSTREAM_NoError;
+}
+
+uint8_t CDC_Device_SendString(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo, const char* const String)
+{
+  return CDC_Device_SendData(CDCInterfaceInfo, String, strlen(String));
+}
+
+uint8_t CDC_Device_SendString_P(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo, const char* const String)
+{
+  return CDC_Device_SendData(CDCInterfaceInfo, String, strlen(String));
+}
+
+uint8_t CDC_Device_Flush(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo)
+{
+  if (!CDC_Ready(CDCInterfaceInfo)) return ENDPOINT_RWSTREAM_DeviceDisconnected;
+  port_t *port = CdcPort(CDCInterfaceInfo);
+  if (port->inFillLen == 0) return ENDPOINT_READYWAIT_NoError;
+  if (port->inBanksBusy >= InBankCount()) {
+    uint8_t error = InWaitUntilReady(port);
+    if (error != ENDPOINT_READYWAIT_NoError) return error;
+  }
+  InClear(port);
+  return ENDPOINT_READYWAIT_NoError;
+}
+
+uint16_t CDC_Device_BytesReceived(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo)
+{
+  port_t *port = CdcPort(CDCInterfaceInfo);
+  uint16_t n = (port->outFifoIn + OUT_FIFO_SIZE - port->outFifoOut) % OUT_FIFO_SIZE;
+  uint16_t size = CDCInterfaceInfo->Config.DataOUTEndpoint.Size;
+  return (n < size) ? n : size;
+}
+
+int16_t CDC_Device_ReceiveByte(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo)
+{
+  if (!CDC_Ready(CDCInterfaceInfo)) return -1;
+  port_t *port = CdcPort(CDCInterfaceInfo);
+  if (port->outFifoIn == port->outFifoOut) return -1;
+  uint8_t data = port->outFifo[port->outFifoOut];
+  port->outFifoOut = (port->outFifoOut + 1) % OUT_FIFO_SIZE;
+  Work();
+  return data;
+}
+
+void Endpoint_SelectEndpoint(const uint8_t Address)
+{
+  for (uint8_t i = 0; i < PORTS; i++) {
+    if (Address == PortInterfaces[i]->Config.DataINEndpoint.Address ||
+        Address == PortInterfaces[i]->Config.DataOUTEndpoint.Address) {
+      SelectedPort = &Ports[i];
+      SelectedOut = (Address == PortInterfaces[i]->Config.DataOUTEndpoint.Address);
+      return;
+    }
+  }
+  fprintf(stderr, "endpoint %02X not simulated\n", Address);
+  exit(2);
+}
+
+bool Endpoint_IsINReady(void)
+{
+  return SelectedPort->inBanksBusy < InBankCount();
+}
+
+uint8_t Endpoint_WaitUntilReady(void)
+{
+  return InWaitUntilReady(SelectedPort);
+}
+
+void Endpoint_Write_8(const uint8_t Data)
+{
+  if (SelectedPort->inFillLen < InBankSize()) {
+    SelectedPort->inFill[SelectedPort->inFillLen++] = Data;
+  }
+  Work();
+  HostSim_Advance(HostSim_Costs.ByteCycles);
+}
+
+void Endpoint_ClearIN(void)
+{
+  InClear(SelectedPort);
+}
+
+// What the host sent is one byte stream; each packet takes as much of
+// it as fits.
+bool Endpoint_IsOUTReceived(void)
+{
+  port_t *port = SelectedPort;
+  if (port->outBankLen == 0) {
+    uint16_t n = (port->outFifoIn + OUT_FIFO_SIZE - port->outFifoOut) % OUT_FIFO_SIZE;
+    uint16_t size = PortInterfaces[port - Ports]->Config.DataOUTEndpoint.Size;
+    port->outBankLen = (n < size) ? n : size;
+  }
+  // Only a bank to take counts; polling an empty endpoint is not work.
+  if (port->outBankLen == 0) return false;
+  Work();
+  return true;
+}
+
+uint16_t Endpoint_BytesInEndpoint(void)
+{
+  return SelectedPort->outBankLen;
+}
+
+uint8_t Endpoint_Read_8(void)
+{
+  port_t *port = SelectedPort;
+  if (!SelectedOut || port->outBankLen == 0) {
+    fprintf(stderr, "OUT endpoint read with nothing received\n");
+    exit(2);
+  }
+  uint8_t data = port->outFifo[port->outFifoOut];
+  port->outFifoOut = (port->outFifoOut + 1) % OUT_FIFO_SIZE;
+  port->outBankLen--;
+  Work();
+  HostSim_Advance(HostSim_Costs.ByteCycles);
+  return data;
+}
+
+void Endpoint_ClearOUT(void)
+{
+  // Anything not read is lost, as with the hardware.
+  port_t *port = SelectedPort;
+  port->outFifoOut = (port->outFifoOut + port->outBankLen) % OUT_FIFO_SIZE;
+  port->outBankLen = 0;
+}
+
+void CDC_Device_SendControlLineStateChange(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo)
+{
+  Trace("LINE %04X", CDCInterfaceInfo->State.ControlLineStates.DeviceToHost);
+}
+
+void CDC_Device_USBTask(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo)
+{
+  if (!CDC_Ready(CDCInterfaceInfo)) return;
+  // Autoflush whatever is in the bank if the hardware can take it.
+  port_t *port = CdcPort(CDCInterfaceInfo);
+  if (port->inFillLen > 0 && port->inBanksBusy < InBankCount()) {
+    InClear(port);
+  }
+}
+
+#endif
+
+#if USB_HAS_HID
+
+// The report waiting for the host, which polls the interrupt endpoint once a frame.
+static bool HidBankFull;
+static USB_KeyboardReport_Data_t HidBank;
+// What the host has seen down.
+static USB_KeyboardReport_Data_t HidHostKeys;
+
+static inline uint16_t FrameNumber(void)
+{
+  return (HostSim_Now / HOSTSIM_CYCLES_PER_MSEC) & 0x7FF;
+}
+
+static uint64_t LastHidPoll, HidFullSince;
+
+static uint64_t HidNextPoll(void)
+{
+  if (!HidBankFull) return NEVER;
+  return NextPeriod(HOSTSIM_CYCLES_PER_MSEC, LastHidPoll, HidFullSince);
+}
+
+// The host's US layout, for usages 0x04 (A) to 0x38 (/).
+static const char HidUnshifted[] = "abcdefghijklmnopqrstuvwxyz1234567890\r\x1B\b\t -=[]\\\0;'`,./";
+static const char HidShifted[]   = "ABCDEFGHIJKLMNOPQRSTUVWXYZ!@#$%^&*()\r\x1B\b\t _+{}|\0:\"~<>?";
+
+static int16_t HidDecode(uint8_t modifier, uint8_t usage)
+{
+  char ch;
+  if (usage >= 0x04 && usage <= 0x38) {
+    ch = (modifier & HID_KEYBOARD_MODIFIER_LEFTSHIFT) ? HidShifted[usage - 0x04] : HidUnshifted[usage - 0x04];
+  } else if (usage == 0x4C) {
+    ch = 0x7F;
+  } else {
+    return -1;
+  }
+  if (modifier & HID_KEYBOARD_MODIFIER_LEFTCTRL) ch &= 0x1F;
+  if (modifier & HID_KEYBOARD_MODIFIER_LEFTALT) ch |= 0x80;
+  return (uint8_t)ch;
+}
+
+static void HidHostPoll(void)
+{
+  const USB_KeyboardReport_Data_t *report = &HidBank;
+  Trace("HID %02X %02X %02X %02X %02X %02X %02X", report->Modifier,
+        report->KeyCode[0], report->KeyCode[1], report->KeyCode[2],
+        report->KeyCode[3], report->KeyCode[4], report->KeyCode[5]);
+  // Like the OS, act on keys that were not down in the last report.
+  for (uint8_t i = 0; i < 6; i++) {
+    uint8_t usage = report->KeyCode[i];
+    if (usage == 0 || memchr(HidHostKeys.KeyCode, usage, 6) != NULL) continue;
+    if (usage == HID_KEYBOARD_SC_PAUSE) {
+      Trace("BREAK");
+      continue;
+    }
+    int16_t ch = HidDecode(report->Modifier, usage);
+    if (ch < 0) {
+      Trace("UNKNOWN %02X", usage);
+      continue;
+    }
+    ExpectReceived(&Ports[0], ch);
+    HostSim_Stats.HidKeys++;
+  }
+  HidHostKeys = *report;
+  HostSim_Stats.HidReports++;
+  HidBankFull = false;
+}
+
+void HID_Device_USBTask(USB_ClassInfo_HID_Device_t* const HIDInterfaceInfo)
+{
+  if (USB_DeviceState != DEVICE_STATE_Configured) return;
+  if (HIDInterfaceInfo->State.PrevFrameNum == FrameNumber()) return;
+  if (HidBankFull) return;
+
+  uint8_t ReportINData[HIDInterfaceInfo->Config.PrevReportINBufferSize];
+  uint8_t ReportID = 0;
+  uint16_t ReportINSize = 0;
+  memset(ReportINData, 0, sizeof(ReportINData));
+
+  bool ForceSend = CALLBACK_HID_Device_CreateHIDReport(HIDInterfaceInfo, &ReportID, HID_REPORT_ITEM_In,
+                                                       ReportINData, &ReportINSize);
+  bool StatesChanged = false;
+  bool IdlePeriodElapsed = (HIDInterfaceInfo->State.IdleCount && !(HIDInterfaceInfo->State.IdleMSRemaining));
+  if (HIDInterfaceInfo->Config.PrevReportINBuffer != NULL) {
+    StatesChanged = (memcmp(ReportINData, HIDInterfaceInfo->Config.PrevReportINBuffer, ReportINSize) != 0);
+    memcpy(HIDInterfaceInfo->Config.PrevReportINBuffer, ReportINData, HIDInterfaceInfo->Config.PrevReportINBufferSize);
+  }
+  if (ReportINSize && (ForceSend || StatesChanged || IdlePeriodElapsed)) {
+    HIDInterfaceInfo->State.IdleMSRemaining = HIDInterfaceInfo->State.IdleCount;
+    memcpy(&HidBank, ReportINData, sizeof(HidBank));
+    HidBankFull = true;
+    HidFullSince = HostSim_Now;
+    Work();
+    HostSim_Advance(HostSim_Costs.ByteCycles * ReportINSize);
+  }
+  HIDInterfaceInfo->State.PrevFrameNum = FrameNumber();
+}
+
+#endif
+
+void USB_USBTask(void)
+{
+}
+
+/*** Scheduled stimuli ***/
+
+enum {
+  EVENT_STROBE,
+  EVENT_STROBE_RELEASE,
+  EVENT_DIRECT,
+  EVENT_HOST_BYTE,
+  EVENT_DTR,
+  EVENT_EXPECT,
+  EVENT_CHAR_PINS,
+  EVENT_HOLD,
+  EVENT_FLOW,
+  EVENT_STROBE_HELD,
+  EVENT_PRINTER_ACK,
+  EVENT_PRINTER_READY,
+  EVENT_KEY_DOWN,
+};
+
+typedef struct {
+  uint64_t at;
+  uint32_t seq;
+  uint8_t kind;
+  uint8_t channel;              // Which keyboard or port.
+  uint16_t value;
+  int16_t expected;
+} event_t;
+
+static event_t *Events;
+static uint32_t EventsCount, EventsCapacity, EventsSeq;
+// For the events scheduled next.
+static uint8_t ScheduleChannel;
+
+static bool EventBefore(const event_t *a, const event_t *b)
+{
+  return (a->at < b->at) || (a->at == b->at && a->seq < b->seq);
+}
+
+static void ScheduleOn(uint64_t at, uint8_t kind, uint8_t channel, uint16_t value, int16_t expected)
+{
+  if (EventsCount == EventsCapacity) {
+    EventsCapacity = EventsCapacity ? EventsCapacity * 2 : 256;
+    Events = realloc(Events, EventsCapacity * sizeof(event_t));
+    if (Events == NULL) {
+      perror("realloc");
+      exit(2);
+    }
+  }
+  // Binary min-heap.
+  event_t event = { at, EventsSeq++, kind, channel, value, expected };
+  uint32_t i = EventsCount++;
+  while (i > 0) {
+    uint32_t parent = (i - 1) / 2;
+    if (!EventBefore(&event, &Events[parent])) break;
+    Events[i] = Events[parent];
+    i = parent;
+  }
+  Events[i] = event;
+}
+
+// On the channel chosen by HostSim_SelectChannel.
+static void Schedule(uint64_t at, uint8_t kind, uint16_t value, int16_t expected)
+{
+  ScheduleOn(at, kind, ScheduleChannel, value, expected);
+}
+
+static event_t Unschedule(void)
+{
+  event_t top = Events[0];
+  event_t last = Events[--EventsCount];
+  uint32_t i = 0;
+  for (;;) {
+    uint32_t child = 2 * i + 1;
+    if (child >= EventsCount) break;
+    if (child + 1 < EventsCount && EventBefore(&Events[child + 1], &Events[child]))
+      child++;
+    if (!EventBefore(&Events[child], &last)) break;
+    Events[i] = Events[child];
+    i = child;
+  }
+  Events[i] = last;
+  return top;
+}
+
+/*** Keyboard flow control ***/
+
+// Polarity of the ready / ack line on C7, as in ParallelKeyboard.c.
+#define READY_ACK_ON_LOW false
+#define READY_ACK_ON_HIGH true
+#ifndef READY_ACK_ON_STATE
+#define READY_ACK_ON_STATE READY_ACK_ON_HIGH
+#endif
+
+// With flow on, the keyboard holds its strobes while ready is off and
+// sends them once it is on again, in order.
+static bool KbdFlow;
+#define HELD_SIZE 1024
+static uint8_t Held[HELD_SIZE];
+static uint16_t HeldIn, HeldOut;
+static uint64_t LastHeldRelease;
+
+static bool ReadyOn(void)
+{
+  if (!(DDRC & (1 << 7))) return true;
+  return ((PORTC & (1 << 7)) != 0) == READY_ACK_ON_STATE;
+}
+
+static bool StrobeHold(uint8_t pins)
+{
+  if (!KbdFlow || (HeldIn == HeldOut && ReadyOn())) return false;
+  if ((uint16_t)(HeldIn - HeldOut) < HELD_SIZE) {
+    Held[HeldIn++ % HELD_SIZE] = pins;
+  }
+  HostSim_Stats.StrobesHeld++;
+  return true;
+}
+
+// One held strobe at a time, a pulse width apart.
+static void StrobeRelease(void)
+{
+  if (HeldIn == HeldOut || !ReadyOn()) return;
+  if (HostSim_Now < LastHeldRelease + 2 * HostSim_Costs.StrobeCycles) return;
+  LastHeldRelease = HostSim_Now;
+  ScheduleOn(HostSim_Now, EVENT_STROBE_HELD, 0, Held[HeldOut++ % HELD_SIZE], HOSTSIM_NO_EXPECT);
+}
+
+void HostSim_ScheduleStrobe(uint64_t at, uint8_t charPins, int16_t expected)
+{
+  Schedule(at, EVENT_STROBE, charPins, expected);
+}
+
+void HostSim_ScheduleDirect(uint64_t at, uint16_t directPins)
+{
+  Schedule(at, EVENT_DIRECT, directPins, HOSTSIM_NO_EXPECT);
+}
+
+void HostSim_ScheduleHostByte(uint64_t at, uint8_t data)
+{
+  Schedule(at, EVENT_HOST_BYTE, data, HOSTSIM_NO_EXPECT);
+}
+
+void HostSim_ScheduleDTR(uint64_t at, bool on)
+{
+  Schedule(at, EVENT_DTR, on, HOSTSIM_NO_EXPECT);
+}
+
+void HostSim_ScheduleCharPins(uint64_t at, uint8_t charPins)
+{
+  Schedule(at, EVENT_CHAR_PINS, charPins, HOSTSIM_NO_EXPECT);
+}
+
+void HostSim_ScheduleExpect(uint64_t at, uint8_t data)
+{
+  Schedule(at, EVENT_EXPECT, 0, data);
+}
+
+void HostSim_ScheduleHold(uint64_t at, bool hold)
+{
+  Schedule(at, EVENT_HOLD, hold, HOSTSIM_NO_EXPECT);
+}
+
+void HostSim_ScheduleFlow(uint64_t at, bool flow)
+{
+  Schedule(at, EVENT_FLOW, flow, HOSTSIM_NO_EXPECT);
+}
+
+void HostSim_ScheduleKeyDown(uint64_t at, bool down)
+{
+  Schedule(at, EVENT_KEY_DOWN, down, HOSTSIM_NO_EXPECT);
+}
+
+void HostSim_ExpectCount(uint8_t data, uint32_t min, uint32_t max)
+{
+  port_t *port = &Ports[ScheduleChannel];
+  port->counted[data] = true;
+  port->countMin[data] = min;
+  port->countMax[data] = max;
+}
+
+void HostSim_SelectChannel(uint8_t channel)
+{
+  if (channel >= KBD_CHANNELS) {
+    fprintf(stderr, "channel %u not simulated\n", channel);
+    exit(2);
+  }
+  ScheduleChannel = channel;
+}
+
+bool HostSim_EventsPending(void)
+{
+  return EventsCount > 0 || HeldIn != HeldOut;
+}
+
+/*** Printer on the output port ***/
+
+#ifdef OUTPUT_PORT
+// Handshake and polarities, as in ParallelKeyboard.c.
+#define OUTPUT_HANDSHAKE_NONE 0
+#define OUTPUT_HANDSHAKE_BUSY 1
+#define OUTPUT_HANDSHAKE_ACK 2
+#ifndef OUTPUT_HANDSHAKE
+#define OUTPUT_HANDSHAKE OUTPUT_HANDSHAKE_NONE
+#endif
+#ifndef OUTPUT_STROBE_ON_STATE
+#define OUTPUT_STROBE_ON_STATE READY_ACK_ON_LOW
+#endif
+#ifndef OUTPUT_HANDSHAKE_ON_STATE
+#if OUTPUT_HANDSHAKE == OUTPUT_HANDSHAKE_BUSY
+#define OUTPUT_HANDSHAKE_ON_STATE READY_ACK_ON_HIGH
+#else
+#define OUTPUT_HANDSHAKE_ON_STATE READY_ACK_ON_LOW
+#endif
+#endif
+// Width of the ack pulse.
+#define PRINTER_ACK_CYCLES (5 * HOSTSIM_CYCLES_PER_USEC)
+#endif
+
+// What the printer should get, in order.
+#define PRINT_EXPECT_SIZE 4096
+static uint8_t PrintExpects[PRINT_EXPECT_SIZE];
+static uint16_t PrintExpectIn, PrintExpectOut;
+
+void HostSim_ExpectPrint(uint8_t data)
+{
+  PrintExpects[PrintExpectIn] = data;
+  PrintExpectIn = (PrintExpectIn + 1) % PRINT_EXPECT_SIZE;
+}
+
+#ifdef OUTPUT_PORT
+static void PrintReceived(uint8_t data)
+{
+  for (uint16_t i = PrintExpectOut; i != PrintExpectIn; i = (i + 1) % PRINT_EXPECT_SIZE) {
+    if (PrintExpects[i] == data) {
+      // Anything ahead of this in line is not coming.
+      while (PrintExpectOut != i) {
+        Trace("DROPPED PRINT %02X", PrintExpects[PrintExpectOut]);
+        HostSim_Stats.Dropped++;
+        PrintExpectOut = (PrintExpectOut + 1) % PRINT_EXPECT_SIZE;
+      }
+      PrintExpectOut = (i + 1) % PRINT_EXPECT_SIZE;
+      return;
+    }
+  }
+}
+
+static bool PrinterStrobed;
+static uint64_t PrinterBusyUntil;
+
+// The busy or ack line on E6.
+static void PrinterLine(bool on)
+{
+  if (on == OUTPUT_HANDSHAKE_ON_STATE)
+    PINE |= (1 << 6);
+  else
+    PINE &= ~(1 << 6);
+}
+
+// Called as time passes: the leading edge of the strobe on F0 latches
+// D1-D7, unless the printer is still busy with the last character, which
+// then loses this one.
+static void PrinterSample(void)
+{
+  bool strobed = (DDRF & (1 << 0)) && (((PORTF & (1 << 0)) != 0) == OUTPUT_STROBE_ON_STATE);
+  if (strobed == PrinterStrobed) return;
+  PrinterStrobed = strobed;
+  if (!strobed) return;
+  uint8_t data = (PORTD >> 1) & 0x7F;
+  if (HostSim_Now < PrinterBusyUntil) {
+    Trace("PRINT LOST %02X", data);
+    return;
+  }
+  Trace("PRINT %02X", data);
+  HostSim_Stats.Printed++;
+  PrintReceived(data);
+  PrinterBusyUntil = HostSim_Now + HostSim_Costs.PrintCycles;
+#if OUTPUT_HANDSHAKE == OUTPUT_HANDSHAKE_BUSY
+  PrinterLine(true);
+  Schedule(PrinterBusyUntil, EVENT_PRINTER_READY, 0, HOSTSIM_NO_EXPECT);
+#elif OUTPUT_HANDSHAKE == OUTPUT_HANDSHAKE_ACK
+  Schedule(PrinterBusyUntil, EVENT_PRINTER_ACK, 0, HOSTSIM_NO_EXPECT);
+#endif
+}
+#else
+static inline void PrinterSample(void)
+{
+}
+#endif
+
+/*** Keyboard pins and event dispatch ***/
+
+// D0 and, with KBD_CHANNELS, the other keyboards' strobes after it.
+#define STROBE_PINS ((1 << KBD_CHANNELS) - 1)
+
+// Edges on D1-D3 that EICRA says should set the INT1-INT3 flags.
+static void DirectEdges(uint8_t before, uint8_t after)
+{
+  for (uint8_t n = INT0 + KBD_CHANNELS; n <= INT3; n++) {
+    uint8_t bit = 1 << n;
+    if (!(EIMSK & bit) || !((before ^ after) & bit)) continue;
+    switch ((EICRA >> (2 * n)) & 3) {
+    case 1:                     // Any edge.
+      IntDirectPending |= bit;
+      break;
+    case 2:                     // Falling.
+      if (!(after & bit)) IntDirectPending |= bit;
+      break;
+    case 3:                     // Rising.
+      if (after & bit) IntDirectPending |= bit;
+      break;
+    }
+  }
+}
+
+// A key held down keeps its strobe on until it is let go.
+static bool KeysDown[KBD_CHANNELS];
+
+// The level of STROBE while a pulse is in progress, from the configured edge.
+static inline bool StrobeActiveHigh(void)
+{
+  return (EICRA & ((1 << ISC01) | (1 << ISC00))) == ((1 << ISC01) | (1 << ISC00));
+}
+
+static void Expect(port_t *port, uint8_t data)
+{
+  port->expects[port->expectIn].data = data;
+  port->expects[port->expectIn].strobed = HostSim_Now;
+  port->expectIn = (port->expectIn + 1) % EXPECT_SIZE;
+  HostSim_Stats.Expected++;
+}
+
+#if KBD_CHANNELS > 1
+// What each keyboard's strobe last clocked into its latch; PINB follows
+// the latch whose output enable on PORTF is low, floating high otherwise.
+static uint8_t Latches[KBD_CHANNELS];
+
+static void DriveBus(void)
+{
+  uint8_t value = 0xFF;
+  for (uint8_t n = 0; n < KBD_CHANNELS; n++) {
+    if ((DDRF & (1 << n)) && !(PORTF & (1 << n))) value &= Latches[n];
+  }
+  PINB = value;
+}
+#endif
+
+// _NOP: a cycle, in which an output enable takes effect.
+void HostSim_Nop(void)
+{
+  HostSim_Advance(1);
+#if KBD_CHANNELS > 1
+  DriveBus();
+#endif
+}
+
+static void Dispatch(event_t *event)
+{
+  switch (event->kind) {
+  case EVENT_STROBE:
+  case EVENT_STROBE_HELD:
+    if (event->expected != HOSTSIM_NO_EXPECT) {
+      // From when it was typed, even if it is held.
+      Expect(&Ports[event->channel], event->expected);
+    }
+    if (event->kind == EVENT_STROBE && StrobeHold(event->value)) {
+      Trace("HELD %02X", event->value);
+      break;
+    }
+#if KBD_CHANNELS > 1
+    Latches[event->channel] = event->value;
+#else
+    PINB = event->value;
+#endif
+    if (StrobeActiveHigh())
+      PIND |= (1 << event->channel);
+    else
+      PIND &= ~(1 << event->channel);
+    HostSim_Stats.Strobes++;
+    if (event->channel == 0)
+      Trace("STROBE %02X", event->value);
+    else
+      Trace("STROBE%u %02X", event->channel, event->value);
+    if (event->channel == 0) {
+      if (EIMSK & (1 << INT0)) Int0Pending = true;
+    } else if (EIMSK & (1 << (INT0 + event->channel))) {
+      IntDirectPending |= 1 << (INT0 + event->channel);
+    }
+    ScheduleOn(HostSim_Now + HostSim_Costs.StrobeCycles, EVENT_STROBE_RELEASE, event->channel, 0, HOSTSIM_NO_EXPECT);
+    break;
+  case EVENT_STROBE_RELEASE:
+  case EVENT_KEY_DOWN:
+    if (event->kind == EVENT_KEY_DOWN) {
+      KeysDown[event->channel] = event->value;
+      Trace("KEY %s", event->value ? "DOWN" : "UP");
+      if (event->value) break;
+    } else if (KeysDown[event->channel]) {
+      break;
+    }
+    if (StrobeActiveHigh())
+      PIND &= ~(1 << event->channel);
+    else
+      PIND |= (1 << event->channel);
+    break;
+  case EVENT_DIRECT:
+    DirectEdges(PIND, event->value);
+    // The strobes are not direct keys.
+    PIND = (PIND & STROBE_PINS) | (event->value & 0xFF & ~STROBE_PINS);
+    PINF = event->value >> 8;
+    Trace("DIRECT %04X", event->value);
+    break;
+  case EVENT_HOST_BYTE:
+#if USB_HAS_CDC
+    {
+      port_t *port = &Ports[event->channel];
+      uint8_t data = event->value;
+      port->outFifo[port->outFifoIn] = data;
+      port->outFifoIn = (port->outFifoIn + 1) % OUT_FIFO_SIZE;
+      HostSim_Stats.OutBytes++;
+      TraceBytes(event->channel ? "OUT1" : "OUT", &data, 1);
+    }
+#endif
+    break;
+  case EVENT_DTR:
+#if USB_HAS_CDC
+    {
+      USB_ClassInfo_CDC_Device_t *interface = PortInterfaces[event->channel];
+      if (event->value)
+        interface->State.ControlLineStates.HostToDevice |= CDC_CONTROL_LINE_OUT_DTR;
+      else
+        interface->State.ControlLineStates.HostToDevice &= ~CDC_CONTROL_LINE_OUT_DTR;
+      Trace("DTR %u", event->value);
+      // Delivered from the control endpoint interrupt.
+      if (EVENT_CDC_Device_ControLineStateChanged != NULL)
+        EVENT_CDC_Device_ControLineStateChanged(interface);
+    }
+#endif
+    break;
+  case EVENT_EXPECT:
+    Expect(&Ports[event->channel], event->expected);
+    break;
+  case EVENT_CHAR_PINS:
+#if KBD_CHANNELS > 1
+    Latches[event->channel] = event->value;
+#else
+    PINB = event->value;
+#endif
+    Trace("CHAR %02X", event->value);
+    break;
+  case EVENT_HOLD:
+    HostHold = event->value;
+    Trace("HOLD %u", event->value);
+    break;
+  case EVENT_FLOW:
+    KbdFlow = event->value;
+    break;
+#ifdef OUTPUT_PORT
+  case EVENT_PRINTER_ACK:
+    PrinterLine(true);
+    if (EIMSK & (1 << INT6)) Int6Pending = true;
+    Schedule(HostSim_Now + PRINTER_ACK_CYCLES, EVENT_PRINTER_READY, 0, HOSTSIM_NO_EXPECT);
+    break;
+  case EVENT_PRINTER_READY:
+    PrinterLine(false);
+    break;
+#endif
+  }
+}
+
+/*** Clock ***/
+
+void HostSim_Advance(uint32_t cycles)
+{
+  PrinterSample();
+  BellSample();
+  if (InAdvance) {
+    // A busy wait inside an interrupt handler: the pins still change,
+    // but nothing else can run until it returns.
+    uint64_t until = HostSim_Now + cycles;
+    while (EventsCount > 0 && Events[0].at <= until) {
+      event_t event = Unschedule();
+      if (event.at > HostSim_Now) HostSim_Now = event.at;
+      Dispatch(&event);
+    }
+    HostSim_Now = until;
+    return;
+  }
+  InAdvance = true;
+  uint64_t until = HostSim_Now + cycles;
+  for (;;) {
+    uint64_t next = until;
+    int which = -1;
+    if (EventsCount > 0 && Events[0].at <= next) {
+      next = Events[0].at;
+      which = 0;
+    }
+    uint64_t sof = NextPeriod(HOSTSIM_CYCLES_PER_MSEC, LastSOF, 0);
+    if (EVENT_USB_Device_StartOfFrame != NULL && sof <= next) {
+      next = sof;
+      which = 1;
+    }
+    uint64_t compare = Timer3NextCompare();
+    if (compare <= next) {
+      next = compare;
+      which = 2;
+    }
+    port_t *pollPort = NULL;
+    for (uint8_t i = 0; i < PORTS; i++) {
+      uint64_t poll = HostNextPoll(&Ports[i]);
+      if (poll <= next) {
+        next = poll;
+        which = 3;
+        pollPort = &Ports[i];
+      }
+    }
+#if USB_HAS_HID
+    uint64_t hidPoll = HidNextPoll();
+    if (hidPoll <= next) {
+      next = hidPoll;
+      which = 4;
+    }
+#endif
+    uint64_t compareB = Timer1BNextCompare();
+    if (compareB <= next) {
+      next = compareB;
+      which = 5;
+    }
+    uint64_t compare0A = Timer0ANextCompare();
+    if (compare0A <= next) {
+      next = compare0A;
+      which = 6;
+    }
+    uint64_t overflow1 = Timer1OvfNext();
+    if (overflow1 <= next) {
+      next = overflow1;
+      which = 7;
+    }
+    if (which < 0) break;
+    if (next > HostSim_Now) HostSim_Now = next;
+    switch (which) {
+    case 0:
+      {
+        event_t event = Unschedule();
+        Dispatch(&event);
+      }
+      break;
+    case 1:
+      LastSOF = next;
+      SOFPending = true;
+      break;
+    case 2:
+      Timer3LastMatch = next / Timer3Prescale();
+      TIFR3 |= (1 << OCF3A);
+      Timer3Pending = true;
+      break;
+    case 3:
+      pollPort->lastHostPoll = next;
+      HostPoll(pollPort);
+      break;
+#if USB_HAS_HID
+    case 4:
+      LastHidPoll = next;
+      HidHostPoll();
+      break;
+#endif
+    case 5:
+      Timer1BLastMatch = next / Timer1Prescale();
+      TIFR1 |= (1 << OCF1B);
+      Timer1BPending = true;
+      break;
+    case 6:
+      Timer0ALastMatch = next / Timer0Prescale();
+      TIFR0 |= (1 << OCF0A);
+      Timer0APending = true;
+      break;
+    case 7:
+      Timer1OvfLastMatch = next / Timer1Prescale();
+      TIFR1 |= (1 << TOV1);
+      Timer1OvfPending = true;
+      break;
+    }
+    RunPendingISRs();
+  }
+  if (HostSim_Now < until) HostSim_Now = until;
+  InAdvance = false;
+}
+
+/*** Main loop ***/
+
+void HostSim_Init(void)
+{
+  USB_DeviceState = DEVICE_STATE_Configured;
+#if USB_HAS_CDC
+  // As though a terminal program has opened each port.
+  for (uint8_t i = 0; i < PORTS; i++) {
+    PortInterfaces[i]->State.LineEncoding.BaudRateBPS = 115200;
+    PortInterfaces[i]->State.LineEncoding.DataBits = 8;
+  }
+#endif
+#if USB_HAS_HID
+  // Report protocol, and an idle rate of zero as set by most hosts.
+  Keyboard_HID_Interface.State.UsingReportProtocol = true;
+  Keyboard_HID_Interface.State.PrevFrameNum = 0xFFFF;
+#endif
+
+#ifdef PROFILE
+  Profile_Init();
+#endif
+  Parallel_Kbd_Init();
+  // Idle level of STROBE, now that the edge is configured.
+  if (StrobeActiveHigh())
+    PIND &= ~STROBE_PINS;
+  else
+    PIND |= STROBE_PINS;
+#if KBD_CHANNELS > 1
+  DriveBus();
+#endif
+#ifdef OUTPUT_PORT
+  PrinterLine(false);
+#endif
+
+  InterruptsEnabled = true;
+}
+
+/** Same as the body of main() in VirtualSerial.c. */
+void HostSim_MainLoop(void)
+{
+  StrobeRelease();
+
+  uint64_t passStart = HostSim_Now;
+  InPass = true;
+  PassWork = false;
+  PROFILE_BEGIN(loopStart);
+  PROFILE_BEGIN(phaseStart);
+
+  Parallel_Kbd_Task();
+  PROFILE_LAP(PROFILE_KBD_TASK, phaseStart);
+
+  // What these cost on the device is charged to the loop as a whole.
+  HostSim_Advance(HostSim_Costs.LoopCycles);
+#if USB_HAS_CDC
+  CDC_Device_USBTask(&VirtualSerial_CDC_Interface);
+#endif
+#if KBD_CHANNELS > 1
+  CDC_Device_USBTask(&VirtualSerial_CDC_Interface_1);
+#endif
+#if USB_HAS_HID
+  HID_Device_USBTask(&Keyboard_HID_Interface);
+#endif
+  PROFILE_LAP(PROFILE_CDC_TASK, phaseStart);
+  USB_USBTask();
+  PROFILE_END(PROFILE_USB_TASK, phaseStart);
+
+  PROFILE_END(PROFILE_LOOP, loopStart);
+  HostSim_Stats.MainLoops++;
+  InPass = false;
+  if (PassWork) HostSim_Stats.BusyCycles += HostSim_Now - passStart;
+
+#ifdef SLEEP_IDLE
+  Parallel_Kbd_Idle();
+#endif
+}
+
+void HostSim_Finish(void)
+{
+  for (uint8_t i = 0; i < PORTS; i++) {
+    port_t *port = &Ports[i];
+    while (port->expectOut != port->expectIn) {
+      Trace("DROPPED %02X", port->expects[port->expectOut].data);
+      HostSim_Stats.Dropped++;
+      port->expectOut = (port->expectOut + 1) % EXPECT_SIZE;
+    }
+    for (uint16_t data = 0; data < 256; data++) {
+      if (port->counted[data] &&
+          (port->received[data] < port->countMin[data] || port->received[data] > port->countMax[data])) {
+        Trace("RECEIVED %02X %u TIMES, NOT %u TO %u", data, port->received[data],
+              port->countMin[data], port->countMax[data]);
+        HostSim_Stats.Dropped++;
+      }
+    }
+  }
+  while (PrintExpectOut != PrintExpectIn) {
+    Trace("DROPPED PRINT %02X", PrintExpects[PrintExpectOut]);
+    HostSim_Stats.Dropped++;
+    PrintExpectOut = (PrintExpectOut + 1) % PRINT_EXPECT_SIZE;
+  }
+  if (BellsExpected >= 0 && HostSim_Stats.Bells != (uint32_t)BellsExpected) {
+    Trace("BELLS %u, NOT %d", HostSim_Stats.Bells, BellsExpected);
+    HostSim_Stats.Dropped++;
+  }
+}
@@ -0,0 +1,104 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Header file for HostSim.c.
+ *
+ *  A host build of ParallelKeyboard.c runs against simulated ports, a
+ *  simulated CPU clock and fake CDC and HID endpoints. Time only moves forward when
+ *  the firmware does work (a main loop pass, an endpoint write, a busy wait);
+ *  scheduled strobes, direct key changes and host traffic are delivered as the
+ *  clock passes them, calling the ISRs just as the hardware would.
+ */
+
+#ifndef _HOSTSIM_H_
+#define _HOSTSIM_H_
+
+  /* Includes: */
+    #include <stdbool.h>
+    #include <stdint.h>
+    #include <stdio.h>
+
+  /* Macros: */
+    /** Simulated CPU cycles per microsecond. */
+    #define HOSTSIM_CYCLES_PER_USEC (F_CPU / 1000000)
+
+    /** Simulated CPU cycles per millisecond, which is also one USB frame. */
+    #define HOSTSIM_CYCLES_PER_MSEC (F_CPU / 1000)
+
+    /** Expected value for a strobe that should not produce any output. */
+    #define HOSTSIM_NO_EXPECT -1
+
+  /* Type Defines: */
+    /** Coarse cost model, in CPU cycles. */
+    typedef struct
+    {
+      uint32_t LoopCycles;      /**< One pass of the main loop outside of Parallel_Kbd_Task. */
+      uint32_t IsrCycles;       /**< Entry, body and exit of an interrupt handler. */
+      uint32_t ByteCycles;      /**< Writing one byte into the IN endpoint bank. */
+      uint32_t HostPollCycles;  /**< Interval between IN tokens from the host. */
+      uint32_t StrobeCycles;    /**< Width of the keyboard's strobe pulse. */
+      uint32_t SleepStepCycles; /**< Granularity of waking from sleep. */
+      uint32_t PrintCycles;     /**< Time the printer on OUTPUT_PORT takes over each character. */
+    } HostSim_Costs_t;
+
+    typedef struct
+    {
+      uint32_t Strobes;         /**< Strobe edges seen by the keyboard. */
+      uint32_t StrobesHeld;     /**< Held back by the keyboard while ready was off. */
+      uint32_t Expected;        /**< Characters the host should receive. */
+      uint32_t Delivered;       /**< Expected characters that reached the host. */
+      uint32_t Dropped;         /**< Expected characters that never did. */
+      uint64_t LatencyMin;      /**< Strobe to host receipt, in cycles. */
+      uint64_t LatencyMax;
+      uint64_t LatencyTotal;
+      uint32_t InPackets;       /**< IN packets taken by the host. */
+      uint32_t InBytes;
+      uint64_t InFirst;         /**< When the first and last IN packets were taken. */
+      uint64_t InLast;
+      uint32_t HidReports;      /**< HID keyboard reports taken by the host. */
+      uint32_t HidKeys;         /**< Key presses in them that the host recognized. */
+      uint32_t OutBytes;        /**< Bytes sent by the host. */
+      uint32_t Printed;         /**< Characters taken by the printer on OUTPUT_PORT. */
+      uint32_t Bells;           /**< Rings of the bell on C6. */
+      uint32_t MainLoops;
+      uint32_t Interrupts;
+      uint32_t Sleeps;          /**< Times the main loop slept, with SLEEP_IDLE. */
+      uint64_t SleepCycles;     /**< Time spent asleep. */
+      uint64_t BusyCycles;      /**< Main loop passes that had a strobe, direct key edge or
+                                 *   endpoint byte to handle, and any such interrupt while asleep. */
+    } HostSim_Stats_t;
+
+  /* External Variables: */
+    extern uint64_t HostSim_Now;
+    extern HostSim_Costs_t HostSim_Costs;
+    extern HostSim_Stats_t HostSim_Stats;
+    extern bool HostSim_Verbose;
+    extern FILE *HostSim_Record;        /**< If set, gets every byte the host takes from the CDC IN endpoint. */
+
+  /* Function Prototypes: */
+    void HostSim_Init(void);
+    void HostSim_Advance(uint32_t cycles);
+    void HostSim_MainLoop(void);
+    void HostSim_Finish(void);
+    void HostSim_Sleep(void);
+    void HostSim_Nop(void);
+
+    void HostSim_ScheduleStrobe(uint64_t at, uint8_t charPins, int16_t expected);
+    void HostSim_ScheduleDirect(uint64_t at, uint16_t directPins);
+    void HostSim_ScheduleHostByte(uint64_t at, uint8_t data);
+    void HostSim_ScheduleDTR(uint64_t at, bool on);
+    void HostSim_ScheduleCharPins(uint64_t at, uint8_t charPins);
+    void HostSim_ScheduleExpect(uint64_t at, uint8_t data);
+    void HostSim_ScheduleHold(uint64_t at, bool hold);
+    void HostSim_ScheduleFlow(uint64_t at, bool flow);
+    void HostSim_ScheduleKeyDown(uint64_t at, bool down);
+    void HostSim_ExpectPrint(uint8_t data);
+    void HostSim_ExpectBells(uint32_t count, uint32_t spacingMsec);
+    void HostSim_ExpectCount(uint8_t data, uint32_t min, uint32_t max);
+    void HostSim_SelectChannel(uint8_t channel);
+    bool HostSim_EventsPending(void);
+
+#endif
@@ -0,0 +1,219 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Records what a CAPTURE build of the firmware sees from the keyboard, for
+ *  the replay command of KbdSim.
+ *
+ *    KbdCapture -r TTY FILE     send DLE c to the keyboard on TTY and record
+ *                               its frames into FILE until interrupted, then
+ *                               send DLE e
+ *    KbdCapture -x STREAM FILE  take the frames out of everything saved from
+ *                               the port during a capture, such as by KbdSim -o
+ *    KbdCapture -d FILE         list the frames in FILE, one per line, with
+ *                               the time since the first in usec
+ *
+ *  Nothing else should be talking to the keyboard during a capture, since
+ *  any other reply would be mixed in with the frames.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "CaptureFile.h"
+
+/*** Extracting frames from the port ***/
+
+typedef struct {
+  FILE *out;
+  bool started, done, error;
+  char last[3];                 // To find the C reply.
+  uint8_t frame[CAPTURE_FRAME_MAX];
+  size_t length;
+  unsigned long frames;
+} extract_t;
+
+// Takes the next byte from the port.
+static void ExtractByte(extract_t *extract, uint8_t b)
+{
+  if (extract->done) return;
+  if (!extract->started) {
+    memmove(extract->last, extract->last + 1, 2);
+    extract->last[2] = b;
+    extract->started = !memcmp(extract->last, "C\r\n", 3);
+    return;
+  }
+  extract->frame[extract->length++] = b;
+  capture_frame_t frame;
+  int n = CaptureFile_Parse(extract->frame, extract->length, &frame);
+  if (n < 0) {
+    // Should be the E reply.
+    extract->error = (extract->length > 1 || b != 'E');
+    extract->done = true;
+    extract->length = 0;
+  } else if (n > 0) {
+    fwrite(extract->frame, 1, n, extract->out);
+    extract->frames++;
+    extract->length = 0;
+  }
+}
+
+static int ExtractFinish(extract_t *extract, const char *file)
+{
+  if (!extract->started) {
+    fprintf(stderr, "%s: no C reply, not a CAPTURE build?\n", file);
+    return 1;
+  }
+  if (extract->error || extract->length > 0) {
+    fprintf(stderr, "%s: bad frame after %lu\n", file, extract->frames);
+    return 1;
+  }
+  fprintf(stderr, "%lu frames\n", extract->frames);
+  return 0;
+}
+
+static int ExtractStream(const char *stream, FILE *out)
+{
+  FILE *in = fopen(stream, "rb");
+  if (in == NULL) {
+    perror(stream);
+    return 2;
+  }
+  extract_t extract = { .out = out };
+  int c;
+  while (!extract.done && (c = getc(in)) != EOF) {
+    ExtractByte(&extract, c);
+  }
+  fclose(in);
+  return ExtractFinish(&extract, stream);
+}
+
+static volatile sig_atomic_t Interrupted;
+
+static void Interrupt(int sig)
+{
+  (void)sig;
+  Interrupted = 1;
+}
+
+static int Record(const char *tty, FILE *out)
+{
+  int fd = open(tty, O_RDWR | O_NOCTTY);
+  if (fd < 0) {
+    perror(tty);
+    return 2;
+  }
+  struct termios tio;
+  if (tcgetattr(fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 1;
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+  tcflush(fd, TCIFLUSH);
+
+  struct sigaction sa = { .sa_handler = Interrupt };
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  extract_t extract = { .out = out };
+  bool ending = false;
+  int idle = 0;
+  write(fd, "\020c", 2);
+  fprintf(stderr, "capturing, interrupt to stop\n");
+  while (!extract.done) {
+    if (Interrupted && !ending) {
+      write(fd, "\020e", 2);
+      ending = true;
+    }
+    uint8_t buf[256];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0 && errno != EINTR) {
+      perror(tty);
+      break;
+    }
+    for (ssize_t i = 0; i < n; i++) {
+      ExtractByte(&extract, buf[i]);
+    }
+    // Give up on the E reply after a second.
+    if (ending && n <= 0 && ++idle > 10) break;
+  }
+  close(fd);
+  return ExtractFinish(&extract, tty);
+}
+
+/*** Listing ***/
+
+static int Dump(const char *file)
+{
+  size_t count;
+  capture_frame_t *frames = CaptureFile_Read(file, &count);
+  if (frames == NULL) return 1;
+  uint64_t ticks = 0;
+  for (size_t i = 0; i < count; i++) {
+    const capture_frame_t *frame = &frames[i];
+    ticks += frame->ticks;
+    printf("%12.1f", (double)ticks / CAPTURE_TICKS_PER_USEC);
+    if (frame->kind & CAPTURE_FRAME_STROBE) {
+      printf(" strobe %02X", frame->charPins);
+    }
+    if (frame->kind & CAPTURE_FRAME_KEYS) {
+      printf(" keys %04X", frame->directKeys);
+    }
+    if (frame->kind & CAPTURE_FRAME_LOST) {
+      printf(" lost");
+    }
+    putchar('\n');
+  }
+  free(frames);
+  return 0;
+}
+
+static void Usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s -r tty file | -x stream file | -d file\n", prog);
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  int mode = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "rxd")) != -1) {
+    switch (opt) {
+    case 'r':
+    case 'x':
+    case 'd':
+      mode = opt;
+      break;
+    default:
+      Usage(argv[0]);
+    }
+  }
+  if (mode == 'd') {
+    if (optind + 1 != argc) Usage(argv[0]);
+    return Dump(argv[optind]);
+  }
+  if (mode == 0 || optind + 2 != argc) Usage(argv[0]);
+
+  FILE *out = fopen(argv[optind + 1], "wb");
+  if (out == NULL) {
+    perror(argv[optind + 1]);
+    return 2;
+  }
+  int status = (mode == 'r') ? Record(argv[optind], out) : ExtractStream(argv[optind], out);
+  if (fclose(out) != 0) {
+    perror(argv[optind + 1]);
+    return 2;
+  }
+  return status;
+}
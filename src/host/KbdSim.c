@@ -0,0 +1,523 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Script driver for the host simulation. Reads a keystroke script, schedules
+ *  it against HostSim.c, runs the firmware main loop until everything has been
+ *  delivered, and reports what the host received.
+ *
+ *  Script commands, one per line:
+ *
+ *    rate CPS        typing rate for type and storm (default 10)
+ *    type TEXT       strobe each character of TEXT (C escapes allowed)
+ *    strobe TEXT     likewise, but expecting nothing, as when capturing
+ *    storm COUNT     strobe COUNT printable characters
+ *    raw HEX         strobe a raw CHAR_PIN value, expecting nothing
+ *    bounce USEC     strobe the last character again USEC after it, expecting nothing
+ *    settle USEC HEX the next character's data lines read HEX until USEC after its strobe
+ *    down MSEC       the next character's key is held down, keeping its strobe
+ *                    on, for MSEC
+ *    direct HEX      set the direct keys that are down, key 1 in bit 0
+ *    replay FILE [N] play back the strobes and direct keys of a capture
+ *                    file from KbdCapture, N times as fast, expecting nothing
+ *    host TEXT       host sends TEXT on the OUT endpoint
+ *    dtr 0|1         host changes DTR
+ *    hold 0|1        host stops or starts reading the IN endpoint
+ *    flow 0|1        keyboard holds its strobes while ready / ack is off
+ *    expect TEXT     host should receive TEXT, whatever else it gets
+ *    count C MIN MAX host should receive the character C from MIN to MAX
+ *                    times in all (C escapes allowed)
+ *    print TEXT      printer on OUTPUT_PORT should get TEXT
+ *    printer USEC    time the printer takes over each character (default 100)
+ *    bells N MSEC    the bell should ring N times in all, each at least MSEC
+ *                    after the last started
+ *    wait MSEC       let time pass
+ *    channel N       the keyboard and port for the commands after, with
+ *                    KBD_CHANNELS (default 0)
+ *
+ *  With -o, everything the host receives is also written to a file, such as
+ *  for KbdCapture -x.
+ *
+ *  With -b, prints one line for make bench instead of the report: the
+ *  strobes and the characters dropped, the strobe queue high-water mark from
+ *  the reply to a DLE q in the script, busy cycles (see HostSim.h) per
+ *  strobe, and average and maximum latency in usec.
+ *
+ *  With -c, exits with status 1 if any expected character was dropped or,
+ *  with -L, arrived later than that many cycles after its strobe.
+ *
+ *  Characters are encoded onto the port according to the same
+ *  PARALLEL_KBD_OPTS that ParallelKeyboard.c was compiled with.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "CaptureFile.h"
+#include "HostSim.h"
+#include "KbdSettings.h"
+
+/*** Keyboard encoding, mirroring ParallelKeyboard.c ***/
+
+#ifndef CHAR_MASK
+#define CHAR_MASK 0x7F
+#endif
+
+#ifndef PARITY_CHECK
+#define PARITY_CHECK PARITY_NONE
+#endif
+#define PARITY_NONE -1
+#define PARITY_EVEN 0
+#define PARITY_ODD 1
+
+#ifndef DIRECT_KEYS
+#define DIRECT_KEYS 0
+#endif
+
+#ifndef DIRECT_INVERT_MASK
+#define DIRECT_INVERT_MASK 0
+#endif
+
+// The second keyboard's encoding with KBD_CHANNELS, as for ChannelDecodeChar.
+#ifndef CHAR_MASK_1
+#define CHAR_MASK_1 CHAR_MASK
+#endif
+
+#ifndef PARITY_CHECK_1
+#define PARITY_CHECK_1 PARITY_CHECK
+#endif
+
+#if defined(CHAR_INVERT_1)
+#define ENCODE_INVERT_1 (CHAR_INVERT_1)
+#elif defined(CHAR_INVERT)
+#define ENCODE_INVERT_1 1
+#else
+#define ENCODE_INVERT_1 0
+#endif
+
+static uint8_t EncodeCharWith(uint8_t code, uint8_t mask, bool invert, int8_t parity)
+{
+  uint8_t pins = code & mask;
+  if (invert) {
+    pins = ~pins;
+  }
+  if (parity != PARITY_NONE && __builtin_parity(pins) != parity) {
+    pins ^= 0x80;
+  }
+  return pins;
+}
+
+static uint8_t EncodeChar(uint8_t code)
+{
+#ifdef CHAR_INVERT
+  return EncodeCharWith(code, CHAR_MASK, true, PARITY_CHECK);
+#else
+  return EncodeCharWith(code, CHAR_MASK, false, PARITY_CHECK);
+#endif
+}
+
+static uint8_t EncodeChannelChar(uint8_t channel, uint8_t code)
+{
+  if (channel == 0) {
+    return EncodeChar(code);
+  }
+  return EncodeCharWith(code, CHAR_MASK_1, ENCODE_INVERT_1, PARITY_CHECK_1);
+}
+
+// PIND bits 1-7 in the low byte and PINF in the high byte for the
+// direct keys that are down, key 1 in bit 0.
+static uint16_t EncodeDirect(uint16_t keys)
+{
+  keys ^= DIRECT_INVERT_MASK;
+  return ((keys & 0x7F) << 1) | ((keys >> 7) << 8);
+}
+
+/*** Script ***/
+
+static uint8_t Channel;
+
+static int16_t ExpectChar(uint8_t code)
+{
+#ifdef DEBUG_ACTIONS
+  // Output is a hex dump, not the character.
+  return HOSTSIM_NO_EXPECT;
+#else
+  return code & (Channel == 0 ? CHAR_MASK : CHAR_MASK_1);
+#endif
+}
+
+static uint64_t ScriptTime;
+static uint32_t TypingRate = 10;
+static uint64_t LastStrobeTime;
+static uint8_t LastStrobePins;
+static uint32_t SettleUsec;
+static uint8_t SettlePins;
+static uint32_t DownMsec;
+
+static size_t Unescape(const char *in, uint8_t *out)
+{
+  size_t n = 0;
+  while (*in) {
+    char c = *in++;
+    if (c == '\\' && *in) {
+      c = *in++;
+      switch (c) {
+      case 'a': c = '\a'; break;
+      case 'b': c = '\b'; break;
+      case 'e': c = '\e'; break;
+      case 'n': c = '\n'; break;
+      case 'r': c = '\r'; break;
+      case 't': c = '\t'; break;
+      case 's': c = ' '; break;
+      case 'x':
+        {
+          // At most two digits, so that a letter can follow.
+          char hex[3] = { 0 };
+          strncpy(hex, in, 2);
+          char *end;
+          c = (char)strtoul(hex, &end, 16);
+          in += end - hex;
+        }
+        break;
+      }
+    }
+    out[n++] = c;
+  }
+  return n;
+}
+
+static void Strobe(uint8_t code, bool expect)
+{
+  uint8_t pins = EncodeChannelChar(Channel, code);
+  int16_t expected = expect ? ExpectChar(code) : HOSTSIM_NO_EXPECT;
+  if (DownMsec > 0) {
+    HostSim_ScheduleKeyDown(ScriptTime, true);
+    HostSim_ScheduleKeyDown(ScriptTime + (uint64_t)DownMsec * HOSTSIM_CYCLES_PER_MSEC, false);
+    DownMsec = 0;
+  }
+  if (SettleUsec > 0) {
+    HostSim_ScheduleStrobe(ScriptTime, SettlePins, expected);
+    HostSim_ScheduleCharPins(ScriptTime + (uint64_t)SettleUsec * HOSTSIM_CYCLES_PER_USEC, pins);
+    SettleUsec = 0;
+  } else {
+    HostSim_ScheduleStrobe(ScriptTime, pins, expected);
+  }
+  LastStrobeTime = ScriptTime;
+  LastStrobePins = pins;
+  ScriptTime += (uint64_t)F_CPU / TypingRate;
+}
+
+// Capture times are in Timer 1 ticks, at prescaler 8.
+static bool Replay(const char *file, uint32_t speed)
+{
+  size_t count;
+  capture_frame_t *frames = CaptureFile_Read(file, &count);
+  if (frames == NULL) return false;
+  uint64_t ticks = 0;
+  int32_t lastKeys = -1;
+  for (size_t i = 0; i < count; i++) {
+    const capture_frame_t *frame = &frames[i];
+    ticks += frame->ticks;
+    uint64_t at = ScriptTime + ticks * 8 / speed;
+    // Before the strobe that saw them.
+    if ((frame->kind & CAPTURE_FRAME_KEYS) && frame->directKeys != lastKeys) {
+      HostSim_ScheduleDirect(at, EncodeDirect(frame->directKeys));
+      lastKeys = frame->directKeys;
+    }
+    if (frame->kind & CAPTURE_FRAME_STROBE) {
+      HostSim_ScheduleStrobe(at, frame->charPins, HOSTSIM_NO_EXPECT);
+    }
+  }
+  ScriptTime += ticks * 8 / speed;
+  free(frames);
+  return true;
+}
+
+static bool ScriptLine(char *line, const char *file, int lineno)
+{
+  char *nl = strchr(line, '\n');
+  if (nl) *nl = '\0';
+  while (*line == ' ' || *line == '\t') line++;
+  if (*line == '\0' || *line == '#') return true;
+
+  char *arg = line + strcspn(line, " \t");
+  if (*arg) {
+    *arg++ = '\0';
+    while (*arg == ' ' || *arg == '\t') arg++;
+  }
+
+  uint8_t text[256];
+  size_t len;
+  if (!strcmp(line, "rate")) {
+    TypingRate = strtoul(arg, NULL, 0);
+    if (TypingRate == 0) TypingRate = 1;
+  } else if (!strcmp(line, "type")) {
+    len = Unescape(arg, text);
+    for (size_t i = 0; i < len; i++) {
+      Strobe(text[i], true);
+    }
+  } else if (!strcmp(line, "strobe")) {
+    len = Unescape(arg, text);
+    for (size_t i = 0; i < len; i++) {
+      Strobe(text[i], false);
+    }
+  } else if (!strcmp(line, "storm")) {
+    unsigned long count = strtoul(arg, NULL, 0);
+    for (unsigned long i = 0; i < count; i++) {
+      Strobe('!' + (i % ('~' - '!' + 1)), true);
+    }
+  } else if (!strcmp(line, "raw")) {
+    HostSim_ScheduleStrobe(ScriptTime, strtoul(arg, NULL, 16), HOSTSIM_NO_EXPECT);
+    ScriptTime += (uint64_t)F_CPU / TypingRate;
+  } else if (!strcmp(line, "bounce")) {
+    HostSim_ScheduleStrobe(LastStrobeTime + strtoul(arg, NULL, 0) * HOSTSIM_CYCLES_PER_USEC,
+                           LastStrobePins, HOSTSIM_NO_EXPECT);
+  } else if (!strcmp(line, "settle")) {
+    char *end;
+    SettleUsec = strtoul(arg, &end, 0);
+    SettlePins = strtoul(end, NULL, 16);
+  } else if (!strcmp(line, "down")) {
+    DownMsec = strtoul(arg, NULL, 0);
+  } else if (!strcmp(line, "direct")) {
+    HostSim_ScheduleDirect(ScriptTime, EncodeDirect(strtoul(arg, NULL, 16)));
+  } else if (!strcmp(line, "replay")) {
+    char *speed = arg + strcspn(arg, " \t");
+    if (*speed) *speed++ = '\0';
+    uint32_t n = strtoul(speed, NULL, 0);
+    if (!Replay(arg, n ? n : 1)) return false;
+  } else if (!strcmp(line, "host")) {
+    len = Unescape(arg, text);
+    for (size_t i = 0; i < len; i++) {
+      HostSim_ScheduleHostByte(ScriptTime, text[i]);
+    }
+  } else if (!strcmp(line, "dtr")) {
+    HostSim_ScheduleDTR(ScriptTime, strtoul(arg, NULL, 0) != 0);
+  } else if (!strcmp(line, "hold")) {
+    HostSim_ScheduleHold(ScriptTime, strtoul(arg, NULL, 0) != 0);
+  } else if (!strcmp(line, "flow")) {
+    HostSim_ScheduleFlow(ScriptTime, strtoul(arg, NULL, 0) != 0);
+  } else if (!strcmp(line, "expect")) {
+    len = Unescape(arg, text);
+    for (size_t i = 0; i < len; i++) {
+      HostSim_ScheduleExpect(ScriptTime, text[i]);
+    }
+  } else if (!strcmp(line, "count")) {
+    char *end = arg + strcspn(arg, " \t");
+    if (*end) *end++ = '\0';
+    if (Unescape(arg, text) != 1) {
+      fprintf(stderr, "%s:%d: count takes one character\n", file, lineno);
+      return false;
+    }
+    uint32_t min = strtoul(end, &end, 0);
+    HostSim_ExpectCount(text[0], min, strtoul(end, NULL, 0));
+  } else if (!strcmp(line, "print")) {
+    len = Unescape(arg, text);
+    for (size_t i = 0; i < len; i++) {
+      HostSim_ExpectPrint(text[i]);
+    }
+  } else if (!strcmp(line, "bells")) {
+    char *end;
+    uint32_t count = strtoul(arg, &end, 0);
+    HostSim_ExpectBells(count, strtoul(end, NULL, 0));
+  } else if (!strcmp(line, "printer")) {
+    HostSim_Costs.PrintCycles = strtoul(arg, NULL, 0) * HOSTSIM_CYCLES_PER_USEC;
+  } else if (!strcmp(line, "channel")) {
+    Channel = strtoul(arg, NULL, 0);
+    HostSim_SelectChannel(Channel);
+  } else if (!strcmp(line, "wait")) {
+    ScriptTime += (uint64_t)(strtod(arg, NULL) * HOSTSIM_CYCLES_PER_MSEC);
+  } else {
+    fprintf(stderr, "%s:%d: unknown command %s\n", file, lineno, line);
+    return false;
+  }
+  return true;
+}
+
+static bool ReadScript(FILE *in, const char *file)
+{
+  char line[512];
+  int lineno = 0;
+  while (fgets(line, sizeof(line), in)) {
+    if (!ScriptLine(line, file, ++lineno)) return false;
+  }
+  return true;
+}
+
+/*** Report ***/
+
+// The high-water mark from the last Q reply the host received, or -1.
+static int QueueHighWater(FILE *received)
+{
+  int highWater = -1;
+  rewind(received);
+  int c;
+  while ((c = getc(received)) != EOF) {
+    unsigned size, mark, lost;
+    if (c == 'Q' && fscanf(received, " %2x %2x %4x", &size, &mark, &lost) == 3) {
+      highWater = mark;
+    }
+  }
+  return highWater;
+}
+
+static void BenchReport(const char *label, FILE *received)
+{
+  const HostSim_Stats_t *stats = &HostSim_Stats;
+  char highWater[12] = "-";
+  int mark = QueueHighWater(received);
+  if (mark >= 0) snprintf(highWater, sizeof(highWater), "%d", mark);
+  printf("%-28s %7u %7u %5s %9.0f", label, stats->Strobes, stats->Dropped, highWater,
+         stats->Strobes ? (double)stats->BusyCycles / stats->Strobes : 0.0);
+  if (stats->Delivered > 0) {
+    // Nothing is expected from DEBUG_ACTIONS.
+    printf(" %9.1f %9.1f\n", (double)stats->LatencyTotal / stats->Delivered / HOSTSIM_CYCLES_PER_USEC,
+           (double)stats->LatencyMax / HOSTSIM_CYCLES_PER_USEC);
+  } else {
+    printf(" %9s %9s\n", "-", "-");
+  }
+}
+
+static void Report(void)
+{
+  const HostSim_Stats_t *stats = &HostSim_Stats;
+  printf("strobes     %u\n", stats->Strobes);
+  if (stats->StrobesHeld > 0) {
+    printf("held        %u\n", stats->StrobesHeld);
+  }
+  printf("expected    %u\n", stats->Expected);
+  printf("delivered   %u\n", stats->Delivered);
+  printf("dropped     %u\n", stats->Dropped);
+  if (stats->Delivered > 0) {
+    printf("latency     min %llu avg %llu max %llu cycles\n",
+           (unsigned long long)stats->LatencyMin,
+           (unsigned long long)(stats->LatencyTotal / stats->Delivered),
+           (unsigned long long)stats->LatencyMax);
+  }
+  printf("in          %u packets %u bytes\n", stats->InPackets, stats->InBytes);
+  if (stats->InLast > stats->InFirst) {
+    printf("throughput  %.0f bytes/s\n",
+           (double)stats->InBytes * F_CPU / (stats->InLast - stats->InFirst));
+  }
+  if (stats->HidReports > 0) {
+    printf("hid         %u reports %u keys\n", stats->HidReports, stats->HidKeys);
+  }
+  printf("out         %u bytes\n", stats->OutBytes);
+  if (stats->Printed > 0) {
+    printf("printed     %u\n", stats->Printed);
+  }
+  if (stats->Bells > 0) {
+    printf("bells       %u\n", stats->Bells);
+  }
+  printf("main loops  %u\n", stats->MainLoops);
+  printf("interrupts  %u\n", stats->Interrupts);
+  if (stats->Sleeps > 0) {
+    printf("sleep       %u times %.1f%% of the time\n", stats->Sleeps,
+           100.0 * stats->SleepCycles / HostSim_Now);
+  }
+  printf("elapsed     %.3f ms\n", (double)HostSim_Now / HOSTSIM_CYCLES_PER_MSEC);
+}
+
+#ifdef RUNTIME_SETTINGS
+extern const kbd_settings_t DefaultSettings;
+
+// The built-in default, as DLE r would send it.
+static void PrintSettings(void)
+{
+  const uint8_t *bytes = (const uint8_t *)&DefaultSettings;
+  for (size_t i = 0; i < sizeof(kbd_settings_t); i++) {
+    printf("%02X", bytes[i]);
+  }
+  putchar('\n');
+}
+#endif
+
+static void Usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-v] [-c] [-s] [-b label] [-o received-file] [-L max-latency-cycles] [-l loop-cycles] [-p host-poll-cycles] [script]\n", prog);
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  bool check = false;
+  const char *bench = NULL;
+  uint64_t maxLatency = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "vcsb:o:L:l:p:")) != -1) {
+    switch (opt) {
+#ifdef RUNTIME_SETTINGS
+    case 's':
+      PrintSettings();
+      return 0;
+#endif
+    case 'v':
+      HostSim_Verbose = true;
+      break;
+    case 'c':
+      check = true;
+      break;
+    case 'b':
+      bench = optarg;
+      if (HostSim_Record == NULL) HostSim_Record = tmpfile();
+      break;
+    case 'o':
+      HostSim_Record = fopen(optarg, "w+b");
+      if (HostSim_Record == NULL) {
+        perror(optarg);
+        return 2;
+      }
+      break;
+    case 'L':
+      maxLatency = strtoull(optarg, NULL, 0);
+      break;
+    case 'l':
+      HostSim_Costs.LoopCycles = strtoul(optarg, NULL, 0);
+      break;
+    case 'p':
+      HostSim_Costs.HostPollCycles = strtoul(optarg, NULL, 0);
+      if (HostSim_Costs.HostPollCycles == 0) Usage(argv[0]);
+      break;
+    default:
+      Usage(argv[0]);
+    }
+  }
+
+  bool ok;
+  if (optind < argc) {
+    FILE *in = fopen(argv[optind], "r");
+    if (in == NULL) {
+      perror(argv[optind]);
+      return 2;
+    }
+    ok = ReadScript(in, argv[optind]);
+    fclose(in);
+  } else {
+    ok = ReadScript(stdin, "<stdin>");
+  }
+  if (!ok) return 2;
+
+  HostSim_Init();
+  // Leave time for the last of the output to drain.
+  uint64_t end = ScriptTime + 20 * HOSTSIM_CYCLES_PER_MSEC;
+  while (HostSim_EventsPending() || HostSim_Now < end) {
+    HostSim_MainLoop();
+  }
+  HostSim_Finish();
+
+  if (bench != NULL) {
+    BenchReport(bench, HostSim_Record);
+  } else {
+    Report();
+  }
+  if (HostSim_Record != NULL) fclose(HostSim_Record);
+
+  if (check && maxLatency > 0 && HostSim_Stats.LatencyMax > maxLatency) {
+    fprintf(stderr, "latency over %llu cycles\n", (unsigned long long)maxLatency);
+    return 1;
+  }
+  return (check && HostSim_Stats.Dropped > 0) ? 1 : 0;
+}
@@ -0,0 +1,33 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Host stand-in for the LUFA board LED driver.
+ */
+
+#ifndef _HOST_LUFA_LEDS_H_
+#define _HOST_LUFA_LEDS_H_
+
+#include <stdint.h>
+
+#define BOARD_NONE 0
+#define BOARD_TEENSY 1
+#define BOARD_TEENSY2 2
+#define BOARD_LEONARDO 3
+#define BOARD_MICRO 4
+#define BOARD_ADAFRUITU4 5
+
+#define LEDS_LED1 (1 << 6)
+#define LEDS_LED2 0
+#define LEDS_LED3 0
+#define LEDS_ALL_LEDS LEDS_LED1
+#define LEDS_NO_LEDS 0
+
+extern uint8_t HostSim_LEDs;
+
+static inline void LEDs_Init(void) { HostSim_LEDs = 0; }
+static inline void LEDs_SetAllLEDs(uint8_t mask) { HostSim_LEDs = mask; }
+
+#endif
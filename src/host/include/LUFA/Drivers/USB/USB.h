@@ -0,0 +1,159 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Host stand-in for the LUFA USB stack: the CDC and HID device class driver
+ *  APIs that ParallelKeyboard.c calls, implemented by the fake endpoints in
+ *  HostSim.c, and enough descriptor types for Descriptors.h to compile.
+ */
+
+#ifndef _HOST_LUFA_USB_H_
+#define _HOST_LUFA_USB_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <LUFA/Platform/Platform.h>
+
+#define ENDPOINT_DIR_IN 0x80
+#define ENDPOINT_DIR_OUT 0x00
+
+#define ENDPOINT_RWSTREAM_NoError 0
+#define ENDPOINT_RWSTREAM_Timeout 3
+#define ENDPOINT_RWSTREAM_DeviceDisconnected 2
+#define ENDPOINT_READYWAIT_NoError 0
+#define ENDPOINT_READYWAIT_Timeout 3
+
+#define CDC_CONTROL_LINE_OUT_DTR (1 << 0)
+#define CDC_CONTROL_LINE_OUT_RTS (1 << 1)
+#define CDC_CONTROL_LINE_IN_DCD (1 << 0)
+#define CDC_CONTROL_LINE_IN_DSR (1 << 1)
+#define CDC_CONTROL_LINE_IN_BREAK (1 << 2)
+
+enum USB_Device_States_t {
+  DEVICE_STATE_Unattached = 0,
+  DEVICE_STATE_Powered = 1,
+  DEVICE_STATE_Default = 2,
+  DEVICE_STATE_Addressed = 3,
+  DEVICE_STATE_Configured = 4,
+  DEVICE_STATE_Suspended = 5,
+};
+
+extern volatile uint8_t USB_DeviceState;
+
+/* Descriptor types, opaque here. */
+typedef struct { uint8_t Size, Type; } USB_Descriptor_Header_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_Descriptor_Configuration_Header_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_Descriptor_Interface_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_Descriptor_Endpoint_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_CDC_Descriptor_FunctionalHeader_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_CDC_Descriptor_FunctionalACM_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_CDC_Descriptor_FunctionalUnion_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_Descriptor_Interface_Association_t;
+typedef struct { USB_Descriptor_Header_t Header; } USB_HID_Descriptor_HID_t;
+
+typedef struct {
+  uint8_t Address;
+  uint16_t Size;
+  uint8_t Type;
+  uint8_t Banks;
+} USB_Endpoint_Table_t;
+
+typedef struct {
+  uint32_t BaudRateBPS;
+  uint8_t CharFormat;
+  uint8_t ParityType;
+  uint8_t DataBits;
+} CDC_LineEncoding_t;
+
+typedef struct {
+  struct {
+    uint8_t ControlInterfaceNumber;
+    USB_Endpoint_Table_t DataINEndpoint;
+    USB_Endpoint_Table_t DataOUTEndpoint;
+    USB_Endpoint_Table_t NotificationEndpoint;
+  } Config;
+  struct {
+    struct {
+      uint16_t HostToDevice;
+      uint16_t DeviceToHost;
+    } ControlLineStates;
+    CDC_LineEncoding_t LineEncoding;
+  } State;
+} USB_ClassInfo_CDC_Device_t;
+
+uint8_t CDC_Device_SendByte(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo, const uint8_t Data);
+uint8_t CDC_Device_SendData(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo, const void* const Buffer, const uint16_t Length);
+uint8_t CDC_Device_SendString(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo, const char* const String);
+uint8_t CDC_Device_SendString_P(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo, const char* const String);
+uint8_t CDC_Device_Flush(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo);
+uint16_t CDC_Device_BytesReceived(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo);
+int16_t CDC_Device_ReceiveByte(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo);
+void CDC_Device_SendControlLineStateChange(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo);
+void CDC_Device_USBTask(USB_ClassInfo_CDC_Device_t* const CDCInterfaceInfo);
+
+/* Direct access to the CDC data endpoints, the only ones selected. */
+void Endpoint_SelectEndpoint(const uint8_t Address);
+bool Endpoint_IsINReady(void);
+uint8_t Endpoint_WaitUntilReady(void);
+void Endpoint_Write_8(const uint8_t Data);
+void Endpoint_ClearIN(void);
+bool Endpoint_IsOUTReceived(void);
+uint16_t Endpoint_BytesInEndpoint(void);
+uint8_t Endpoint_Read_8(void);
+void Endpoint_ClearOUT(void);
+
+#define HID_REPORT_ITEM_In 0
+#define HID_REPORT_ITEM_Out 1
+
+#define HID_KEYBOARD_MODIFIER_LEFTCTRL (1 << 0)
+#define HID_KEYBOARD_MODIFIER_LEFTSHIFT (1 << 1)
+#define HID_KEYBOARD_MODIFIER_LEFTALT (1 << 2)
+
+#define HID_KEYBOARD_SC_PAUSE 0x48
+
+typedef struct {
+  uint8_t Modifier;
+  uint8_t Reserved;
+  uint8_t KeyCode[6];
+} USB_KeyboardReport_Data_t;
+
+typedef struct {
+  struct {
+    uint8_t InterfaceNumber;
+    USB_Endpoint_Table_t ReportINEndpoint;
+    void* PrevReportINBuffer;
+    uint8_t PrevReportINBufferSize;
+  } Config;
+  struct {
+    bool UsingReportProtocol;
+    uint16_t PrevFrameNum;
+    uint16_t IdleCount;
+    uint16_t IdleMSRemaining;
+  } State;
+} USB_ClassInfo_HID_Device_t;
+
+void HID_Device_USBTask(USB_ClassInfo_HID_Device_t* const HIDInterfaceInfo);
+
+static inline void HID_Device_MillisecondElapsed(USB_ClassInfo_HID_Device_t* const HIDInterfaceInfo)
+{
+  if (HIDInterfaceInfo->State.IdleMSRemaining)
+    HIDInterfaceInfo->State.IdleMSRemaining--;
+}
+
+bool CALLBACK_HID_Device_CreateHIDReport(USB_ClassInfo_HID_Device_t* const HIDInterfaceInfo,
+                                         uint8_t* const ReportID,
+                                         const uint8_t ReportType,
+                                         void* ReportData,
+                                         uint16_t* const ReportSize);
+void CALLBACK_HID_Device_ProcessHIDReport(USB_ClassInfo_HID_Device_t* const HIDInterfaceInfo,
+                                          const uint8_t ReportID,
+                                          const uint8_t ReportType,
+                                          const void* ReportData,
+                                          const uint16_t ReportSize);
+
+void USB_USBTask(void);
+
+#endif
@@ -0,0 +1,36 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Host stand-in for the LUFA platform header.
+ */
+
+#ifndef _HOST_LUFA_PLATFORM_H_
+#define _HOST_LUFA_PLATFORM_H_
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#define ARCH_AVR8 0
+#define ARCH_XMEGA 1
+#ifndef ARCH
+#define ARCH ARCH_AVR8
+#endif
+
+#ifdef USE_LUFA_CONFIG_HEADER
+#include "LUFAConfig.h"
+#endif
+
+#define ATTR_WARN_UNUSED_RESULT __attribute__((warn_unused_result))
+#define ATTR_NON_NULL_PTR_ARG(...) __attribute__((nonnull(__VA_ARGS__)))
+#define ATTR_ALWAYS_INLINE __attribute__((always_inline))
+
+#define GCC_MEMORY_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+static inline void GlobalInterruptEnable(void) { sei(); }
+static inline void GlobalInterruptDisable(void) { cli(); }
+
+#endif
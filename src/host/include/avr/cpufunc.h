@@ -0,0 +1,18 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Host stand-in for <avr/cpufunc.h>: a no-op takes a cycle, long enough
+ *  for an output to reach whatever it drives.
+ */
+
+#ifndef _HOST_AVR_CPUFUNC_H_
+#define _HOST_AVR_CPUFUNC_H_
+
+extern void HostSim_Nop(void);
+
+#define _NOP() HostSim_Nop()
+
+#endif
@@ -0,0 +1,23 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Host stand-in for <avr/interrupt.h>. An ISR is an ordinary function that
+ *  HostSim.c calls when the simulated event fires.
+ */
+
+#ifndef _HOST_AVR_INTERRUPT_H_
+#define _HOST_AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+
+#define ISR(vector, ...) void vector(void); void vector(void)
+
+extern void HostSim_InterruptsEnable(bool enable);
+
+#define sei() HostSim_InterruptsEnable(true)
+#define cli() HostSim_InterruptsEnable(false)
+
+#endif
@@ -0,0 +1,84 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Host stand-in for <avr/io.h>: just the ATmega32U4 registers and bit
+ *  numbers that the keyboard code touches, backed by variables in HostSim.c.
+ */
+
+#ifndef _HOST_AVR_IO_H_
+#define _HOST_AVR_IO_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Ports. */
+extern volatile uint8_t PINB, PORTB, DDRB;
+extern volatile uint8_t PINC, PORTC, DDRC;
+extern volatile uint8_t PIND, PORTD, DDRD;
+extern volatile uint8_t PINE, PORTE, DDRE;
+extern volatile uint8_t PINF, PORTF, DDRF;
+
+/* External interrupts. */
+extern volatile uint8_t EIMSK, EICRA, EICRB, EIFR;
+
+#define INT0 0
+#define INT1 1
+#define INT2 2
+#define INT3 3
+#define INT6 6
+
+#define ISC00 0
+#define ISC01 1
+#define ISC10 2
+#define ISC11 3
+#define ISC20 4
+#define ISC21 5
+#define ISC30 6
+#define ISC31 7
+#define ISC60 4
+#define ISC61 5
+
+/* Timer 0. The counter is derived from the simulated clock, so it is read-only. */
+extern volatile uint8_t TCCR0A, TCCR0B, TIFR0, TIMSK0;
+extern volatile uint8_t OCR0A;
+extern uint8_t HostSim_TCNT0(void);
+#define TCNT0 HostSim_TCNT0()
+
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define OCF0A 1
+#define OCIE0A 1
+
+/* Timer 1. The counter is derived from the simulated clock, so it is read-only. */
+extern volatile uint8_t TCCR1A, TCCR1B, TIFR1, TIMSK1;
+extern volatile uint16_t OCR1B;
+extern uint16_t HostSim_TCNT1(void);
+#define TCNT1 HostSim_TCNT1()
+
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define TOV1 0
+#define TOIE1 0
+#define OCF1B 2
+#define OCIE1B 2
+
+/* Timer 3, likewise. */
+extern volatile uint8_t TCCR3A, TCCR3B, TIFR3, TIMSK3;
+extern volatile uint16_t OCR3A;
+extern uint16_t HostSim_TCNT3(void);
+#define TCNT3 HostSim_TCNT3()
+
+#define CS30 0
+#define CS31 1
+#define CS32 2
+#define WGM32 3
+#define OCF3A 1
+#define OCIE3A 1
+
+#endif
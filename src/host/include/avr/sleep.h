@@ -0,0 +1,23 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Host stand-in for <avr/sleep.h>: sleeping lets the simulated clock run
+ *  until an interrupt handler has.
+ */
+
+#ifndef _HOST_AVR_SLEEP_H_
+#define _HOST_AVR_SLEEP_H_
+
+#define SLEEP_MODE_IDLE 0
+
+extern void HostSim_Sleep(void);
+
+#define set_sleep_mode(mode)
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu() HostSim_Sleep()
+
+#endif
@@ -0,0 +1,21 @@
+/*
+  Copyright 2015 Mike McMahon
+*/
+
+/** \file
+ *
+ *  Host stand-in for <util/delay.h>. A busy wait just advances the simulated
+ *  clock, servicing any interrupts that come due meanwhile.
+ */
+
+#ifndef _HOST_UTIL_DELAY_H_
+#define _HOST_UTIL_DELAY_H_
+
+#include <stdint.h>
+
+extern void HostSim_Advance(uint32_t cycles);
+
+#define _delay_us(us) HostSim_Advance((uint32_t)((us) * (F_CPU / 1000000.0)))
+#define _delay_ms(ms) HostSim_Advance((uint32_t)((ms) * (F_CPU / 1000.0)))
+
+#endif
@@ -0,0 +1,209 @@
+# PARALLEL_KBD_OPTS for each keyboard in README.md, and a few other
+# configurations, for building the host simulation once per profile.
+# Keep in sync with README.md.
+
+PROFILES += SW-11234
+SW-11234_OPTS = -DDIRECT_KEYS=3 -DDIRECT_PORT_UNUSED=4 -DDIRECT_INVERT_MASK=5
+
+PROFILES += SW-11769
+SW-11769_OPTS = -DCONTROL_STROBE_TRIGGER=TRIGGER_RISING -DDIRECT_KEYS=2
+
+PROFILES += SD-16234
+SD-16234_OPTS = -DCHAR_MASK=0xFF
+
+PROFILES += SD-16534
+SD-16534_OPTS = -DCONTROL_STROBE_TRIGGER=TRIGGER_RISING -DCHAR_MASK=0xFF \
+  -DREADY_ACK_MODE=READY_ACK_MODE_DTR -DREADY_ACK_ON_STATE=READY_ACK_ON_LOW
+
+PROFILES += SD-16604
+SD-16604_OPTS = -DCONTROL_STROBE_TRIGGER=TRIGGER_RISING -DBELL_MODE=BELL_MODE_TONE \
+  -DDIRECT_KEYS=5 -DDIRECT_INVERT_MASK=0x1F \
+  -DREADY_ACK_MODE=READY_ACK_MODE_DTR -DREADY_ACK_ON_STATE=READY_ACK_ON_LOW \
+  -DDEBUG_ACTIONS
+
+PROFILES += SC-15142
+SC-15142_OPTS = -DCONTROL_STROBE_TRIGGER=TRIGGER_RISING -DPARITY_CHECK=PARITY_ODD \
+  -DDIRECT_KEYS=3 -DDIRECT_INVERT_MASK=7 -DDIRECT_DEBOUNCE=5 \
+  -DDIRECT_KEY_1=DIRECT_HERE_IS -DDIRECT_KEY_2=DIRECT_BREAK
+
+PROFILES += SD-16192
+SD-16192_OPTS = -DCHAR_MASK=0xFF \
+  -DDIRECT_KEYS=4 -DDIRECT_INVERT_MASK=0xF -DDIRECT_KEY_1=DIRECT_BREAK
+
+PROFILES += LK01
+LK01_OPTS = -DCONTROL_STROBE_TRIGGER=TRIGGER_RISING
+
+PROFILES += Consul-262.3
+Consul-262.3_OPTS = -DCHAR_MASK=0xFF -DCHAR_INVERT
+
+PROFILES += Beehive-B100
+Beehive-B100_OPTS = -DDIRECT_KEYS=7 -DDIRECT_INVERT_MASK=0x5F \
+  -DDIRECT_ESC_PREFIX_MASK=1 -DDIRECT_ESC_PREFIX_VT100 \
+  -DDIRECT_KEY_2=DIRECT_BREAK
+
+PROFILES += SNK-58
+SNK-58_OPTS = -DCHAR_MASK=0xFF
+
+PROFILES += Apple-II
+Apple-II_OPTS = -DCONTROL_STROBE_TRIGGER=TRIGGER_RISING \
+  -DDIRECT_KEYS=1 -DDIRECT_INVERT_MASK=1 -DDIRECT_DEBOUNCE=5 \
+  -DDIRECT_KEY_1=DIRECT_BREAK
+
+PROFILES += Apple-1
+Apple-1_OPTS = -DCONTROL_STROBE_TRIGGER=TRIGGER_RISING \
+  -DDIRECT_KEYS=2 -DDIRECT_INVERT_MASK=1 -DDIRECT_DEBOUNCE=5 \
+  -DDIRECT_KEY_1=DIRECT_BREAK -DDIRECT_KEY_2=DIRECT_HERE_IS
+
+PROFILES += Maxi-Switch-216004
+Maxi-Switch-216004_OPTS = -DCONTROL_STROBE_TRIGGER=TRIGGER_RISING \
+  -DDIRECT_KEYS=2 -DDIRECT_INVERT_MASK=3 -DDIRECT_DEBOUNCE=5 \
+  -DDIRECT_KEY_1=DIRECT_BREAK -DDIRECT_KEY_2=DIRECT_HERE_IS
+
+PROFILES += JE610
+JE610_OPTS = -DDIRECT_KEYS=2 -DDIRECT_DEBOUNCE=5 \
+  -DDIRECT_KEY_1=DIRECT_ANSWERBACK_2 -DANSWERBACK_2="\"UD1\\r\\n\"" \
+  -DDIRECT_KEY_2=DIRECT_ANSWERBACK_3 -DANSWERBACK_3="\"UD2\\r\\n\""
+
+PROFILES += EKA-9100
+EKA-9100_OPTS = -DBELL_MODE=BELL_MODE_LOW \
+  -DREADY_ACK_MODE=READY_ACK_MODE_KEY_ACK -DREADY_ACK_ON_STATE=READY_ACK_ON_LOW -DREADY_ACK_DELAY_MSEC=250 \
+  -DDIRECT_KEYS=2 -DDIRECT_INVERT_MASK=3 -DDIRECT_DEBOUNCE=5 \
+  -DDIRECT_KEY_1=DIRECT_HERE_IS -DDIRECT_KEY_2=DIRECT_BREAK
+
+PROFILES += Scientific-Devices
+Scientific-Devices_OPTS = -DDIRECT_KEYS=15 -DDIRECT_INVERT_MASK=0x7FFF -DDIRECT_DEBOUNCE=5 \
+  -DDIRECT_KEY_12=DIRECT_HERE_IS -DDIRECT_KEY_15=DIRECT_BREAK \
+  -DDIRECT_KEY_1=DIRECT_ANSWERBACK_2 -DANSWERBACK_2="\"Goodbye\\r\\n\""
+
+PROFILES += Maxi-Switch-2160094
+Maxi-Switch-2160094_OPTS = -DCHAR_INVERT
+
+PROFILES += Xerox-820
+Xerox-820_OPTS =
+
+PROFILES += Datamedia-1520
+Datamedia-1520_OPTS = -DCHAR_INVERT \
+  -DDIRECT_KEYS=3 -DDIRECT_INVERT_MASK=7 -DDIRECT_DEBOUNCE=5 \
+  -DDIRECT_KEY_3=DIRECT_BREAK
+
+PROFILES += Dasher-D2
+Dasher-D2_OPTS = -DCHAR_MASK=0xFF \
+  -DDIRECT_KEYS=1 -DDIRECT_INVERT_MASK=1 -DDIRECT_KEY_1=DIRECT_BREAK
+
+PROFILES += K100
+K100_OPTS = -DCONTROL_STROBE_TRIGGER=TRIGGER_RISING \
+  -DDIRECT_KEYS=3 -DDIRECT_INVERT_MASK=7 -DDIRECT_DEBOUNCE=5 \
+  -DDIRECT_KEY_1=DIRECT_BREAK
+
+PROFILES += SD-16046
+SD-16046_OPTS = -DCHAR_MASK=0xFF \
+  -DDIRECT_KEYS=3 -DDIRECT_INVERT_MASK=7 -DDIRECT_KEY_3=DIRECT_BREAK \
+  -DDEBUG_ACTIONS
+
+PROFILES += SD-16614
+SD-16614_OPTS = -DCONTROL_STROBE_TRIGGER=TRIGGER_RISING -DPARITY_CHECK=PARITY_ODD \
+  -DDIRECT_KEYS=3
+
+PROFILES += SW-11373
+SW-11373_OPTS = -DCHAR_INVERT
+
+PROFILES += SW-10034
+SW-10034_OPTS = -DCHAR_INVERT -DPARITY_CHECK=PARITY_ODD \
+  -DDIRECT_KEYS=3
+
+PROFILES += Licon-80-551077
+Licon-80-551077_OPTS = -DDIRECT_KEYS=4 -DDIRECT_INVERT_MASK=0xD -DDIRECT_KEY_3=DIRECT_BREAK -DDIRECT_KEY_4=DIRECT_HERE_IS
+
+PROFILES += KTC-65-0627
+KTC-65-0627_OPTS = -DDIRECT_KEYS=5 -DDIRECT_INVERT_MASK=0x1F -DDIRECT_KEY_1=DIRECT_HERE_IS -DDIRECT_KEY_2=DIRECT_BREAK
+
+PROFILES += Incoterm-K2x
+Incoterm-K2x_OPTS = -DDIRECT_KEYS=1
+
+PROFILES += TKC-Numpad
+TKC-Numpad_OPTS = -DCONTROL_STROBE_TRIGGER=TRIGGER_RISING -DCHAR_MASK=0x3F
+
+PROFILES += Writehander
+Writehander_OPTS =
+
+PROFILES += Controls-Research
+Controls-Research_OPTS = -DDIRECT_KEYS=12 -DDIRECT_INVERT_MASK=0x0FFF
+
+# The keyboards above, for make bench.
+KEYBOARDS := $(PROFILES)
+
+# USB modes other than the CDC serial port, on a keyboard with HERE IS and BREAK keys.
+
+PROFILES += HID
+HID_OPTS = -DUSB_MODE=USB_MODE_HID -DENABLE_SOF_EVENTS \
+  -DDIRECT_KEYS=2 -DDIRECT_KEY_1=DIRECT_HERE_IS -DDIRECT_KEY_2=DIRECT_BREAK
+
+PROFILES += CDC-HID
+CDC-HID_OPTS = -DUSB_MODE=USB_MODE_CDC_HID -DENABLE_SOF_EVENTS -DBELL_MODE=BELL_MODE_TONE \
+  -DDIRECT_KEYS=2 -DDIRECT_KEY_1=DIRECT_HERE_IS -DDIRECT_KEY_2=DIRECT_BREAK
+
+# Strobe filtering, checked further by scripts/glitch.txt.
+
+PROFILES += Filter
+Filter_OPTS = -DSTROBE_FILTER -DSTROBE_SETTLE_USEC=20
+
+# Idle sleep between interrupts, checked to stay within a frame of latency.
+
+PROFILES += Sleep
+Sleep_OPTS = -DSLEEP_IDLE -DBELL_MODE=BELL_MODE_TONE \
+  -DDIRECT_KEYS=2 -DDIRECT_DEBOUNCE=5 -DDIRECT_KEY_1=DIRECT_HERE_IS -DDIRECT_KEY_2=DIRECT_BREAK
+
+# Direct keys on edge interrupts, checked for ordering by scripts/direct.txt.
+
+PROFILES += DirectInt
+DirectInt_OPTS = -DDIRECT_KEYS_INTERRUPT -DSLEEP_IDLE \
+  -DDIRECT_KEYS=3 -DDEBUG_ACTIONS
+
+# Per key debounce on the millisecond tick, checked by scripts/debounce.txt.
+
+PROFILES += Debounce
+Debounce_OPTS = -DDIRECT_DEBOUNCE_PER_KEY -DDIRECT_DEBOUNCE=5 -DDIRECT_DEBOUNCE_PRESS_2=1 \
+  -DDIRECT_KEYS=3 -DDEBUG_ACTIONS
+
+# Macros on direct keys and a character code, checked by scripts/macro.txt.
+
+PROFILES += Macro
+Macro_OPTS = -DCHAR_MASK=0xFF -DDIRECT_KEYS=2 \
+  -DDIRECT_KEY_1=DIRECT_MACRO_1 -DMACRO_1="\"The quick brown fox jumps over the lazy dog.\\r\\n\"" \
+  -DMACRO_2="\"<F1>\"" -DMACRO_CHAR_2=0x80 -DDIRECT_KEY_2=DIRECT_HERE_IS
+
+# Host flow control on ready / ack, checked by scripts/flow.txt.
+
+PROFILES += Flow
+Flow_OPTS = -DREADY_ACK_MODE=READY_ACK_MODE_FLOW
+
+# SC-15142 streaming what it sees, captured by scripts/capture.txt for
+# scripts/replay.txt.
+
+PROFILES += Capture
+Capture_OPTS = $(SC-15142_OPTS) -DCAPTURE
+
+# Two keyboards on one device, the second with its data lines inverted,
+# checked by scripts/channels.txt.
+
+PROFILES += Concentrator
+Concentrator_OPTS = -DKBD_CHANNELS=2 -DCHAR_INVERT_1 -DBELL_MODE=BELL_MODE_TONE
+
+# Host output to a printer on the output port, paced by its ack and by
+# its busy line, checked by scripts/printer.txt.
+
+PROFILES += Printer
+Printer_OPTS = -DOUTPUT_PORT -DOUTPUT_HANDSHAKE=OUTPUT_HANDSHAKE_ACK -DSLEEP_IDLE
+
+PROFILES += PrinterBusy
+PrinterBusy_OPTS = -DOUTPUT_PORT -DOUTPUT_HANDSHAKE=OUTPUT_HANDSHAKE_BUSY
+
+# Auto-repeat for the LK01, which strobes once however long a key is held,
+# on its own and paced by key ack, checked by scripts/repeat.txt.
+
+PROFILES += Repeat
+Repeat_OPTS = $(LK01_OPTS) -DAUTO_REPEAT
+
+PROFILES += RepeatAck
+RepeatAck_OPTS = $(LK01_OPTS) -DAUTO_REPEAT \
+  -DREADY_ACK_MODE=READY_ACK_MODE_KEY_ACK -DREADY_ACK_DELAY_MSEC=50